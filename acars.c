@@ -18,6 +18,8 @@
 #include <string.h>
 #include <math.h>
 #include "acarsdec.h"
+#include "metrics.h"
+#include "probes.h"
 
 #define SYN 0x16
 #define SOH 0x01
@@ -26,6 +28,10 @@
 #define ETB 0x97
 #define DLE 0x7f
 
+/* "+*" bit sync then SYN SYN, lsb first : the sequence preceding SOH */
+#define SYNPAT 0x16162aabU
+#define MAXSYNERR 2
+
 /* message queue */
 static pthread_mutex_t blkq_mtx;
 static pthread_cond_t blkq_wcd;
@@ -36,14 +42,14 @@ static int acars_shutdown;
 
 #include "syndrom.h"
 
-static int fixprerr(msgblk_t * blk, const unsigned short crc, int *pr, int pn)
+static int fixprerr(msgblk_t * blk, const unsigned short crc, int *pr, int pn, int *nt)
 {
 	int i;
 
 	if (pn > 0) {
 		/* try to recursievly fix parity error */
 		for (i = 0; i < 8; i++) {
-			if (fixprerr(blk, crc ^ syndrom[i + 8 * (blk->len - *pr + 1)], pr + 1, pn - 1)) {
+			if (fixprerr(blk, crc ^ syndrom[i + 8 * (blk->len - *pr + 1)], pr + 1, pn - 1, nt)) {
 				blk->txt[*pr] ^= (1 << i);
 				return 1;
 			}
@@ -51,6 +57,7 @@ static int fixprerr(msgblk_t * blk, const unsigned short crc, int *pr, int pn)
 		return 0;
 	} else {
 		/* end of recursion : no more parity error */
+		(*nt)++;
 		if (crc == 0)
 			return 1;
 
@@ -63,7 +70,7 @@ static int fixprerr(msgblk_t * blk, const unsigned short crc, int *pr, int pn)
 	}
 }
 
-static int fixdberr(msgblk_t * blk, const unsigned short crc)
+static int fixdberr(msgblk_t * blk, const unsigned short crc, int *nt)
 {
 	int i,j,k;
 
@@ -79,6 +86,7 @@ static int fixdberr(msgblk_t * blk, const unsigned short crc)
 	  for (i = 0; i < 8; i++)
 	   for (j = 0; j < 8; j++) {
 		   if(i==j) continue;
+		   (*nt)++;
 		   if((crc^syndrom[i+bo]^syndrom[j+bo])==0) {
 			   blk->txt[k] ^= (1 << i);
 			   blk->txt[k] ^= (1 << j);
@@ -90,13 +98,125 @@ static int fixdberr(msgblk_t * blk, const unsigned short crc)
 }
 
 #define MAXPERR 3
+static int checkAcars(msgblk_t * blk, int *nt)
+{
+	int i, pn;
+	unsigned short crc;
+	int pr[MAXPERR];
+
+	/* handle message */
+	if (blk->len < 13) {
+		if (verbose)
+			fprintf(stderr, "#%d too short\n", blk->chn + 1);
+		METRIC_INC(metrics.ch[blk->chn].unfixed);
+		return -1;
+	}
+
+	/* force STX/ETX */
+	blk->txt[12] &= (ETX | STX);
+	blk->txt[12] |= (ETX & STX);
+
+	/* parity check */
+	pn = 0;
+	for (i = 0; i < blk->len; i++) {
+		if ((numbits[(unsigned char)(blk->txt[i])] & 1) == 0) {
+			if (pn < MAXPERR) {
+				pr[pn] = i;
+			}
+			pn++;
+		}
+	}
+	if (pn > 0)
+		METRIC_INC(metrics.ch[blk->chn].parity);
+	if (pn > MAXPERR) {
+		if (verbose)
+			fprintf(stderr,
+				"#%d too many parity errors: %d\n",
+				blk->chn + 1, pn);
+		METRIC_INC(metrics.ch[blk->chn].unfixed);
+		return -1;
+	}
+	if (pn > 0 && verbose)
+		fprintf(stderr, "#%d parity error(s): %d\n",
+			blk->chn + 1, pn);
+	blk->err = pn;
+
+	/* crc check */
+	crc = 0;
+	for (i = 0; i < blk->len; i++) {
+		update_crc(crc, blk->txt[i]);
+
+	}
+	update_crc(crc, blk->crc[0]);
+	update_crc(crc, blk->crc[1]);
+	if (crc) {
+		METRIC_INC(metrics.ch[blk->chn].crc);
+		if (verbose)
+			fprintf(stderr, "#%d crc error\n", blk->chn + 1);
+	}
+
+	/* try to fix error */
+	if(pn) {
+	  if (fixprerr(blk, crc, pr, pn, nt) == 0) {
+		if (verbose)
+			fprintf(stderr, "#%d not able to fix errors\n", blk->chn + 1);
+		METRIC_INC(metrics.ch[blk->chn].unfixed);
+		return -1;
+	  }
+		if (verbose)
+			fprintf(stderr, "#%d errors fixed\n", blk->chn + 1);
+	} else {
+	
+
+	  if (crc) {
+		 if(fixdberr(blk, crc, nt) == 0) {
+			if (verbose)
+				fprintf(stderr, "#%d not able to fix errors\n", blk->chn + 1);
+			METRIC_INC(metrics.ch[blk->chn].unfixed);
+			return -1;
+	  	}
+	  	if (verbose)
+			fprintf(stderr, "#%d errors fixed\n", blk->chn + 1);
+	  }
+	}
+
+	/* redo parity checking and removing */
+	pn = 0;
+	for (i = 0; i < blk->len; i++) {
+		if ((numbits[(unsigned char)(blk->txt[i])] & 1) == 0) {
+			pn++;
+		}
+		blk->txt[i] &= 0x7f;
+	}
+	if (pn) {
+		fprintf(stderr, "#%d parity check problem\n",
+			blk->chn + 1);
+		METRIC_INC(metrics.ch[blk->chn].unfixed);
+		return -1;
+	}
+
+	if (blk->err || crc)
+		METRIC_INC(metrics.ch[blk->chn].fixed);
+	return 0;
+}
+
+/* check and try to correct a raw block, return 0 if it could be validated */
+int fixAcars(msgblk_t * blk)
+{
+	int nt = 0;
+	int res;
+
+	res = checkAcars(blk, &nt);
+	PROBE4(acars_fix, blk->chn, res, blk->err, nt);
+	return res;
+}
+
 static void *blk_thread(void *arg)
 {
+	stageThread(STAGE_OUTPUT, "acarsdec-out");
 	do {
 		msgblk_t *blk;
-		int i, pn;
-		unsigned short crc;
-		int pr[MAXPERR];
+		unsigned long long tsdeq;
 
 		if (verbose)
 			fprintf(stderr, "blk_starting\n");
@@ -106,7 +226,8 @@ static void *blk_thread(void *arg)
 		while ((blkq_e == NULL) && !acars_shutdown)
 			pthread_cond_wait(&blkq_wcd, &blkq_mtx);
 
-		if (acars_shutdown) {
+		/* on shutdown, exit once the queue is drained */
+		if (blkq_e == NULL) {
 			pthread_mutex_unlock(&blkq_mtx);
 			break;
 		}
@@ -115,99 +236,31 @@ static void *blk_thread(void *arg)
 		blkq_e = blk->prev;
 		if (blkq_e == NULL)
 			blkq_s = NULL;
+		METRIC_DEC(metrics.blkqdepth);
 		pthread_mutex_unlock(&blkq_mtx);
 
 		if (verbose)
 			fprintf(stderr, "get message #%d\n", blk->chn + 1);
 
-		/* handle message */
-		if (blk->len < 13) {
-			if (verbose)
-				fprintf(stderr, "#%d too short\n", blk->chn + 1);
-			free(blk);
-			continue;
-		}
+		/* keep the raw block before any correction */
+		if (capfilename)
+			Frmcapwrite(blk);
 
-		/* force STX/ETX */
-		blk->txt[12] &= (ETX | STX);
-		blk->txt[12] |= (ETX & STX);
+		tsdeq = monotonic_us();
+		latency(LAT_QUEUE, blk->tsfrm, tsdeq);
 
-		/* parity check */
-		pn = 0;
-		for (i = 0; i < blk->len; i++) {
-			if ((numbits[(unsigned char)(blk->txt[i])] & 1) == 0) {
-				if (pn < MAXPERR) {
-					pr[pn] = i;
-				}
-				pn++;
-			}
-		}
-		if (pn > MAXPERR) {
-			if (verbose)
-				fprintf(stderr,
-					"#%d too many parity errors: %d\n",
-					blk->chn + 1, pn);
-			free(blk);
-			continue;
-		}
-		if (pn > 0 && verbose)
-			fprintf(stderr, "#%d parity error(s): %d\n",
-				blk->chn + 1, pn);
-		blk->err = pn;
-
-		/* crc check */
-		crc = 0;
-		for (i = 0; i < blk->len; i++) {
-			update_crc(crc, blk->txt[i]);
-
-		}
-		update_crc(crc, blk->crc[0]);
-		update_crc(crc, blk->crc[1]);
-		if (crc && verbose)
-			fprintf(stderr, "#%d crc error\n", blk->chn + 1);
+		if (fixAcars(blk) == 0) {
+			unsigned long long tsfix = monotonic_us(), tsout;
 
-		/* try to fix error */
-		if(pn) {
-		  if (fixprerr(blk, crc, pr, pn) == 0) {
-			if (verbose)
-				fprintf(stderr, "#%d not able to fix errors\n", blk->chn + 1);
-			free(blk);
-			continue;
-		  }
-			if (verbose)
-				fprintf(stderr, "#%d errors fixed\n", blk->chn + 1);
-		} else {
-		
-
-		  if (crc) {
-			 if(fixdberr(blk, crc) == 0) {
-				if (verbose)
-					fprintf(stderr, "#%d not able to fix errors\n", blk->chn + 1);
-				free(blk);
-				continue;
-		  	}
-		  	if (verbose)
-				fprintf(stderr, "#%d errors fixed\n", blk->chn + 1);
-		  }
+			if (autoPpm)
+				ppmSample(blk);
+			latency(LAT_FIX, tsdeq, tsfix);
+			outputmsg(blk);
+			tsout = monotonic_us();
+			latency(LAT_OUTPUT, tsfix, tsout);
+			latency(LAT_TOTAL, blk->tsin, tsout);
 		}
 
-		/* redo parity checking and removing */
-		pn = 0;
-		for (i = 0; i < blk->len; i++) {
-			if ((numbits[(unsigned char)(blk->txt[i])] & 1) == 0) {
-				pn++;
-			}
-			blk->txt[i] &= 0x7f;
-		}
-		if (pn) {
-			fprintf(stderr, "#%d parity check problem\n",
-				blk->chn + 1);
-			free(blk);
-			continue;
-		}
-
-		outputmsg(blk);
-
 		free(blk);
 
 	} while (1);
@@ -229,6 +282,7 @@ int initAcars(channel_t * ch)
 
 	ch->outbits = 0;
 	ch->nbits = 8;
+	ch->synreg = 0;
 	ch->Acarsstate = WSYN;
 
 	ch->blk = NULL;
@@ -236,11 +290,18 @@ int initAcars(channel_t * ch)
 	return 0;
 }
 
-static void resetAcars(channel_t * ch)
+static inline void newstate(channel_t * ch, int state)
 {
-	ch->Acarsstate = WSYN;
+	ch->Acarsstate = state;
+	PROBE2(acars_state, ch->chn, state);
+}
+
+void resetAcars(channel_t * ch)
+{
+	newstate(ch, WSYN);
 	ch->MskDf = 0;
 	ch->nbits = 1;
+	ch->synreg = 0;
 }
 
 void decodeAcars(channel_t * ch)
@@ -250,36 +311,32 @@ void decodeAcars(channel_t * ch)
 	switch (ch->Acarsstate) {
 
 	case WSYN:
-		if (r == SYN) {
-			ch->Acarsstate = SYN2;
+		/*
+		 * correlate the last 32 bits with the sync sequence : a SYN SYN alone
+		 * or the whole sequence with up to MAXSYNERR wrong bits, in either polarity
+		 */
+		ch->synreg = (ch->synreg >> 1) | ((unsigned int)(r & 0x80) << 24);
+		if ((ch->synreg >> 16) == (SYNPAT >> 16) ||
+		    __builtin_popcount(ch->synreg ^ SYNPAT) <= MAXSYNERR) {
+			METRIC_INC(metrics.ch[ch->chn].syn);
+			newstate(ch, SOH1);
 			ch->nbits = 8;
 			return;
 		}
-		if (r == (unsigned char)~SYN) {
+		if ((~ch->synreg >> 16) == (SYNPAT >> 16) ||
+		    __builtin_popcount(~ch->synreg ^ SYNPAT) <= MAXSYNERR) {
 			ch->MskS ^= 2;
-			ch->Acarsstate = SYN2;
+			METRIC_INC(metrics.ch[ch->chn].syn);
+			newstate(ch, SOH1);
 			ch->nbits = 8;
 			return;
 		}
 		ch->nbits = 1;
 		return;
 
-	case SYN2:
-		if (r == SYN) {
-			ch->Acarsstate = SOH1;
-			ch->nbits = 8;
-			return;
-		}
-		if (r == (unsigned char)~SYN) {
-			ch->MskS ^= 2;
-			ch->nbits = 8;
-			return;
-		}
-		resetAcars(ch);
-		return;
-
 	case SOH1:
 		if (r == SOH) {
+			METRIC_INC(metrics.ch[ch->chn].soh);
 			if(ch->blk == NULL) {
 				ch->blk = malloc(sizeof(msgblk_t));
 				if(ch->blk == NULL) {
@@ -287,8 +344,15 @@ void decodeAcars(channel_t * ch)
 					return;
 				}
 			}
-			gettimeofday(&(ch->blk->tv), NULL);
-			ch->Acarsstate = TXT;
+			if (ch->batch) {
+				/* recorded samples : time from the sample clock */
+				unsigned long long us = ch->smpcnt * 1000000ULL / INTRATE + ch->tvbase.tv_usec;
+
+				ch->blk->tv.tv_sec = ch->tvbase.tv_sec + us / 1000000;
+				ch->blk->tv.tv_usec = us % 1000000;
+			} else
+				gettimeofday(&(ch->blk->tv), NULL);
+			newstate(ch, TXT);
 			ch->blk->chn = ch->chn;
 			ch->blk->len = 0;
 			ch->blk->err = 0;
@@ -317,7 +381,7 @@ void decodeAcars(channel_t * ch)
 			}
 		}
 		if (r == ETX || r == ETB) {
-			ch->Acarsstate = CRC1;
+			newstate(ch, CRC1);
 			ch->nbits = 8;
 			return;
 		}
@@ -328,7 +392,7 @@ void decodeAcars(channel_t * ch)
 			ch->blk->len -= 3;
 			ch->blk->crc[0] = ch->blk->txt[ch->blk->len];
 			ch->blk->crc[1] = ch->blk->txt[ch->blk->len + 1];
-			ch->Acarsstate = CRC2;
+			newstate(ch, CRC2);
 			goto putmsg_lbl;
 		}
 		if (ch->blk->len > 240) {
@@ -342,17 +406,47 @@ void decodeAcars(channel_t * ch)
 
 	case CRC1:
 		ch->blk->crc[0] = r;
-		ch->Acarsstate = CRC2;
+		newstate(ch, CRC2);
 		ch->nbits = 8;
 		return;
 	case CRC2:
 		ch->blk->crc[1] = r;
  putmsg_lbl:
 		ch->blk->lvl = 10*log10(ch->MskLvlSum / ch->MskBitCount);
+		if (autoPpm)
+			ppmTag(ch->blk);
+		if (surveyBand) {
+			unsigned short crc = 0;
+			int i;
+
+			for (i = 0; i < ch->blk->len; i++)
+				update_crc(crc, ch->blk->txt[i]);
+			update_crc(crc, ch->blk->crc[0]);
+			update_crc(crc, ch->blk->crc[1]);
+			surveyFrame(ch->chn, crc == 0);
+		}
+		METRIC_INC(metrics.ch[ch->chn].queued);
+		PROBE3(acars_frame, ch->chn, ch->blk->len, ch->blk->err);
+		METRIC_ADD(metrics.ch[ch->chn].lvlsum, (long)(ch->blk->lvl * 10));
 
 		if (verbose)
 			fprintf(stderr, "put message #%d\n", ch->chn + 1);
 
+		if (ch->batch) {
+			/* kept by the batch worker owning this channel */
+			ch->blk->tsin = 0;
+			ch->blk->prev = ch->blkl;
+			ch->blkl = ch->blk;
+			ch->blk = NULL;
+			newstate(ch, END);
+			ch->nbits = 8;
+			return;
+		}
+
+		ch->blk->tsin = METRIC_GET(metrics.inputts);
+		ch->blk->tsfrm = monotonic_us();
+		latency(LAT_DEMOD, ch->blk->tsin, ch->blk->tsfrm);
+
 		pthread_mutex_lock(&blkq_mtx);
 		ch->blk->prev = NULL;
 		if (blkq_s)
@@ -360,11 +454,13 @@ void decodeAcars(channel_t * ch)
 		blkq_s = ch->blk;
 		if (blkq_e == NULL)
 			blkq_e = blkq_s;
+		if (METRIC_INC(metrics.blkqdepth) > metrics.blkqmax)
+			metrics.blkqmax = metrics.blkqdepth;
 		pthread_cond_signal(&blkq_wcd);
 		pthread_mutex_unlock(&blkq_mtx);
 
 		ch->blk=NULL;
-		ch->Acarsstate = END;
+		newstate(ch, END);
 		ch->nbits = 8;
 		return;
 	case END:
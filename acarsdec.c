@@ -25,11 +25,17 @@
 #include <sched.h>
 #include <unistd.h>
 #include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/mman.h>
 #ifdef HAVE_LIBACARS
 #include <libacars/version.h>
 #endif
 #include "acarsdec.h"
+#include "metrics.h"
 extern void build_label_filter(char *arg);
+extern void Binoutclose(void);
 
 channel_t channel[MAXNBCHANNELS];
 unsigned int nbch;
@@ -44,6 +50,37 @@ int emptymsg = 0;
 int mdly=600;
 int hourly = 0;
 int daily = 0;
+char *arcfilename = NULL;
+time_t arcsince = 0;
+time_t arcuntil = 0;
+char *arctail = NULL;
+char *capfilename = NULL;
+int rawFormat = RAWFMT_U8;
+int rawMult = 160;
+int rawRealtime = 0;
+char *iqrecprefix = NULL;
+size_t iqrecMaxSize = 0;
+int iqrecMaxTime = 0;
+#ifdef WITH_SNDFILE
+char *bbprefix = NULL;
+int bbFormat = BBFMT_FLOAT;
+int batchSegment = 600;
+#endif
+char *metricsfile = NULL;
+int metricsport = 0;
+int metricsInterval = 10;
+int squelch = 0;
+int demodEngine = DEMOD_SCALAR;
+int chanFilter = CHANFLT_BOXCAR;
+int amDetector = AMDET_ENVELOPE;
+int afc = 0;
+int autoPpm = 0;
+char *surveyBand = NULL;
+int surveyTime = 60;
+int surveyBest = 0;
+int hopDwell = 0;
+char *controlpath = NULL;
+static int memLock = 0;
 
 int signalExit = 0;
 
@@ -54,7 +91,7 @@ int skip_reassembly = 0;
 #ifdef WITH_RTL
 int gain = -100;
 int ppm = 0;
-int rtlMult = 160;
+int rtlMult = 0;
 #endif
 
 #ifdef WITH_AIR
@@ -70,7 +107,7 @@ int	ppm		= 0;
 char *antenna=NULL;
 double gain = -10.0;
 int ppm = 0;
-int rateMult = 160;
+int rateMult = 0;
 int freq = 0;
 #endif
 
@@ -85,6 +122,54 @@ char *mqtt_passwd=NULL;
 char *Rawaddr = NULL;
 char *logfilename = NULL;
 
+static const char shortopts[] = "HDvarfdsRo:t:g:m:Aep:n:N:j:l:c:i:L:G:b:M:P:U:T:";
+static const struct option long_opts[] = {
+	{ "verbose", no_argument, NULL, 'v' },
+	{ "skip-reassembly", no_argument, NULL, 1 },
+#ifdef WITH_SOAPY
+	{ "antenna", required_argument, NULL, 2},
+#endif
+	{ "archive", required_argument, NULL, 3},
+	{ "replay", no_argument, NULL, 4},
+	{ "since", required_argument, NULL, 5},
+	{ "until", required_argument, NULL, 6},
+	{ "tail", required_argument, NULL, 7},
+	{ "capture", required_argument, NULL, 8},
+	{ "redecode", no_argument, NULL, 9},
+	{ "iq-format", required_argument, NULL, 10},
+	{ "iq-mult", required_argument, NULL, 11},
+	{ "iq-realtime", no_argument, NULL, 12},
+	{ "iq-record", required_argument, NULL, 13},
+	{ "iq-record-size", required_argument, NULL, 14},
+	{ "iq-record-time", required_argument, NULL, 15},
+#ifdef WITH_SNDFILE
+	{ "bb-record", required_argument, NULL, 16},
+	{ "bb-format", required_argument, NULL, 17},
+	{ "batch", no_argument, NULL, 18},
+	{ "batch-segment", required_argument, NULL, 19},
+#endif
+	{ "metrics-file", required_argument, NULL, 20},
+	{ "metrics-port", required_argument, NULL, 21},
+	{ "metrics-interval", required_argument, NULL, 22},
+	{ "squelch", required_argument, NULL, 23},
+	{ "demod", required_argument, NULL, 24},
+	{ "chan-filter", required_argument, NULL, 25},
+	{ "am", required_argument, NULL, 26},
+	{ "afc", no_argument, NULL, 27},
+	{ "auto-ppm", no_argument, NULL, 28},
+	{ "survey", required_argument, NULL, 29},
+	{ "survey-time", required_argument, NULL, 30},
+	{ "survey-best", required_argument, NULL, 31},
+	{ "hop", required_argument, NULL, 32},
+	{ "control", required_argument, NULL, 33},
+	{ "config", required_argument, NULL, 34},
+	{ "cpu", required_argument, NULL, 35},
+	{ "rt", required_argument, NULL, 36},
+	{ "nice", required_argument, NULL, 37},
+	{ "mlock", no_argument, NULL, 38},
+	{ NULL, 0, NULL, 0 }
+};
+
 static void usage(void)
 {
 	fprintf(stderr,
@@ -96,6 +181,11 @@ static void usage(void)
 		"\nUsage: acarsdec  [-o lv] [-t time] [-A] [-b 'labels,..'] [-e] [-i station_id] [-n|-j|-N ipaddr:port] [-l logfile [-H|-D]]");
 #ifdef HAVE_LIBACARS
 	fprintf(stderr, " [--skip-reassembly] ");
+#endif
+	fprintf(stderr, " [--archive file] [--capture file]");
+	fprintf(stderr, " [--metrics-file file] [--metrics-port port] [--metrics-interval s] [--squelch dB] [--demod scalar|soa] [--chan-filter boxcar|halfband] [--am envelope|coherent|coherent-dc] [--afc] [--auto-ppm] [--survey f1:f2[:step] [--survey-time s] [--survey-best N]] [--hop ms] [--control path] [--config file] [--cpu stage:cpus] [--rt stage:prio] [--nice stage:n] [--mlock]");
+#if defined(WITH_RTL) || defined(WITH_SOAPY)
+	fprintf(stderr, " [--iq-record prefix [--iq-record-size MB] [--iq-record-time s]]");
 #endif
 #ifdef WITH_MQTT
 	fprintf(stderr, " [ -M mqtt_url");
@@ -103,11 +193,15 @@ static void usage(void)
 	fprintf(stderr, " [-U mqtt_user |");
 	fprintf(stderr, " -P mqtt_passwd]]|");
 #endif
+	fprintf(stderr, " --replay archivefile [..] |");
+	fprintf(stderr, " --redecode capturefile [..] |");
+	fprintf(stderr, " [--iq-format u8|cs16|cf32] [--iq-mult mult] [--iq-realtime] -R iqfile fc f1 [f2] .. [fN] |");
 #ifdef WITH_ALSA
 	fprintf(stderr, " -a alsapcmdevice  |");
 #endif
 #ifdef WITH_SNDFILE
 	fprintf(stderr, " -f inputwavfile  |");
+	fprintf(stderr, " [--batch-segment s] --batch wavfile [..] |");
 #endif
 #ifdef WITH_RTL
 	fprintf(stderr,
@@ -145,6 +239,56 @@ static void usage(void)
 		" -H\t\t\t: rotate log file once every hour\n");
 	fprintf(stderr,
 		" -D\t\t\t: rotate log file once every day\n");
+	fprintf(stderr,
+		" --archive file\t\t: append messages to a binary archive file (rotated as the log file with -H or -D)\n");
+	fprintf(stderr,
+		" --capture file\t\t: append every received frame, before error correction, to a capture file\n");
+	fprintf(stderr,
+		" --metrics-file file\t: periodically write decoding and output counters to file in prometheus text format\n");
+	fprintf(stderr,
+		" --metrics-port port\t: serve the same counters over http on localhost:port\n");
+	fprintf(stderr,
+		" --metrics-interval s\t: metrics file update interval in seconds (default 10)\n");
+	fprintf(stderr,
+		" --squelch dB\t\t: only demodulate channels when their signal is dB above the noise floor (ie: 6)\n");
+	fprintf(stderr,
+		" --demod soa\t\t: demodulate all channels together with vector instructions (rtl, soapy, -R and -f inputs)\n");
+	fprintf(stderr,
+		" --chan-filter halfband\t: more selective but slower channel decimation filter (rtl, soapy and -R inputs)\n");
+	fprintf(stderr,
+		" --am coherent\t\t: carrier tracking AM demodulation (rtl, soapy and -R inputs), or per channel with freq:c\n");
+	fprintf(stderr,
+		" --afc\t\t\t: follow the carrier offset of each channel (rtl, soapy and -R inputs)\n");
+	fprintf(stderr,
+		" --auto-ppm\t\t: estimate the tuner frequency error from the decoded messages and correct it (rtl and soapy inputs)\n");
+	fprintf(stderr,
+		" --survey f1:f2[:step]\t: before -r, -d or -R, survey the channels from f1 to f2 MHz every step kHz (25 or 8.33, default 25) instead of decoding given frequencies, and print a ranked channel plan\n");
+	fprintf(stderr,
+		" --survey-time s\t: survey time of each tuning, in seconds (default 60)\n");
+	fprintf(stderr,
+		" --survey-best N\t: after the survey, go on decoding the N best channels\n");
+	fprintf(stderr,
+		" --hop ms\t\t: before -r or -d, cycle the tuner between groups of channels too far apart for one tuning, about ms milliseconds per group\n");
+	fprintf(stderr,
+		" --control path\t\t: add, remove or retune channels, change the gain, the label filter and the network output at runtime through the unix socket path (rtl, soapy and -R inputs)\n");
+	fprintf(stderr,
+		" --config file\t\t: read options from file, as on the command line. SIGHUP reloads its output options (-o -t -b -A -e -i -l -H -D -n -N -j)\n");
+	fprintf(stderr,
+		" --cpu stage:cpus\t: run the threads of stage (input, output or aux) on cpus (ie : input:2 or aux:0,1-3)\n");
+	fprintf(stderr,
+		" --rt stage:prio\t: run the threads of stage with the SCHED_FIFO real time priority prio (1 to 99)\n");
+	fprintf(stderr,
+		" --nice stage:n\t\t: set the nice value of the threads of stage (-20 to 19)\n");
+	fprintf(stderr,
+		" --mlock\t\t: lock acarsdec memory in RAM, so that it is never paged out\n");
+#if defined(WITH_RTL) || defined(WITH_SOAPY)
+	fprintf(stderr,
+		" --iq-record prefix\t: record rtl or soapy samples to prefix_date.ext files, SIGUSR1 stops/restarts recording\n");
+	fprintf(stderr,
+		" --iq-record-size MB\t: start a new IQ record file every MB megabytes\n");
+	fprintf(stderr,
+		" --iq-record-time s\t: start a new IQ record file every s seconds\n");
+#endif
 	fprintf(stderr, "\n");
 	fprintf(stderr,
 		" -n ipaddr:port\t\t: send acars messages to addr:port on UDP in planeplotter compatible format\n");
@@ -160,6 +304,22 @@ static void usage(void)
 #endif
 	fprintf(stderr, "\n");
 
+	fprintf(stderr,
+		" --replay archivefile [..]\t: output messages stored in binary archive files instead of decoding\n");
+	fprintf(stderr,
+		" --since t, --until t\t: only replay messages received between t and t (seconds since epoch)\n");
+	fprintf(stderr,
+		" --tail reg\t\t: only replay messages from aircraft registration reg\n");
+	fprintf(stderr,
+		" --redecode capturefile [..]\t: correct and output frames saved with --capture instead of decoding\n");
+	fprintf(stderr,
+		" -R iqfile fc f1 [f2]...[f%d]\t: decode IQ samples from iqfile (- for stdin) recorded at center frequency fc, on VHF frequencies f1 and optionally f2 to f%d in Mhz (ie : -R rec.iq 131.0 131.525 131.725)\n", MAXNBCHANNELS, MAXNBCHANNELS);
+	fprintf(stderr,
+		" --iq-format fmt\t: raw IQ sample format : u8 (rtl_sdr, default), cs16 or cf32\n");
+	fprintf(stderr,
+		" --iq-mult mult\t\t: raw IQ sample rate multiplier, sample rate is mult*%d (default: 160 for 2 MS/s)\n", INTRATE);
+	fprintf(stderr,
+		" --iq-realtime\t\t: read raw IQ samples at their real time rate instead of as fast as possible\n");
 #ifdef WITH_ALSA
 	fprintf(stderr,
 		" -a alsapcmdevice\t: decode from soundcard input alsapcmdevice (ie: hw:0,0)\n");
@@ -167,12 +327,20 @@ static void usage(void)
 #ifdef WITH_SNDFILE
 	fprintf(stderr,
 		" -f inputwavfile\t: decode from a wav file at %d sampling rate\n",INTRATE);
+	fprintf(stderr,
+		" --bb-record prefix\t: record the %d samples/s baseband of each channel to prefix_freq.wav files, readable with -f\n",INTRATE);
+	fprintf(stderr,
+		" --bb-format fmt\t: baseband record sample format : float (default) or pcm16\n");
+	fprintf(stderr,
+		" --batch wavfile [..]\t: decode many wav files in parallel on all cpu cores, output in time order\n");
+	fprintf(stderr,
+		" --batch-segment s\t: split batch files in segments of s seconds decoded in parallel (default 600, 0 : whole files)\n");
 #endif
 #ifdef WITH_RTL
 	fprintf(stderr,
 		" -g gain\t\t: set rtl gain in db (0 to 49.6; >52 and -10 will result in AGC; default is AGC)\n");
 	fprintf(stderr, " -p ppm\t\t\t: set rtl ppm frequency correction\n");
-	fprintf(stderr, " -m rtlMult\t\t\t: set rtl sample rate multiplier: 160 for 2 MS/s or 192 for 2.4 MS/s (default: 160)\n");
+	fprintf(stderr, " -m rtlMult\t\t\t: set rtl sample rate multiplier: 160 for 2 MS/s or 192 for 2.4 MS/s (default: the lowest where the frequencies fit)\n");
 	fprintf(stderr,
 		" -r rtldevice f1 [f2]...[f%d]\t: decode from rtl dongle number or S/N rtldevice receiving at VHF frequencies f1 and optionally f2 to f%d in Mhz (ie : -r 0 131.525 131.725 131.825 )\n", MAXNBCHANNELS, MAXNBCHANNELS);
 #endif
@@ -195,7 +363,7 @@ static void usage(void)
 		" -g gain\t\t: set gain in db (-10 will result in AGC; default is AGC)\n");
 	fprintf(stderr, " -p ppm\t\t\t: set ppm frequency correction\n");
 	fprintf(stderr, " c freq\t\t\t: set center frequency to tune to\n");
-	fprintf(stderr, " -m rateMult\t\t\t: set sample rate multiplier: 160 for 2 MS/s or 192 for 2.4 MS/s (default: 160)\n");
+	fprintf(stderr, " -m rateMult\t\t\t: set sample rate multiplier: 160 for 2 MS/s or 192 for 2.4 MS/s (default: the lowest where the frequencies fit)\n");
 	fprintf (stderr,
 		" -d devicestring f1 [f2] .. [f%d]\t: decode from a SoapySDR device located by devicestring at VHF frequencies f1 and optionally f2 to f%d in Mhz (ie : -d driver=rtltcp 131.525 131.725 131.825 )\n", MAXNBCHANNELS, MAXNBCHANNELS);
 #endif
@@ -211,29 +379,256 @@ static void sigintHandler(int signum)
 #ifdef DEBUG
 	SndWriteClose();
 #endif
-#ifdef WITH_RTL
+	/* every input stops on it, so that the outputs and recordings are closed */
 	signalExit = 1;
-	runRtlCancel();
-#elif WITH_SOAPY
-	signalExit = 1;
-#else
-	exit(0);
+#ifdef WITH_RTL
+	if (inmode == 3)
+		runRtlCancel();
 #endif
 }
 
+static void sigusr1Handler(int signum)
+{
+	iqrecActive = !iqrecActive;
+}
+
+/*
+ * --config file : the options of file, written as on the command line, one or more per line
+ * ('#' starts a comment, "" quote a value with spaces), are read in place of --config file.
+ * On SIGHUP, the file is read again and the output options (-o -t -b -A -e -i -l -H -D -n -N -j)
+ * are applied together, without stopping the decoding. The other ones need a restart.
+ */
+static char *configfile = NULL;
+static int cmdargc, cfgpos, cfglen;
+static char **cmdargv;
+static sem_t hupsem;
+
+static int addarg(int *argc, char ***argv, const char *arg)
+{
+	char **nargv = realloc(*argv, (*argc + 2) * sizeof(char *));
+
+	if (nargv == NULL)
+		return -1;
+	*argv = nargv;
+	if ((nargv[*argc] = strdup(arg)) == NULL)
+		return -1;
+	(*argc)++;
+	nargv[*argc] = NULL;
+	return 0;
+}
+
+static void freeargs(int argc, char **argv)
+{
+	int n;
+
+	for (n = 0; n < argc; n++)
+		free(argv[n]);
+	free(argv);
+}
+
+/* append the options of configfile to argv */
+static int readConfig(int *argc, char ***argv)
+{
+	FILE *fd;
+	char line[1024];
+	int lineno = 0;
+
+	fd = fopen(configfile, "r");
+	if (fd == NULL) {
+		fprintf(stderr, "Could not open config file %s: %s\n", configfile, strerror(errno));
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fd)) {
+		char *p = line, *arg;
+
+		lineno++;
+		for (;;) {
+			while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+				p++;
+			if (*p == '\0' || *p == '#')
+				break;
+			if (*p == '"') {
+				arg = ++p;
+				while (*p && *p != '"')
+					p++;
+				if (*p == '\0') {
+					fprintf(stderr, "%s:%d: missing \"\n", configfile, lineno);
+					fclose(fd);
+					return -1;
+				}
+			} else {
+				arg = p;
+				while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+					p++;
+			}
+			if (*p)
+				*p++ = '\0';
+			if (addarg(argc, argv, arg)) {
+				fprintf(stderr, "ERROR : malloc\n");
+				fclose(fd);
+				return -1;
+			}
+		}
+	}
+	fclose(fd);
+	return 0;
+}
+
+/* the command line, with the options of the config file in place of --config file */
+static int expandConfig(int *argc, char ***argv)
+{
+	int n;
+
+	*argc = 0;
+	*argv = NULL;
+	for (n = 0; n < cmdargc; n++) {
+		if (n == cfgpos) {
+			if (readConfig(argc, argv))
+				return -1;
+			n += cfglen - 1;
+		} else if (addarg(argc, argv, cmdargv[n])) {
+			fprintf(stderr, "ERROR : malloc\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* find --config file in the command line, and read it */
+static void initConfig(int *argc, char ***argv)
+{
+	int n;
+
+	for (n = 1; n < *argc; n++) {
+		if (strcmp((*argv)[n], "--config") == 0 && n + 1 < *argc) {
+			configfile = (*argv)[n + 1];
+			cfglen = 2;
+			break;
+		}
+		if (strncmp((*argv)[n], "--config=", 9) == 0) {
+			configfile = (*argv)[n] + 9;
+			cfglen = 1;
+			break;
+		}
+	}
+	if (configfile == NULL)
+		return;
+
+	cmdargc = *argc;
+	cmdargv = *argv;
+	cfgpos = n;
+	if (expandConfig(argc, argv))
+		exit(1);
+}
+
+/* SIGHUP : read the config file again, and apply its output options */
+static void reloadConfig(void)
+{
+	int argc, c, res = 0;
+	char **argv;
+	char sys_hostname[HOST_NAME_MAX+1];
+	outconf_t oc = { .outtype = OUTTYPE_STD, .netout = NETLOG_NONE, .mdly = 600 };
+
+	gethostname(sys_hostname, HOST_NAME_MAX);
+	sys_hostname[HOST_NAME_MAX] = 0;
+	oc.idstation = sys_hostname;
+
+	if (expandConfig(&argc, &argv)) {
+		fprintf(stderr, "Config file %s not reloaded\n", configfile);
+		freeargs(argc, argv);
+		return;
+	}
+
+	/* oc points to the strings of argv, outputReload copies what it keeps */
+	optind = 0;
+	while ((c = getopt_long(argc, argv, shortopts, long_opts, NULL)) != EOF) {
+		switch (c) {
+		case 'o':
+			oc.outtype = atoi(optarg);
+			break;
+		case 't':
+			oc.mdly = atoi(optarg);
+			break;
+		case 'b':
+			oc.lblf = optarg;
+			break;
+		case 'A':
+			oc.airflt = 1;
+			break;
+		case 'e':
+			oc.emptymsg = 1;
+			break;
+		case 'i':
+			oc.idstation = optarg;
+			break;
+		case 'l':
+			oc.logfilename = optarg;
+			break;
+		case 'H':
+			oc.hourly = 1;
+			break;
+		case 'D':
+			oc.daily = 1;
+			break;
+		case 'n':
+			oc.Rawaddr = optarg;
+			oc.netout = NETLOG_PLANEPLOTTER;
+			break;
+		case 'N':
+			oc.Rawaddr = optarg;
+			oc.netout = NETLOG_NATIVE;
+			break;
+		case 'j':
+			oc.Rawaddr = optarg;
+			oc.netout = NETLOG_JSON;
+			break;
+#ifdef WITH_MQTT
+		case 'M':
+			oc.netout = NETLOG_MQTT;
+			break;
+#endif
+		case '?':
+			res = 1;
+			break;
+		default:
+			/* input and decoding options, set at start */
+			break;
+		}
+	}
+
+	if (oc.hourly && oc.daily) {
+		fprintf(stderr, "Options: -H and -D are exclusive\n");
+		res = 1;
+	}
+	if (res)
+		fprintf(stderr, "Config file %s not reloaded\n", configfile);
+	else if (outputReload(&oc))
+		fprintf(stderr, "Config file %s reloaded, with errors\n", configfile);
+	else
+		fprintf(stderr, "Config file %s reloaded\n", configfile);
+	freeargs(argc, argv);
+}
+
+static void sighupHandler(int signum)
+{
+	sem_post(&hupsem);
+}
+
+static void *hup_thread(void *arg)
+{
+	stageThread(STAGE_AUX, "acarsdec-reload");
+	for (;;) {
+		if (sem_wait(&hupsem) == 0)
+			reloadConfig();
+	}
+	return NULL;
+}
+
 int main(int argc, char **argv)
 {
 	int c;
 	int res, n;
 	struct sigaction sigact;
-	struct option long_opts[] = {
-		{ "verbose", no_argument, NULL, 'v' },
-		{ "skip-reassembly", no_argument, NULL, 1 },
-#ifdef WITH_SOAPY
-		{ "antenna", required_argument, NULL, 2},
-#endif
-		{ NULL, 0, NULL, 0 }
-	};
 	char sys_hostname[HOST_NAME_MAX+1];
 	char *lblf=NULL;
 
@@ -241,8 +636,10 @@ int main(int argc, char **argv)
 	sys_hostname[HOST_NAME_MAX]=0;
 	idstation = strdup(sys_hostname);
 
+	initConfig(&argc, &argv);
+
 	res = 0;
-	while ((c = getopt_long(argc, argv, "HDvarfdsRo:t:g:m:Aep:n:N:j:l:c:i:L:G:b:M:P:U:T:", long_opts, NULL)) != EOF) {
+	while ((c = getopt_long(argc, argv, shortopts, long_opts, NULL)) != EOF) {
 
 		switch (c) {
 		case 'v':
@@ -384,6 +781,166 @@ int main(int argc, char **argv)
 			free(idstation);
 			idstation = strdup(optarg);
 			break;
+		case 3:
+			arcfilename = optarg;
+			break;
+		case 4:
+			res = initReplay(argv, optind);
+			inmode = 7;
+			break;
+		case 5:
+			arcsince = atol(optarg);
+			break;
+		case 6:
+			arcuntil = atol(optarg);
+			break;
+		case 7:
+			arctail = optarg;
+			break;
+		case 8:
+			capfilename = optarg;
+			break;
+		case 9:
+			res = initRedecode(argv, optind);
+			inmode = 8;
+			break;
+		case 'R':
+			res = initRaw(argv, optind);
+			inmode = 9;
+			break;
+		case 10:
+			if (strcmp(optarg, "cs16") == 0)
+				rawFormat = RAWFMT_CS16;
+			else if (strcmp(optarg, "cf32") == 0)
+				rawFormat = RAWFMT_CF32;
+			else if (strcmp(optarg, "u8") == 0)
+				rawFormat = RAWFMT_U8;
+			else
+				usage();
+			break;
+		case 11:
+			rawMult = atoi(optarg);
+			break;
+		case 12:
+			rawRealtime = 1;
+			break;
+		case 13:
+			iqrecprefix = optarg;
+			break;
+		case 14:
+			iqrecMaxSize = (size_t)atol(optarg) * 1024 * 1024;
+			break;
+		case 15:
+			iqrecMaxTime = atoi(optarg);
+			break;
+#ifdef WITH_SNDFILE
+		case 16:
+			bbprefix = optarg;
+			break;
+		case 17:
+			if (strcmp(optarg, "float") == 0)
+				bbFormat = BBFMT_FLOAT;
+			else if (strcmp(optarg, "pcm16") == 0)
+				bbFormat = BBFMT_PCM16;
+			else
+				usage();
+			break;
+		case 18:
+			res = initBatch(argv, optind);
+			inmode = 10;
+			break;
+		case 19:
+			batchSegment = atoi(optarg);
+			break;
+#endif
+		case 20:
+			metricsfile = optarg;
+			break;
+		case 21:
+			metricsport = atoi(optarg);
+			break;
+		case 22:
+			metricsInterval = atoi(optarg);
+			break;
+		case 23:
+			squelch = atoi(optarg);
+			if (squelch < 0)
+				usage();
+			break;
+		case 24:
+			if (strcmp(optarg, "soa") == 0)
+				demodEngine = DEMOD_SOA;
+			else if (strcmp(optarg, "scalar") == 0)
+				demodEngine = DEMOD_SCALAR;
+			else
+				usage();
+			break;
+		case 25:
+			if (strcmp(optarg, "halfband") == 0)
+				chanFilter = CHANFLT_HALFBAND;
+			else if (strcmp(optarg, "boxcar") == 0)
+				chanFilter = CHANFLT_BOXCAR;
+			else
+				usage();
+			break;
+		case 26:
+			amDetector = parseAmDetector(optarg);
+			if (amDetector < 0)
+				usage();
+			break;
+		case 27:
+			afc = 1;
+			break;
+		case 28:
+			autoPpm = 1;
+			break;
+		case 29:
+			if (inmode) {
+				fprintf(stderr, "--survey must be given before the input option\n");
+				exit(1);
+			}
+			surveyBand = optarg;
+			break;
+		case 30:
+			surveyTime = atoi(optarg);
+			if (surveyTime <= 0)
+				usage();
+			break;
+		case 31:
+			surveyBest = atoi(optarg);
+			if (surveyBest < 0)
+				usage();
+			break;
+		case 32:
+			if (inmode) {
+				fprintf(stderr, "--hop must be given before the input option\n");
+				exit(1);
+			}
+			hopDwell = atoi(optarg);
+			if (hopDwell <= 0)
+				usage();
+			break;
+		case 33:
+			controlpath = optarg;
+			break;
+		case 34:
+			fprintf(stderr, "--config can only be given once, and not in a config file\n");
+			exit(1);
+		case 35:
+			if (stageCpus(optarg))
+				usage();
+			break;
+		case 36:
+			if (stageRt(optarg))
+				usage();
+			break;
+		case 37:
+			if (stageNice(optarg))
+				usage();
+			break;
+		case 38:
+			memLock = 1;
+			break;
 
 		default:
 			usage();
@@ -391,7 +948,7 @@ int main(int argc, char **argv)
 	}
 
 	if (inmode == 0) {
-		fprintf(stderr, "Need at least one of -a|-f|-r|-R|-d options\n");
+		fprintf(stderr, "Need at least one of -a|-f|-r|-R|-d|--replay|--redecode options\n");
 		usage();
 	}
 
@@ -406,6 +963,51 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
+	if (surveyBand && inmode != 3 && inmode != 6 && inmode != 9) {
+		fprintf(stderr, "--survey is only available for rtl, soapy and -R inputs\n");
+		exit(1);
+	}
+
+	if (hopDwell && inmode != 3 && inmode != 6) {
+		fprintf(stderr, "--hop is only available for rtl and soapy inputs\n");
+		exit(1);
+	}
+
+	if (hopDwell && surveyBand) {
+		fprintf(stderr, "Options: --hop and --survey are exclusive\n");
+		exit(1);
+	}
+
+	if (hopDwell && demodEngine == DEMOD_SOA) {
+		fprintf(stderr, "Options: --hop and --demod soa are exclusive\n");
+		exit(1);
+	}
+
+	if (surveyBand && demodEngine == DEMOD_SOA) {
+		fprintf(stderr, "Options: --survey and --demod soa are exclusive\n");
+		exit(1);
+	}
+
+	if (controlpath && inmode != 3 && inmode != 6 && inmode != 9) {
+		fprintf(stderr, "--control is only available for rtl, soapy and -R inputs\n");
+		exit(1);
+	}
+
+	if (controlpath && (hopDwell || surveyBand || demodEngine == DEMOD_SOA)) {
+		fprintf(stderr, "Options: --control is exclusive with --hop, --survey and --demod soa\n");
+		exit(1);
+	}
+
+	if (autoPpm && inmode != 3 && inmode != 6) {
+		fprintf(stderr, "--auto-ppm is only available for rtl and soapy inputs\n");
+		exit(1);
+	}
+
+	if (squelch && demodEngine == DEMOD_SOA) {
+		fprintf(stderr, "Options: --squelch and --demod soa are exclusive\n");
+		exit(1);
+	}
+
 	build_label_filter(lblf);
 
 	res = initOutput(logfilename, Rawaddr);
@@ -414,6 +1016,57 @@ int main(int argc, char **argv)
 		exit(res);
 	}
 
+	if (iqrecprefix) {
+		const char *ext;
+
+		switch (inmode) {
+		case 3:
+			ext = "cu8";
+			break;
+		case 6:
+			ext = "cs16";
+			break;
+		default:
+			fprintf(stderr, "IQ recording is only available for rtl and soapy inputs\n");
+			exit(1);
+		}
+		res = IQrecinit(iqrecprefix, ext);
+		if (res) {
+			fprintf(stderr, "Unable to init IQ recording\n");
+			exit(res);
+		}
+	}
+
+#ifdef WITH_SNDFILE
+	if (bbprefix) {
+		if (inmode == 10) {
+			fprintf(stderr, "Baseband recording is not available in batch mode\n");
+			exit(1);
+		}
+		res = initBBrec(bbprefix);
+		if (res) {
+			fprintf(stderr, "Unable to init baseband recording\n");
+			exit(res);
+		}
+	}
+#endif
+
+	if (metricsfile || metricsport) {
+		res = initMetrics();
+		if (res) {
+			fprintf(stderr, "Unable to init metrics\n");
+			exit(res);
+		}
+	}
+
+	if (capfilename) {
+		res = Frmcapinit(capfilename);
+		if (res) {
+			fprintf(stderr, "Unable to init frame capture\n");
+			exit(res);
+		}
+	}
+
 #ifdef WITH_MQTT
 	if (netout == NETLOG_MQTT) {
 		res = MQTTinit(mqtt_urls,idstation,mqtt_topic,mqtt_user,mqtt_passwd);
@@ -441,6 +1094,20 @@ int main(int argc, char **argv)
 	sigaction(SIGINT, &sigact, NULL);
 	sigaction(SIGTERM, &sigact, NULL);
 	sigaction(SIGQUIT, &sigact, NULL);
+	sigact.sa_handler = sigusr1Handler;
+	sigaction(SIGUSR1, &sigact, NULL);
+	if (configfile) {
+		pthread_t th;
+
+		sem_init(&hupsem, 0, 0);
+		if (pthread_create(&th, NULL, hup_thread, NULL)) {
+			fprintf(stderr, "Unable to start the config reload thread\n");
+			exit(1);
+		}
+		sigact.sa_handler = sighupHandler;
+		sigact.sa_flags = SA_RESTART;
+		sigaction(SIGHUP, &sigact, NULL);
+	}
 
 	for (n = 0; n < nbch; n++) {
 		channel[n].chn = n;
@@ -464,6 +1131,19 @@ int main(int argc, char **argv)
 	}
 #endif
 
+	if (controlpath) {
+		res = initControl(controlpath);
+		if (res) {
+			fprintf(stderr, "Unable to init control socket\n");
+			exit(res);
+		}
+	}
+
+	if (memLock && mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		perror("Unable to lock memory");
+		exit(1);
+	}
+
 	if (verbose)
 		fprintf(stderr, "Decoding %d channels\n", nbch);
 
@@ -500,15 +1180,47 @@ int main(int argc, char **argv)
 		runSoapySample();
 		res = runSoapyClose();
 		break;
+#endif
+	case 7:
+		res = runReplay();
+		break;
+	case 8:
+		res = runRedecode();
+		break;
+	case 9:
+		res = runRawSample();
+		break;
+#ifdef WITH_SNDFILE
+	case 10:
+		res = runBatch();
+		break;
 #endif
 	default:
 		res = -1;
 	}
 
+	if (surveyBand)
+		surveyFlush();
+
 	fprintf(stderr, "exiting ...\n");
 
+	if (controlpath)
+		closeControl();
+
 	deinitAcars();
 
+	if (arcfilename)
+		Binoutclose();
+	if (capfilename)
+		Frmcapclose();
+	if (iqrecprefix)
+		IQrecclose();
+	closeMetrics();
+#ifdef WITH_SNDFILE
+	if (bbprefix)
+		BBrecclose();
+#endif
+
 #ifdef WITH_MQTT
 	MQTTend();
 #endif
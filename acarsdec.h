@@ -43,6 +43,25 @@
 #define OUTTYPE_JSON 4
 #define OUTTYPE_ROUTEJSON 5
 
+#define RAWFMT_U8 0
+#define RAWFMT_CS16 1
+#define RAWFMT_CF32 2
+
+#define CHANFLT_BOXCAR 0
+#define CHANFLT_HALFBAND 1
+
+#define AMDET_ENVELOPE 0
+#define AMDET_COHERENT 1
+#define AMDET_COHERENT_DC 2
+
+#define DEMOD_SCALAR 0
+#define DEMOD_SOA 1
+
+#define BBFMT_FLOAT 0
+#define BBFMT_PCM16 1
+
+#define SQLPREROLL 256
+
 typedef float sample_t;
 
 typedef struct mskblk_s {
@@ -54,26 +73,38 @@ typedef struct mskblk_s {
 	float lvl;
 	char txt[250];
 	unsigned char crc[2];
+	/* --auto-ppm : carrier offset at the end of the frame in Hz, tuner corrections count */
+	float foff;
+	int ppmgen;
+	/* monotonic timestamps in us, for latency metrics */
+	unsigned long long tsin, tsfrm;
 } msgblk_t;
 
 typedef struct {
 	int chn;
 
-#if defined(WITH_RTL) || defined(WITH_AIR)
-	int Fr;
+	float Fr;
 	float complex *wf;
-#endif
+	int amdet;
+	float afcoff;	/* --afc mixer correction, in Hz */
+	int hopgrp;	/* --hop group, only the channels of hopGroup are decoded, CHANOFF if removed */
 #if defined(WITH_AIR)
 	float complex D;
 #endif
 #if defined(WITH_SDRPLAY) || defined(WITH_SOAPY)
-	float	Fr;
         float	complex *oscillator;
         float	complex D;
 	int	counter;
 #endif
 
 	float *dm_buffer;
+
+	/* squelch : noise floor, state and pre-roll samples */
+	float sqlfloor;
+	int sqlopen, sqlhold;
+	int sqllen;
+	float sqlhist[SQLPREROLL];
+
 	double MskPhi;
 	double MskDf;
 	float MskClk;
@@ -84,13 +115,22 @@ typedef struct {
 
 	unsigned char outbits;
 	int	nbits;
+	unsigned int synreg;	/* last 32 bits while waiting for sync */
 
-	enum { WSYN, SYN2, SOH1, TXT, CRC1,CRC2, END } Acarsstate;
+	enum { WSYN, SOH1, TXT, CRC1,CRC2, END } Acarsstate;
 	msgblk_t *blk;
 
+	/* batch decoding : sample clock time base and local list of decoded blocks */
+	int batch;
+	unsigned long long smpcnt;
+	struct timeval tvbase;
+	msgblk_t *blkl;
+
 	pthread_t th;
 } channel_t;
 
+#define CHANOFF -1	/* removed through the control socket */
+
 typedef struct {
         char da[5];
         char sa[5];
@@ -140,6 +180,10 @@ extern int airflt;
 extern int emptymsg;
 extern int mdly;
 extern int hourly, daily;
+extern char *arcfilename;
+extern time_t arcsince, arcuntil;
+extern char *arctail;
+extern char *capfilename;
 
 extern int ppm;
 extern	int	lnaState;
@@ -156,11 +200,20 @@ extern int runAlsaSample(void);
 #ifdef WITH_SNDFILE
 extern int initSoundfile(char **argv,int optind);
 extern int runSoundfileSample(void);
+extern int initBBrec(char *prefix);
+extern void BBrecwrite(channel_t *ch, int len);
+extern void BBrecclose(void);
+extern char *bbprefix;
+extern int bbFormat;
+extern int initBatch(char **argv, int optind);
+extern int runBatch(void);
+extern int batchSegment;
 #endif
 #ifdef WITH_RTL
 extern int initRtl(char **argv,int optind);
 extern int runRtlSample(void);
 extern int runRtlCancel(void);
+extern int rtlSetGain(float g);
 extern int runRtlClose(void);
 extern int rtlMult;
 #endif
@@ -171,6 +224,7 @@ extern int runAirspySample(void);
 #ifdef WITH_SOAPY
 extern int initSoapy(char **argv,int optind);
 extern int soapySetAntenna(const char *antenna);
+extern int soapySetGain(double g);
 extern int runSoapySample(void);
 extern int runSoapyClose(void);
 extern int rateMult;
@@ -185,16 +239,102 @@ extern int MQTTsend(char *msgtxt);
 extern void MQTTend();
 #endif
 
+extern int initReplay(char **argv,int optind);
+extern int runReplay(void);
+
+extern int initRedecode(char **argv,int optind);
+extern int runRedecode(void);
+extern int Frmcapinit(char *filename);
+extern void Frmcapwrite(const msgblk_t *blk);
+extern void Frmcapclose(void);
+extern char *controlpath;
+extern int initControl(char *path);
+extern void closeControl(void);
+enum { STAGE_INPUT, STAGE_OUTPUT, STAGE_AUX, NBSTAGES };
+extern int stageCpus(char *arg);
+extern int stageRt(char *arg);
+extern int stageNice(char *arg);
+extern void stageThread(int stage, const char *name);
+
 extern int initRaw(char **argv,int optind);
 extern int runRawSample(void);
+extern int rawFormat;
+extern int rawMult;
+extern int rawRealtime;
+
+extern int IQrecinit(char *prefix, const char *ext);
+extern void IQrecput(const void *buf, size_t len);
+extern void IQrecclose(void);
+extern char *iqrecprefix;
+extern size_t iqrecMaxSize;
+extern int iqrecMaxTime;
+extern volatile int iqrecActive;
+extern unsigned long iqrecOverruns;
+
+extern int initChan(unsigned int Fc, int mult, float scale, int bufsz);
+extern int chanFilter;
+extern int amDetector;
+extern int afc;
+extern int parseAmDetector(const char *s);
+extern int chanAmDetector(const char *argF);
+extern void mixChan(const float complex *vb, int m);
+extern float chanOffset(int n);
+extern void retuneChan(unsigned int Fc);
+extern unsigned int chanPlanFc(const unsigned int *fr, int nb, int rate);
+extern int chanPlan(const unsigned int *fr, int nb, int minmult, int maxmult, int (*rateok)(int rate), unsigned int *Fc);
+extern void chanSetFc(int n, unsigned int Fc);
+extern unsigned int chanRestart(void);
+extern void chanTuneTo(unsigned int Fc);
+extern int chanTuned(void);
+extern unsigned int chanWaitTune(int ms);
+extern void chanTuneDone(unsigned int Fc);
+extern void chanEnergy(int n, float *lvl, float *floor, float *duty);
+extern int chanFind(float Fr);
+extern int chanFits(unsigned int Fr);
+extern int chanAdd(float Fr, int amdet);
+extern int chanRemove(int n);
+extern int chanRetune(int n, float Fr);
+extern int autoPpm;
+extern void ppmTag(msgblk_t *blk);
+extern void ppmSample(const msgblk_t *blk);
+extern int ppmUpdate(int cur, int *newppm);
+extern char *surveyBand;
+extern int surveyTime;
+extern int surveyBest;
+extern int initSurvey(int rate, unsigned int fixedFc, unsigned int *Fc);
+extern int surveyInput(int len);
+extern void surveyFrame(int chn, int crcok);
+extern int surveyOver(void);
+extern void surveyFlush(void);
+extern int hopDwell;
+extern int hopGroup;
+extern int initHop(int rate, unsigned int *Fc);
+extern int hopInput(int len);
+extern int squelch;
 extern int  initMsk(channel_t *);
 extern void demodMSK(channel_t *ch,int len);
+extern void demodChannels(int len);
+extern int demodEngine;
 
 
 extern int  initAcars(channel_t *);
 extern void decodeAcars(channel_t *);
+extern void resetAcars(channel_t *);
+extern int  fixAcars(msgblk_t *);
 extern int  deinitAcars(void);
 
 extern int DecodeLabel(acarsmsg_t *msg,oooi_t *oooi);
 
+/* output settings applied together by outputReload */
+typedef struct {
+	int outtype, netout;
+	int airflt, emptymsg;
+	int mdly;
+	int hourly, daily;
+	char *lblf, *logfilename, *Rawaddr, *idstation;
+} outconf_t;
+
 extern void outputmsg(const msgblk_t*);
+extern int outputNet(int netfmt, char *Rawaddr);
+extern void outputLabels(char *arg);
+extern int outputReload(const outconf_t *oc);
@@ -28,6 +28,8 @@
 #include <math.h>
 #include <libairspy/airspy.h>
 #include "acarsdec.h"
+#include "metrics.h"
+#include "probes.h"
 
 static unsigned int AIRMULT;
 static unsigned int AIRINRATE;
@@ -293,8 +295,19 @@ static int rx_callback(airspy_transfer_t* transfer)
 	float* pt_rx_buffer;
 	int n,i;
         int bo,be,ben,nbk;
+	static int placed = 0;
 
+	/* the libairspy thread */
+	if (!placed) {
+		stageThread(STAGE_INPUT, "acarsdec-in");
+		placed = 1;
+	}
 	pt_rx_buffer = (float *)(transfer->samples);
+	METRIC_INPUT();
+	PROBE1(input_block, transfer->sample_count);
+
+	if (transfer->dropped_samples)
+		METRIC_INC(metrics.inoverruns);
 
         bo=AIRMULT-ind;
         nbk=(transfer->sample_count-bo)/AIRMULT;
@@ -353,9 +366,10 @@ int runAirspySample(void)
                 return -1;
         }
 
-        while(airspy_is_streaming(device) == AIRSPY_TRUE) {
-                sleep(2);
+        while(!signalExit && airspy_is_streaming(device) == AIRSPY_TRUE) {
+                usleep(100000);
         }
+        airspy_stop_rx(device);
 
         return 0;
 }
@@ -23,6 +23,7 @@
 #include <pthread.h>
 #include <alsa/asoundlib.h>
 #include "acarsdec.h"
+#include "metrics.h"
 
 #define MAXNBFRAMES 4096
 
@@ -110,19 +111,23 @@ int runAlsaSample(void)
 {
 	int r, n, i;
 
+	stageThread(STAGE_INPUT, NULL);
 	do {
 		r = snd_pcm_readi(capture_handle, channel[0].dm_buffer,MAXNBFRAMES);
+		if (r == -EINTR && signalExit)
+			break;
 		if (r <= 0) {
 			fprintf(stderr,
 				"Alsa cannot read from interface (%s)\n",
 				snd_strerror(r));
 			return -1;
 		}
+		METRIC_INPUT();
 
 		demodMSK(&(channel[0]),r);
 
 
-	} while (1);
+	} while (!signalExit);
 	return 0;
 }
 
@@ -0,0 +1,1233 @@
+/*
+ *  Copyright (c) 2015 Thierry Leconte
+ *
+ *
+ *   This code is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Library General Public License version 2
+ *   published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Library General Public License for more details.
+ *
+ */
+
+/*
+ * acarsdec-bench : microbenchmarks of the decoding hot paths, on synthetic
+ * signals and frames, so that changes could be compared across versions and
+ * hardware. Results are printed and optionally saved as json, or compared
+ * with a previous json result. Generated captures (and test.wav) are decoded
+ * through the real inputs and checked against the expected messages.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include "acarsdec.h"
+#include "metrics.h"
+#include "cJSON.h"
+
+/* globals normally defined in acarsdec.c */
+channel_t channel[MAXNBCHANNELS];
+unsigned int nbch;
+char *idstation = "bench";
+int inmode = 0;
+int verbose = 0;
+int outtype = OUTTYPE_NONE;
+int netout = NETLOG_NONE;
+int airflt = 0;
+int emptymsg = 0;
+int mdly = 600;
+int hourly = 0;
+int daily = 0;
+char *arcfilename = NULL;
+time_t arcsince = 0;
+time_t arcuntil = 0;
+char *arctail = NULL;
+char *capfilename = NULL;
+int rawFormat = RAWFMT_U8;
+int rawMult = 160;
+int rawRealtime = 0;
+char *iqrecprefix = NULL;
+size_t iqrecMaxSize = 0;
+int iqrecMaxTime = 0;
+#ifdef WITH_SNDFILE
+char *bbprefix = NULL;
+int bbFormat = BBFMT_FLOAT;
+int batchSegment = 600;
+#endif
+char *metricsfile = NULL;
+int metricsport = 0;
+int metricsInterval = 10;
+int squelch = 0;
+int demodEngine = DEMOD_SCALAR;
+int chanFilter = CHANFLT_BOXCAR;
+int amDetector = AMDET_ENVELOPE;
+int afc = 0;
+int autoPpm = 0;
+char *surveyBand = NULL;
+int surveyTime = 60;
+int surveyBest = 0;
+int hopDwell = 0;
+int signalExit = 0;
+#ifdef HAVE_LIBACARS
+int skip_reassembly = 0;
+#endif
+
+extern const unsigned short crc_ccitt_table[256];
+#define update_crc(crc,c) crc= (crc>> 8)^crc_ccitt_table[(crc^(c))&0xff];
+
+#define MAXRESULTS 64
+static struct {
+	char name[32];
+	char params[64];
+	const char *unit;
+	double value;
+} results[MAXRESULTS];
+static int nbresults;
+
+static double benchtime = 0.5;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* keep the best value of repeated runs of the same benchmark */
+static void report(const char *name, const char *params, const char *unit, double value)
+{
+	int n;
+
+	for (n = 0; n < nbresults; n++)
+		if (strcmp(results[n].name, name) == 0 && strcmp(results[n].params, params) == 0 && results[n].unit == unit) {
+			if (value < results[n].value)
+				results[n].value = value;
+			return;
+		}
+	if (nbresults >= MAXRESULTS)
+		return;
+	snprintf(results[nbresults].name, sizeof(results[nbresults].name), "%s", name);
+	snprintf(results[nbresults].params, sizeof(results[nbresults].params), "%s", params);
+	results[nbresults].unit = unit;
+	results[nbresults].value = value;
+	nbresults++;
+}
+
+static void printresults(void)
+{
+	int n;
+
+	for (n = 0; n < nbresults; n++)
+		printf("%-14s %-34s %10.2f %s\n", results[n].name, results[n].params, results[n].value, results[n].unit);
+}
+
+/* synthetic acars frames */
+
+static unsigned char parity(unsigned char c)
+{
+	return __builtin_parity(c & 0x7f) ? c & 0x7f : c | 0x80;
+}
+
+/* build a valid downlink block text, return its length */
+static int buildblk(msgblk_t *blk, int n)
+{
+	char txt[220];
+	int i, len = 0;
+
+	snprintf(txt, sizeof(txt), "2.N%05dKH1%cM%03dAB%04dFLIGHT POSITION REPORT %06d N45.123 E005.456 FL350",
+		 n % 100000, '0' + n % 10, n % 1000, n % 10000, n);
+
+	for (i = 0; i < 12; i++)
+		blk->txt[len++] = parity(txt[i]);
+	blk->txt[len++] = 0x02;	/* STX */
+	for (; txt[i]; i++)
+		blk->txt[len++] = parity(txt[i]);
+	blk->txt[len++] = 0x83;	/* ETX */
+	blk->len = len;
+	blk->chn = 0;
+	blk->err = 0;
+	blk->lvl = -20;
+	gettimeofday(&(blk->tv), NULL);
+
+	unsigned short crc = 0;
+	for (i = 0; i < len; i++) {
+		update_crc(crc, blk->txt[i]);
+	}
+	blk->crc[0] = crc & 0xff;
+	blk->crc[1] = crc >> 8;
+	return len;
+}
+
+/* full on air byte sequence : pre-key, bit sync, SYN SYN SOH, text, crc, DEL */
+static int buildframe(unsigned char *out, int n, int prekey)
+{
+	msgblk_t blk;
+	int i, len = 0;
+
+	buildblk(&blk, n);
+	for (i = 0; i < prekey; i++)
+		out[len++] = 0xff;
+	out[len++] = parity('+');
+	out[len++] = parity('*');
+	out[len++] = 0x16;
+	out[len++] = 0x16;
+	out[len++] = 0x01;
+	memcpy(out + len, blk.txt, blk.len);
+	len += blk.len;
+	out[len++] = blk.crc[0];
+	out[len++] = blk.crc[1];
+	out[len++] = 0x7f;
+	return len;
+}
+
+/* continuous phase MSK modulator state */
+typedef struct {
+	int rate;
+	double phase;
+	double clk;
+	int prev;
+} mod_t;
+
+/*
+ * MSK modulation of bytes (lsb first) as AM audio at md->rate.
+ * The coding is differential : a 2400Hz bit keeps the previous bit value,
+ * a 1200Hz one inverts it.
+ */
+static int modulate(const unsigned char *bytes, int nb, float *out, mod_t *md)
+{
+	int i, b, n = 0;
+
+	for (i = 0; i < nb; i++) {
+		for (b = 0; b < 8; b++) {
+			int bit = (bytes[i] >> b) & 1;
+			double f;
+
+			f = (bit == md->prev) ? 2400 : 1200;
+			md->prev = bit;
+			/* clk : position of the next sample inside the current bit, in bits */
+			for (; md->clk < 1; md->clk += 2400.0 / md->rate)
+				out[n++] = 0.5 + 0.4 * cos(md->phase + 2 * M_PI * f * md->clk / 2400);
+			md->clk -= 1;
+			md->phase = fmod(md->phase + 2 * M_PI * f / 2400, 2 * M_PI);
+		}
+	}
+	return n;
+}
+
+/* AM audio with nbfrm frames, numbered from first, separated by silence */
+static float *buildaudio(int nbfrm, int first, int rate, int *len)
+{
+	unsigned char frame[300];
+	mod_t md = { rate, 0, 0, 0 };
+	int n = 0, f, i;
+	float *audio;
+
+	audio = malloc((size_t)nbfrm * rate * sizeof(float));
+	if (audio == NULL)
+		return NULL;
+	for (f = 0; f < nbfrm; f++) {
+		int fl = buildframe(frame, first + f, 16);
+
+		for (i = 0; i < rate / 4; i++)
+			audio[n++] = 0.5;
+		n += modulate(frame, fl, audio + n, &md);
+		for (i = 0; i < rate / 4; i++)
+			audio[n++] = 0.5;
+	}
+	*len = n;
+	return audio;
+}
+
+/* reset the demodulator and decoder of an already set up channel */
+static void initdecoder(channel_t *ch)
+{
+	initMsk(ch);
+	ch->outbits = 0;
+	ch->nbits = 8;
+	ch->Acarsstate = WSYN;
+	ch->blk = NULL;
+	ch->blkl = NULL;
+	ch->smpcnt = 0;
+	ch->batch = 1;		/* decoded blocks stay on the channel list */
+}
+
+static void initbenchchannel(channel_t *ch, int n)
+{
+	memset(ch, 0, sizeof(channel_t));
+	ch->chn = n;
+	initdecoder(ch);
+}
+
+static int freeblks(channel_t *ch)
+{
+	int n = 0;
+
+	while (ch->blkl) {
+		msgblk_t *blk = ch->blkl;
+
+		ch->blkl = blk->prev;
+		free(blk);
+		n++;
+	}
+	return n;
+}
+
+/* benchmarks */
+
+static void bench_mixchan(int mult, int nbc, int flt)
+{
+	float complex *vb;
+	double t0, el;
+	unsigned long nbs = 0;
+	char params[64];
+	int n, m;
+
+	vb = malloc(mult * 1024 * sizeof(float complex));
+	for (n = 0; n < mult * 1024; n++)
+		vb[n] = (rand() % 256 - 127.5) + (rand() % 256 - 127.5) * I;
+
+	nbch = nbc;
+	for (n = 0; n < nbc; n++) {
+		channel[n].chn = n;
+		channel[n].Fr = 130000000 + 25000 * n;
+	}
+	chanFilter = flt;
+	initChan(130200000, mult, 1.0 / 127.5, 1024);
+
+	t0 = now();
+	do {
+		for (m = 0; m < 1024; m++)
+			mixChan(vb + m * mult, m);
+		nbs += 1024 * mult;
+	} while ((el = now() - t0) < benchtime);
+
+	snprintf(params, sizeof(params), "mult=%d nbch=%d %s", mult, nbc, flt == CHANFLT_HALFBAND ? "halfband" : "boxcar");
+	report("mixChan", params, "ns/insample", el * 1e9 / nbs);
+
+	for (n = 0; n < nbc; n++) {
+		free(channel[n].wf);
+		free(channel[n].dm_buffer);
+	}
+	chanFilter = CHANFLT_BOXCAR;
+	free(vb);
+}
+
+/* demodulation of frames or of an idle channel, with squelch sql dB or without */
+static void bench_demodmsk(int sql, int idle)
+{
+	float *audio;
+	channel_t ch;
+	char params[64];
+	int len, pos, i;
+	double t0, el;
+	unsigned long nbs = 0, nbm = 0;
+
+	if (idle) {
+		len = 8 * INTRATE;
+		audio = malloc(len * sizeof(float));
+	} else
+		audio = buildaudio(8, 0, INTRATE, &len);
+	if (audio == NULL)
+		return;
+	for (i = 0; i < len; i++)
+		audio[i] = (idle ? 0.5 : audio[i]) + 0.01 * ((float)rand() / RAND_MAX - 0.5);
+
+	squelch = sql;
+	initbenchchannel(&ch, 0);
+
+	t0 = now();
+	do {
+		for (pos = 0; pos + 1024 <= len; pos += 1024) {
+			ch.dm_buffer = audio + pos;
+			demodMSK(&ch, 1024);
+		}
+		nbs += pos;
+		nbm += freeblks(&ch);
+	} while ((el = now() - t0) < benchtime);
+	squelch = 0;
+
+	snprintf(params, sizeof(params), "%s", idle ? "idle channel" : "synthetic frames");
+	if (sql)
+		snprintf(params + strlen(params), sizeof(params) - strlen(params), " squelch=%d", sql);
+	if (!idle && nbm == 0)
+		snprintf(params + strlen(params), sizeof(params) - strlen(params), ", NO DECODE");
+	report("demodMSK", params, "ns/sample", el * 1e9 / nbs);
+
+	free(ch.inb);
+	free(ch.blk);
+	free(audio);
+}
+
+/* demodulation of nbc channels together, by the scalar or the channel parallel engine */
+static void bench_demodchannels(int engine, int nbc)
+{
+	float *audio;
+	char params[64];
+	int len, pos, i, n;
+	double t0, el;
+	unsigned long nbs = 0, nbm = 0;
+
+	audio = buildaudio(8, 0, INTRATE, &len);
+	if (audio == NULL)
+		return;
+	for (i = 0; i < len; i++)
+		audio[i] += 0.01 * ((float)rand() / RAND_MAX - 0.5);
+
+	demodEngine = engine;
+	nbch = nbc;
+	for (n = 0; n < nbc; n++)
+		initbenchchannel(&(channel[n]), n);
+
+	t0 = now();
+	do {
+		for (pos = 0; pos + 1024 <= len; pos += 1024) {
+			for (n = 0; n < nbc; n++)
+				channel[n].dm_buffer = audio + pos;
+			demodChannels(1024);
+		}
+		nbs += pos * nbc;
+		for (n = 0; n < nbc; n++)
+			nbm += freeblks(&(channel[n]));
+	} while ((el = now() - t0) < benchtime);
+	demodEngine = DEMOD_SCALAR;
+
+	snprintf(params, sizeof(params), "%s nbch=%d%s", engine == DEMOD_SOA ? "soa" : "scalar", nbc,
+		 nbm ? "" : ", NO DECODE");
+	report("demodChannels", params, "ns/sample", el * 1e9 / nbs);
+
+	for (n = 0; n < nbc; n++) {
+		free(channel[n].inb);
+		free(channel[n].blk);
+		channel[n].dm_buffer = NULL;
+	}
+	free(audio);
+}
+
+static void bench_decodeacars(void)
+{
+	unsigned char frame[300];
+	channel_t ch;
+	int fl, i, b;
+	double t0, el;
+	unsigned long nbm = 0, nbb = 0;
+
+	fl = buildframe(frame, 1, 16);
+	initbenchchannel(&ch, 0);
+
+	t0 = now();
+	do {
+		for (i = 0; i < fl; i++)
+			for (b = 0; b < 8; b++) {
+				ch.outbits >>= 1;
+				if ((frame[i] >> b) & 1)
+					ch.outbits |= 0x80;
+				if (--ch.nbits <= 0)
+					decodeAcars(&ch);
+			}
+		nbb += fl * 8;
+		nbm += freeblks(&ch);
+	} while ((el = now() - t0) < benchtime);
+
+	if (nbm == 0) {
+		report("decodeAcars", "NO DECODE", "ns/msg", 0);
+		return;
+	}
+	report("decodeAcars", "state machine", "ns/msg", el * 1e9 / nbm);
+	report("decodeAcars", "state machine", "ns/bit", el * 1e9 / nbb);
+	free(ch.inb);
+	free(ch.blk);
+}
+
+/* flip nbe parity bits (1..3), or 2 bits in one byte when nbe is 0 */
+static void bench_fixacars(int nbe)
+{
+	msgblk_t ref, blk;
+	double t0, el;
+	unsigned long nbm = 0, nbok = 0;
+	char params[64];
+	int i;
+
+	buildblk(&ref, 1);
+	t0 = now();
+	do {
+		for (i = 0; i < 64; i++) {
+			int k;
+
+			blk = ref;
+			if (nbe == 0) {
+				k = 13 + (nbm + i) % (blk.len - 14);
+				blk.txt[k] ^= 0x06;
+			} else
+				for (k = 0; k < nbe; k++)
+					blk.txt[13 + (k * 17 + nbm + i) % (blk.len - 14)] ^= 1 << ((nbm + i + k) % 7);
+			if (fixAcars(&blk) == 0)
+				nbok++;
+		}
+		nbm += 64;
+	} while ((el = now() - t0) < benchtime);
+
+	if (nbe)
+		snprintf(params, sizeof(params), "%d parity errors (%.0f%% fixed)", nbe, 100.0 * nbok / nbm);
+	else
+		snprintf(params, sizeof(params), "double bit error (%.0f%% fixed)", 100.0 * nbok / nbm);
+	report("fixAcars", params, "ns/msg", el * 1e9 / nbm);
+}
+
+static void bench_output(void)
+{
+	msgblk_t ref, blk;
+	double t0, el;
+	unsigned long nbm = 0;
+
+	/* json build and formatting, written to /dev/null */
+	outtype = OUTTYPE_JSON;
+	if (initOutput("/dev/null", NULL)) {
+		report("outputmsg", "json, INIT FAILED", "ns/msg", 0);
+		return;
+	}
+
+	buildblk(&ref, 1);
+	fixAcars(&ref);
+	t0 = now();
+	do {
+		blk = ref;
+		outputmsg(&blk);
+		nbm++;
+	} while ((el = now() - t0) < benchtime);
+
+	report("outputmsg", "buildjson to /dev/null", "ns/msg", el * 1e9 / nbm);
+}
+
+static void bench_decodelabel(void)
+{
+	static const struct {
+		const char *label;
+		const char *txt;
+	} lbls[] = {
+		{ "10", "OUT02,1234,LFPG,KJFK,1200" },
+		{ "12", "ON,1234,LFPG,KJFK,1200" },
+		{ "2Z", "KJFK" },
+		{ "QA", "LFPGKJFK1234" },
+		{ "H1", "#DFB POSITION REPORT" },
+	};
+	acarsmsg_t msg;
+	oooi_t oooi;
+	double t0, el;
+	unsigned long nbm = 0;
+	int i;
+
+	memset(&msg, 0, sizeof(msg));
+	t0 = now();
+	do {
+		for (i = 0; i < sizeof(lbls) / sizeof(lbls[0]); i++) {
+			memcpy(msg.label, lbls[i].label, 3);
+			msg.txt = (char *)lbls[i].txt;
+			DecodeLabel(&msg, &oooi);
+		}
+		nbm += i;
+	} while ((el = now() - t0) < benchtime);
+
+	report("DecodeLabel", "oooi labels", "ns/msg", el * 1e9 / nbm);
+}
+
+/* decode checks : the decoded frames must be byte for byte the generated ones */
+
+static int nbfail;
+
+/* blocks of a channel in reception order, the channel list being the reverse */
+static msgblk_t *takeblks(channel_t *ch)
+{
+	msgblk_t *blk, *lst = NULL;
+
+	while ((blk = ch->blkl)) {
+		ch->blkl = blk->prev;
+		blk->prev = lst;
+		lst = blk;
+	}
+	return lst;
+}
+
+/* return the number of decoded frames equal to frames first..first+nbfrm-1, -1 if extra frames */
+static int checkblks(channel_t *ch, int first, int nbfrm)
+{
+	msgblk_t *blk, *lst;
+	int n = 0, ok = 0;
+
+	for (lst = takeblks(ch); (blk = lst); n++) {
+		msgblk_t ref;
+
+		lst = blk->prev;
+		if (n < nbfrm) {
+			/* fixAcars strips the parity bits */
+			buildblk(&ref, first + n);
+			fixAcars(&ref);
+			if (fixAcars(blk) == 0 && blk->len == ref.len &&
+			    memcmp(blk->txt, ref.txt, ref.len) == 0 && memcmp(blk->crc, ref.crc, 2) == 0)
+				ok++;
+		}
+		free(blk);
+	}
+	return n > nbfrm ? -1 : ok;
+}
+
+/* number of decoded frames equal to one of frames first..first+nbfrm-1, some of them being lost */
+static int countblks(channel_t *ch, int first, int nbfrm)
+{
+	msgblk_t *blk, *lst;
+	int n = 0, ok = 0;
+
+	for (lst = takeblks(ch); (blk = lst);) {
+		lst = blk->prev;
+		if (fixAcars(blk) == 0) {
+			int k;
+
+			if (autoPpm)
+				ppmSample(blk);
+
+			/* frames are decoded in order : look for it from the last found one */
+			for (k = n; k < nbfrm; k++) {
+				msgblk_t ref;
+
+				buildblk(&ref, first + k);
+				fixAcars(&ref);
+				if (blk->len == ref.len && memcmp(blk->txt, ref.txt, ref.len) == 0 &&
+				    memcmp(blk->crc, ref.crc, 2) == 0) {
+					n = k + 1;
+					ok++;
+					break;
+				}
+			}
+		}
+		free(blk);
+	}
+	return ok;
+}
+
+#define CHKFC 131000000
+#define CHKSPACING 150000
+#define CHKNBFRM 2
+
+static unsigned int chkfreq(int n, int nbc)
+{
+	return CHKFC + CHKSPACING * (2 * n - nbc + 1) / 2;
+}
+
+/* nbc AM channels around CHKFC, CHKNBFRM frames each, at INTRATE*mult */
+static float complex *buildiq(int nbc, int mult, int *len)
+{
+	int rate = INTRATE * mult, n, k, alen;
+	float complex *iq;
+
+	iq = calloc((size_t)CHKNBFRM * rate, sizeof(float complex));
+	if (iq == NULL)
+		return NULL;
+	*len = 0;
+	for (n = 0; n < nbc; n++) {
+		float *audio = buildaudio(CHKNBFRM, n * CHKNBFRM, rate, &alen);
+		double complex rot = 1, step;
+
+		if (audio == NULL) {
+			free(iq);
+			return NULL;
+		}
+		step = cexp(2 * M_PI * I * ((double)chkfreq(n, nbc) - CHKFC) / rate);
+		for (k = 0; k < alen; k++) {
+			iq[k] += audio[k] / nbc * rot;
+			rot *= step;
+			if ((k & 1023) == 0)
+				rot /= cabs(rot);
+		}
+		if (alen > *len)
+			*len = alen;
+		free(audio);
+	}
+	return iq;
+}
+
+static int writeiq(int fd, const float complex *iq, int len, int fmt)
+{
+	unsigned char buf[4096 * 2 * sizeof(float)];
+	int k, i;
+
+	for (k = 0; k < len; k += 4096) {
+		int nb = len - k < 4096 ? len - k : 4096;
+		size_t sz;
+
+		for (i = 0; i < nb; i++) {
+			float re = crealf(iq[k + i]), im = cimagf(iq[k + i]);
+
+			switch (fmt) {
+			case RAWFMT_CS16:
+				((int16_t *)buf)[2 * i] = lrintf(re * 32767);
+				((int16_t *)buf)[2 * i + 1] = lrintf(im * 32767);
+				break;
+			case RAWFMT_CF32:
+				((float *)buf)[2 * i] = re;
+				((float *)buf)[2 * i + 1] = im;
+				break;
+			default:
+				buf[2 * i] = lrintf(re * 127 + 127.5);
+				buf[2 * i + 1] = lrintf(im * 127 + 127.5);
+				break;
+			}
+		}
+		sz = nb * (fmt == RAWFMT_CS16 ? 4 : fmt == RAWFMT_CF32 ? 8 : 2);
+		if (write(fd, buf, sz) != sz)
+			return -1;
+	}
+	return 0;
+}
+
+/* generated multi channel capture decoded through the raw IQ input */
+static void check_raw(int fmt, int mult, int nbc, int engine)
+{
+	static const char *fmtname[] = { "u8", "cs16", "cf32" };
+	char filename[] = "/tmp/acarsdec-bench-XXXXXX";
+	char fc[16], fr[MAXNBCHANNELS][16], *args[MAXNBCHANNELS + 3];
+	char params[64];
+	float complex *iq;
+	unsigned long nbs = 0;
+	double t0, el = 0;
+	int fd, len, n, bad = 0;
+
+	snprintf(params, sizeof(params), "%s mult=%d nbch=%d%s%s", fmtname[fmt], mult, nbc,
+		 engine == DEMOD_SOA ? " soa" : "", chanFilter == CHANFLT_HALFBAND ? " halfband" : "");
+
+	iq = buildiq(nbc, mult, &len);
+	fd = mkstemp(filename);
+	if (iq == NULL || fd < 0 || writeiq(fd, iq, len, fmt)) {
+		fprintf(stderr, "FAIL rawDecode %s : could not build capture\n", params);
+		nbfail++;
+		free(iq);
+		if (fd >= 0) {
+			close(fd);
+			unlink(filename);
+		}
+		return;
+	}
+	close(fd);
+	free(iq);
+
+	rawFormat = fmt;
+	rawMult = mult;
+	demodEngine = engine;
+	args[0] = filename;
+	snprintf(fc, sizeof(fc), "%.6f", CHKFC / 1e6);
+	args[1] = fc;
+	for (n = 0; n < nbc; n++) {
+		snprintf(fr[n], sizeof(fr[n]), "%.6f", chkfreq(n, nbc) / 1e6);
+		args[2 + n] = fr[n];
+	}
+	args[2 + nbc] = NULL;
+
+	do {
+		if (initRaw(args, 0) || nbch != nbc) {
+			bad = nbc;
+			break;
+		}
+		for (n = 0; n < nbc; n++)
+			initdecoder(&(channel[n]));
+
+		t0 = now();
+		runRawSample();
+		el += now() - t0;
+		nbs += len;
+
+		for (n = 0; n < nbc; n++) {
+			if (checkblks(&(channel[n]), n * CHKNBFRM, CHKNBFRM) != CHKNBFRM)
+				bad++;
+			free(channel[n].wf);
+			free(channel[n].dm_buffer);
+			free(channel[n].inb);
+			free(channel[n].blk);
+		}
+	} while (bad == 0 && el < benchtime);
+	unlink(filename);
+	demodEngine = DEMOD_SCALAR;
+
+	if (bad) {
+		fprintf(stderr, "FAIL rawDecode %s : decoded frames differ from the generated ones\n", params);
+		nbfail++;
+		return;
+	}
+	report("rawDecode", params, "ns/insample", el * 1e9 / nbs);
+}
+
+/*
+ * AM detectors yield : YLDNBFRM bursts, carrier on only for the frame with a random phase
+ * and off Hz +/- up to spread Hz away from the channel, with gaussian noise. cnr is the
+ * carrier to noise ratio in a INTRATE bandwidth.
+ */
+#define YLDMULT 40
+#define YLDNBFRM 100
+#define YLDOFFSET 500
+
+static float complex *buildbursts(float cnr, int off, int spread, int *len)
+{
+	int rate = INTRATE * YLDMULT, n = 0, f, i, alen;
+	double sigma = sqrt(0.25 / pow(10, cnr / 10) * YLDMULT / 2);
+	float complex *iq;
+	float *audio;
+
+	iq = malloc((size_t)YLDNBFRM * rate / 2 * sizeof(float complex));
+	audio = malloc((size_t)rate / 2 * sizeof(float));
+	if (iq == NULL || audio == NULL) {
+		free(iq);
+		free(audio);
+		return NULL;
+	}
+	for (f = 0; f < YLDNBFRM; f++) {
+		unsigned char frame[300];
+		mod_t md = { rate, 0, 0, 0 };
+		double complex rot = cexp(2 * M_PI * I * (rand() / (RAND_MAX + 1.0)));
+		double complex step = cexp(2 * M_PI * I * (off + spread * (2.0 * rand() / RAND_MAX - 1)) / rate);
+		int fl = buildframe(frame, f, 16);
+
+		n += rate / 20;
+		for (i = 0; i < rate / 200; i++)
+			audio[i] = 0.5;
+		alen = i + modulate(frame, fl, audio + i, &md);
+		for (i = 0; i < alen; i++, n++) {
+			iq[n] = audio[i] * rot;
+			rot *= step;
+		}
+	}
+	free(audio);
+	for (i = 0; i < n; i++) {
+		/* Box-Muller */
+		double u = (rand() + 1.0) / (RAND_MAX + 1.0), v = rand() / (RAND_MAX + 1.0);
+
+		iq[i] += sigma * sqrt(-2 * log(u)) * cexp(2 * M_PI * I * v);
+	}
+	*len = n;
+	return iq;
+}
+
+/* write a burst capture to a temporary file */
+static int writebursts(char *filename, float cnr, int off, int spread)
+{
+	float complex *iq;
+	int fd, len;
+
+	iq = buildbursts(cnr, off, spread, &len);
+	fd = mkstemp(filename);
+	if (iq == NULL || fd < 0 || writeiq(fd, iq, len, RAWFMT_CF32)) {
+		fprintf(stderr, "FAIL amYield : could not build capture\n");
+		nbfail++;
+		free(iq);
+		if (fd >= 0) {
+			close(fd);
+			unlink(filename);
+		}
+		return -1;
+	}
+	close(fd);
+	free(iq);
+	return 0;
+}
+
+static int decodeyield(const char *filename, int det)
+{
+	static const char *sfx[] = { "e", "c", "cd" };
+	char fc[16], fr[24], *args[4];
+	int ok;
+
+	rawFormat = RAWFMT_CF32;
+	rawMult = YLDMULT;
+	args[0] = (char *)filename;
+	snprintf(fc, sizeof(fc), "%.6f", CHKFC / 1e6);
+	args[1] = fc;
+	snprintf(fr, sizeof(fr), "%.6f:%s", CHKFC / 1e6, sfx[det]);
+	args[2] = fr;
+	args[3] = NULL;
+
+	if (initRaw(args, 0) || nbch != 1)
+		return -1;
+	initdecoder(&(channel[0]));
+	runRawSample();
+	ok = countblks(&(channel[0]), 0, YLDNBFRM);
+	free(channel[0].wf);
+	free(channel[0].dm_buffer);
+	free(channel[0].inb);
+	free(channel[0].blk);
+	return ok;
+}
+
+static void check_amyield(void)
+{
+	static const float cnrs[] = { 20, 12, 10, 8, 6, 5, 4, 3 };
+	unsigned int c;
+	int d;
+
+	printf("\nAM detectors yield, %d frames, up to %dHz offset\n%-10s %10s %10s %12s\n", YLDNBFRM, YLDOFFSET,
+	       "C/N dB", "envelope", "coherent", "coherent-dc");
+	for (c = 0; c < sizeof(cnrs) / sizeof(cnrs[0]); c++) {
+		char filename[] = "/tmp/acarsdec-bench-XXXXXX";
+
+		if (writebursts(filename, cnrs[c], 0, YLDOFFSET))
+			return;
+
+		printf("%-10.0f", cnrs[c]);
+		for (d = AMDET_ENVELOPE; d <= AMDET_COHERENT_DC; d++) {
+			int ok = decodeyield(filename, d);
+
+			printf(" %*d", d == AMDET_COHERENT_DC ? 12 : 10, ok);
+			/* no loss expected on strong signals */
+			if (c == 0 && ok != YLDNBFRM) {
+				fprintf(stderr, "\nFAIL amYield : %d/%d frames decoded at %.0fdB\n", ok, YLDNBFRM, cnrs[c]);
+				nbfail++;
+			}
+		}
+		printf("\n");
+		unlink(filename);
+	}
+}
+
+/* a tuner AFCOFFSET Hz off : yield without and with --afc, that must find the offset back */
+#define AFCOFFSET 4000
+
+static void check_afc(void)
+{
+	static const float cnrs[] = { 8, 6, 5, 4 };
+	unsigned int c;
+
+	printf("\nAFC yield, %d frames, %dHz offset\n%-10s %10s %10s %10s\n", YLDNBFRM, AFCOFFSET,
+	       "C/N dB", "no afc", "afc", "afc Hz");
+	for (c = 0; c < sizeof(cnrs) / sizeof(cnrs[0]); c++) {
+		char filename[] = "/tmp/acarsdec-bench-XXXXXX";
+		int ok, okafc;
+		float off;
+
+		if (writebursts(filename, cnrs[c], AFCOFFSET, 100))
+			return;
+		ok = decodeyield(filename, AMDET_ENVELOPE);
+		afc = 1;
+		okafc = decodeyield(filename, AMDET_ENVELOPE);
+		off = channel[0].afcoff;
+		afc = 0;
+		unlink(filename);
+
+		printf("%-10.0f %10d %10d %10.0f\n", cnrs[c], ok, okafc, off);
+		if (fabsf(off - AFCOFFSET) > 100) {
+			fprintf(stderr, "FAIL afc : found a %.0fHz offset instead of %dHz\n", off, AFCOFFSET);
+			nbfail++;
+		}
+	}
+}
+
+/*
+ * the same offset seen by --auto-ppm as a tuner error : the channel filter edge biases the first
+ * estimate a bit, the second one, once the tuner has been corrected by the first, must find it
+ */
+static void check_autoppm(void)
+{
+	int expected = lrint(-AFCOFFSET * 1e6 / CHKFC);
+	int it, ok, p = 0;
+
+	printf("\nauto ppm, %dHz offset (%dppm)\n", AFCOFFSET, expected);
+	for (it = 0; it < 2; it++) {
+		char filename[] = "/tmp/acarsdec-bench-XXXXXX";
+		int off = AFCOFFSET + lrint(p * 1e-6 * CHKFC);
+
+		if (writebursts(filename, 8, off, 100))
+			return;
+		autoPpm = 1;
+		ok = decodeyield(filename, AMDET_ENVELOPE);
+		autoPpm = 0;
+		unlink(filename);
+
+		ppmUpdate(p, &p);
+		printf("%d frames with a %dHz offset : correction set to %dppm\n", ok, off, p);
+	}
+	if (p != expected) {
+		fprintf(stderr, "FAIL auto ppm : found %dppm instead of %dppm\n", p, expected);
+		nbfail++;
+	}
+}
+
+#ifdef WITH_SNDFILE
+/* messages of the shipped test.wav : channel, length and crc, in reception order for each channel */
+static const struct {
+	int chn, len;
+	unsigned char crc[2];
+} testwav[] = {
+	{ 0, 208, { 0x61, 0xe5 } },
+	{ 0, 13, { 0x33, 0x7c } },
+	{ 1, 24, { 0x14, 0xfc } },
+	{ 1, 24, { 0x2c, 0x5e } },
+	{ 2, 24, { 0xca, 0x9f } },
+	{ 2, 24, { 0x23, 0xd0 } },
+	{ 3, 24, { 0x6b, 0x5e } },
+};
+#define NBTESTWAV (sizeof(testwav) / sizeof(testwav[0]))
+
+/* test.wav decoded once through the sound file input */
+static void check_wav(char *filename)
+{
+	char *args[2] = { filename, NULL };
+	unsigned long nbs = 0;
+	double t0, el;
+	int n, g, nbdec = 0, ok = 0;
+
+	if (access(filename, R_OK)) {
+		printf("%s not found, sound file check skipped\n", filename);
+		return;
+	}
+	if (initSoundfile(args, 0)) {
+		nbfail++;
+		return;
+	}
+	for (n = 0; n < nbch; n++) {
+		channel[n].chn = n;
+		initdecoder(&(channel[n]));
+	}
+
+	t0 = now();
+	runSoundfileSample();
+	el = now() - t0;
+
+	for (n = 0; n < nbch; n++) {
+		msgblk_t *blk, *lst;
+
+		nbs += channel[n].smpcnt;
+		for (g = 0, lst = takeblks(&(channel[n])); (blk = lst); nbdec++) {
+			lst = blk->prev;
+			while (g < NBTESTWAV && testwav[g].chn != n)
+				g++;
+			if (fixAcars(blk) == 0 && g < NBTESTWAV && blk->len == testwav[g].len &&
+			    memcmp(blk->crc, testwav[g].crc, 2) == 0)
+				ok++;
+			else
+				fprintf(stderr, "unexpected message : { %d, %d, { 0x%02x, 0x%02x } }\n",
+					n, blk->len, blk->crc[0], blk->crc[1]);
+			g++;
+			free(blk);
+		}
+		free(channel[n].dm_buffer);
+		free(channel[n].inb);
+		free(channel[n].blk);
+	}
+
+	if (ok != NBTESTWAV || nbdec != NBTESTWAV) {
+		fprintf(stderr, "FAIL sndDecode %s : %d/%d messages decoded as expected\n", filename, ok, (int)NBTESTWAV);
+		nbfail++;
+		return;
+	}
+	report("sndDecode", "test.wav", "ns/sample", el * 1e9 / nbs);
+}
+#endif
+
+/* compare with a previous json result file, return the number of regressions */
+static int checkbaseline(const char *filename, double tol)
+{
+	cJSON *root, *res, *item;
+	char *buf;
+	long sz;
+	FILE *fd;
+	int n, nbreg = 0;
+
+	fd = fopen(filename, "r");
+	if (fd == NULL) {
+		fprintf(stderr, "Could not open %s\n", filename);
+		return 1;
+	}
+	fseek(fd, 0, SEEK_END);
+	sz = ftell(fd);
+	rewind(fd);
+	buf = calloc(sz + 1, 1);
+	if (buf == NULL || fread(buf, 1, sz, fd) != sz) {
+		fprintf(stderr, "Could not read %s\n", filename);
+		fclose(fd);
+		free(buf);
+		return 1;
+	}
+	fclose(fd);
+
+	root = cJSON_Parse(buf);
+	free(buf);
+	res = cJSON_GetObjectItemCaseSensitive(root, "results");
+	if (res == NULL) {
+		fprintf(stderr, "Invalid baseline file %s\n", filename);
+		cJSON_Delete(root);
+		return 1;
+	}
+
+	cJSON_ArrayForEach(item, res) {
+		cJSON *name = cJSON_GetObjectItemCaseSensitive(item, "name");
+		cJSON *params = cJSON_GetObjectItemCaseSensitive(item, "params");
+		cJSON *unit = cJSON_GetObjectItemCaseSensitive(item, "unit");
+		cJSON *value = cJSON_GetObjectItemCaseSensitive(item, "value");
+
+		if (!cJSON_IsString(name) || !cJSON_IsString(params) || !cJSON_IsString(unit) || !cJSON_IsNumber(value))
+			continue;
+		for (n = 0; n < nbresults; n++) {
+			if (strcmp(results[n].name, name->valuestring) || strcmp(results[n].params, params->valuestring) ||
+			    strcmp(results[n].unit, unit->valuestring))
+				continue;
+			if (results[n].value > value->valuedouble * (1 + tol / 100)) {
+				fprintf(stderr, "REGRESSION %s %s : %.2f %s, baseline %.2f\n", results[n].name,
+					results[n].params, results[n].value, results[n].unit, value->valuedouble);
+				nbreg++;
+			}
+			break;
+		}
+	}
+	cJSON_Delete(root);
+	return nbreg;
+}
+
+static void writejson(const char *filename)
+{
+	char cpu[128] = "unknown", line[256];
+	FILE *fd;
+	int n;
+
+	fd = fopen("/proc/cpuinfo", "r");
+	if (fd) {
+		while (fgets(line, sizeof(line), fd))
+			if (strncmp(line, "model name", 10) == 0) {
+				char *p = strchr(line, ':');
+
+				if (p)
+					snprintf(cpu, sizeof(cpu), "%s", p + 2);
+				cpu[strcspn(cpu, "\n\"")] = 0;
+				break;
+			}
+		fclose(fd);
+	}
+
+	fd = fopen(filename, "w");
+	if (fd == NULL) {
+		fprintf(stderr, "Could not open %s\n", filename);
+		return;
+	}
+	fprintf(fd, "{\n  \"version\": \"%s\",\n  \"cpu\": \"%s\",\n  \"results\": [\n", ACARSDEC_VERSION, cpu);
+	for (n = 0; n < nbresults; n++)
+		fprintf(fd, "    { \"name\": \"%s\", \"params\": \"%s\", \"unit\": \"%s\", \"value\": %.3f }%s\n",
+			results[n].name, results[n].params, results[n].unit, results[n].value,
+			n < nbresults - 1 ? "," : "");
+	fprintf(fd, "  ]\n}\n");
+	fclose(fd);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Acarsdec-bench/acarsdec-%s microbenchmarks\n", ACARSDEC_VERSION);
+	fprintf(stderr, "Usage: acarsdec-bench [-t seconds] [-r repeat] [-j result.json] [-B baseline.json [-T percent]]");
+#ifdef WITH_SNDFILE
+	fprintf(stderr, " [-w test.wav]");
+#endif
+	fprintf(stderr, "\n\n");
+	fprintf(stderr, " -t seconds\t: duration of each benchmark (default 0.5)\n");
+	fprintf(stderr, " -r repeat\t: run the microbenchmarks repeat times and keep the best (default 3)\n");
+	fprintf(stderr, " -j file\t: save results to a json file\n");
+	fprintf(stderr, " -B file\t: fail if a result is slower than in this previous json result file\n");
+	fprintf(stderr, " -T percent\t: tolerance for the baseline comparison (default 15)\n");
+#ifdef WITH_SNDFILE
+	fprintf(stderr, " -w file\t: the test.wav file shipped with acarsdec (default ./test.wav)\n");
+#endif
+	fprintf(stderr, "\nExit status is 1 if a decoded message differs from the expected one or on a regression\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	static const int mults[] = { 160, 192 };
+	static const int nbcs[] = { 1, 4, 8, 16 };
+	static const int chkfmts[] = { RAWFMT_U8, RAWFMT_CS16, RAWFMT_CF32 };
+	char *jsonfile = NULL;
+	char *basefile = NULL;
+	double tolerance = 15;
+#ifdef WITH_SNDFILE
+	char *wavfile = "test.wav";
+#endif
+	int c, i, j, k, r, repeat = 3, nbreg = 0;
+
+	while ((c = getopt(argc, argv, "t:r:j:B:T:w:")) != EOF) {
+		switch (c) {
+		case 't':
+			benchtime = atof(optarg);
+			break;
+		case 'r':
+			repeat = atoi(optarg);
+			break;
+		case 'j':
+			jsonfile = optarg;
+			break;
+		case 'B':
+			basefile = optarg;
+			break;
+		case 'T':
+			tolerance = atof(optarg);
+			break;
+#ifdef WITH_SNDFILE
+		case 'w':
+			wavfile = optarg;
+			break;
+#endif
+		default:
+			usage();
+		}
+	}
+
+	srand(1);
+
+	for (r = 0; r < repeat; r++) {
+		for (i = 0; i < sizeof(mults) / sizeof(mults[0]); i++)
+			for (j = 0; j < sizeof(nbcs) / sizeof(nbcs[0]); j++)
+				for (k = 0; k < 2; k++)
+					bench_mixchan(mults[i], nbcs[j], k ? CHANFLT_HALFBAND : CHANFLT_BOXCAR);
+		bench_demodmsk(0, 0);
+		bench_demodmsk(6, 0);
+		bench_demodmsk(0, 1);
+		bench_demodmsk(6, 1);
+		for (i = 0; i < sizeof(nbcs) / sizeof(nbcs[0]); i++) {
+			bench_demodchannels(DEMOD_SCALAR, nbcs[i]);
+			bench_demodchannels(DEMOD_SOA, nbcs[i]);
+		}
+		bench_decodeacars();
+		for (i = 1; i <= 3; i++)
+			bench_fixacars(i);
+		bench_fixacars(0);
+		bench_output();
+		bench_decodelabel();
+	}
+
+	for (i = 1; i <= 8; i *= 2)
+		check_raw(RAWFMT_U8, 160, i, DEMOD_SCALAR);
+	for (i = 1; i < sizeof(chkfmts) / sizeof(chkfmts[0]); i++)
+		check_raw(chkfmts[i], 160, 4, DEMOD_SCALAR);
+	check_raw(RAWFMT_U8, 192, 4, DEMOD_SCALAR);
+	check_raw(RAWFMT_U8, 160, 8, DEMOD_SOA);
+	chanFilter = CHANFLT_HALFBAND;
+	check_raw(RAWFMT_U8, 160, 4, DEMOD_SCALAR);
+	chanFilter = CHANFLT_BOXCAR;
+	check_amyield();
+	check_afc();
+	check_autoppm();
+#ifdef WITH_SNDFILE
+	check_wav(wavfile);
+#endif
+
+	printresults();
+	if (jsonfile)
+		writejson(jsonfile);
+	if (basefile)
+		nbreg = checkbaseline(basefile, tolerance);
+
+	if (nbfail || nbreg) {
+		fprintf(stderr, "%d decode check(s) failed, %d regression(s)\n", nbfail, nbreg);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,425 @@
+/*
+ *  Copyright (c) 2015 Thierry Leconte
+ *
+ *
+ *   This code is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Library General Public License version 2
+ *   published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Library General Public License for more details.
+ *
+ */
+
+/*
+ * Binary message archive.
+ *
+ * An archive file is a small header followed by length prefixed records,
+ * one per validated message block. Every ARCIDXSTEP records an entry is
+ * appended to a companion ".idx" file giving the time span, the byte range
+ * and a small bloom filter of the aircraft addresses of that chunk, so that
+ * a replay restricted to a time window or a tail only reads the relevant
+ * parts of the archive.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <time.h>
+#include <errno.h>
+
+#include "acarsdec.h"
+#include "output.h"
+#include "metrics.h"
+#include "probes.h"
+
+#define ARCMAGIC "ACARSARC"
+#define IDXMAGIC "ACARSIDX"
+#define ARCVERSION 1
+#define ARCIDXSTEP 64
+#define ARCRETRY 10	/* seconds between two tries to reopen a rotated archive */
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+} __attribute__((packed)) archdr_t;
+
+typedef struct {
+	uint16_t rlen;		/* bytes following this field */
+	uint8_t chn;
+	uint8_t err;
+	int64_t sec;
+	uint32_t usec;
+	float lvl;
+	float freq;
+	char mode, ack, bid, bs, be;
+	char label[3];
+	char addr[8];
+	char no[5];
+	char fid[7];
+	char sublabel[3];
+	char mfi[3];
+	unsigned char crc[2];
+	uint8_t len;
+	/* followed by len bytes of text */
+} __attribute__((packed)) arcrec_t;
+
+typedef struct {
+	int64_t first, last;
+	uint64_t start, end;
+	uint64_t tails;
+} __attribute__((packed)) arcidx_t;
+
+static char *arc_prefix = NULL;
+static char *arc_ext = NULL;
+static struct tm arc_tm;
+static time_t arc_retry;
+static FILE *arcfd = NULL;
+static FILE *idxfd = NULL;
+static arcidx_t curidx;
+static int curnb;
+
+/* replay */
+static char **replay_files = NULL;
+
+static uint64_t tailbits(const char *addr)
+{
+	uint32_t h = 2166136261u;
+
+	while (*addr) {
+		h ^= (unsigned char)*addr++;
+		h *= 16777619u;
+	}
+	return (1ULL << (h & 63)) | (1ULL << ((h >> 8) & 63));
+}
+
+static void flushidx(void)
+{
+	if (curnb == 0 || idxfd == NULL)
+		return;
+	curidx.end = ftell(arcfd);
+	fwrite(&curidx, sizeof(curidx), 1, idxfd);
+	fflush(idxfd);
+	curnb = 0;
+}
+
+static int open_archive(void)
+{
+	char *filename, *idxname;
+	char suffix[16];
+	size_t tlen = 0;
+	archdr_t hdr;
+	struct tm tm;
+
+	suffix[0] = '\0';
+	if (hourly || daily) {
+		time_t t = time(NULL);
+		gmtime_r(&t, &tm);
+		tlen = strftime(suffix, sizeof(suffix), hourly ? "_%Y%m%d_%H" : "_%Y%m%d", &tm);
+		if (tlen == 0) {
+			fprintf(stderr, "open_archive(): strftime returned 0\n");
+			return -1;
+		}
+	}
+
+	filename = malloc(strlen(arc_prefix) + tlen + strlen(arc_ext) + 1);
+	idxname = malloc(strlen(arc_prefix) + tlen + strlen(arc_ext) + 5);
+	if (filename == NULL || idxname == NULL) {
+		fprintf(stderr, "open_archive(): failed to allocate memory\n");
+		free(filename);
+		free(idxname);
+		return -1;
+	}
+	sprintf(filename, "%s%s%s", arc_prefix, suffix, arc_ext);
+	sprintf(idxname, "%s.idx", filename);
+
+	if ((arcfd = fopen(filename, "a")) == NULL) {
+		fprintf(stderr, "Could not open archive file %s: %s\n", filename, strerror(errno));
+		goto fail;
+	}
+	if (ftell(arcfd) == 0) {
+		memcpy(hdr.magic, ARCMAGIC, 8);
+		hdr.version = ARCVERSION;
+		fwrite(&hdr, sizeof(hdr), 1, arcfd);
+	}
+
+	if ((idxfd = fopen(idxname, "a")) == NULL) {
+		fprintf(stderr, "Could not open archive index %s: %s\n", idxname, strerror(errno));
+		fclose(arcfd);
+		arcfd = NULL;
+		goto fail;
+	}
+	if (ftell(idxfd) == 0) {
+		memcpy(hdr.magic, IDXMAGIC, 8);
+		hdr.version = ARCVERSION;
+		fwrite(&hdr, sizeof(hdr), 1, idxfd);
+	}
+
+	/* only once opened, so that a failed rotation is tried again */
+	if (hourly || daily)
+		arc_tm = tm;
+	curnb = 0;
+	free(filename);
+	free(idxname);
+	return 0;
+
+ fail:
+	free(filename);
+	free(idxname);
+	return -1;
+}
+
+int Binoutinit(char *arcfilename)
+{
+	char *basename, *ext;
+
+	arc_prefix = strdup(arcfilename);
+	if (arc_prefix == NULL)
+		return -1;
+
+	basename = strrchr(arc_prefix, '/');
+	basename = basename ? basename + 1 : arc_prefix;
+	ext = strrchr(arc_prefix, '.');
+	if (ext != NULL && (ext <= basename || ext[1] == '\0'))
+		ext = NULL;
+	if ((hourly || daily) && ext) {
+		arc_ext = strdup(ext);
+		*ext = '\0';
+	} else {
+		arc_ext = strdup("");
+	}
+
+	return open_archive();
+}
+
+static void rotate_archive(void)
+{
+	struct tm new_tm;
+	time_t t = time(NULL);
+
+	if (arcfd == NULL) {
+		if (t - arc_retry < ARCRETRY)
+			return;
+		arc_retry = t;
+		open_archive();
+		return;
+	}
+	gmtime_r(&t, &new_tm);
+	if ((hourly && new_tm.tm_hour != arc_tm.tm_hour) ||
+	    (daily && new_tm.tm_mday != arc_tm.tm_mday)) {
+		Binoutclose();
+		arc_retry = t;
+		open_archive();
+	}
+}
+
+void Binoutwrite(const msgblk_t *blk, const acarsmsg_t *msg)
+{
+	arcrec_t rec;
+
+	if (hourly || daily)
+		rotate_archive();
+	if (arcfd == NULL) {
+		METRIC_INC(metrics.sink[SINK_ARCHIVE].errors);
+		PROBE3(output_sink, blk->chn, SINK_ARCHIVE, -1);
+		return;
+	}
+
+	memset(&rec, 0, sizeof(rec));
+	rec.rlen = sizeof(rec) - sizeof(rec.rlen) + blk->len;
+	rec.chn = blk->chn;
+	rec.err = blk->err;
+	rec.sec = blk->tv.tv_sec;
+	rec.usec = blk->tv.tv_usec;
+	rec.lvl = blk->lvl;
+	rec.freq = channel[blk->chn].Fr;
+	rec.mode = msg->mode;
+	rec.ack = msg->ack;
+	rec.bid = msg->bid;
+	rec.bs = msg->bs;
+	rec.be = msg->be;
+	memcpy(rec.label, msg->label, sizeof(rec.label));
+	memcpy(rec.addr, msg->addr, sizeof(rec.addr));
+	memcpy(rec.no, msg->no, sizeof(rec.no));
+	memcpy(rec.fid, msg->fid, sizeof(rec.fid));
+	memcpy(rec.sublabel, msg->sublabel, sizeof(rec.sublabel));
+	memcpy(rec.mfi, msg->mfi, sizeof(rec.mfi));
+	memcpy(rec.crc, blk->crc, 2);
+	rec.len = blk->len;
+
+	if (curnb == 0) {
+		curidx.first = rec.sec;
+		curidx.start = ftell(arcfd);
+		curidx.tails = 0;
+	}
+	curidx.last = rec.sec;
+	curidx.tails |= tailbits(rec.addr);
+
+	if (fwrite(&rec, sizeof(rec), 1, arcfd) != 1
+	    || fwrite(blk->txt, 1, blk->len, arcfd) != blk->len || fflush(arcfd)) {
+		METRIC_INC(metrics.sink[SINK_ARCHIVE].errors);
+		PROBE3(output_sink, blk->chn, SINK_ARCHIVE, -1);
+	} else {
+		METRIC_INC(metrics.sink[SINK_ARCHIVE].sent);
+		PROBE3(output_sink, blk->chn, SINK_ARCHIVE, 0);
+	}
+
+	if (++curnb >= ARCIDXSTEP)
+		flushidx();
+}
+
+void Binoutclose(void)
+{
+	if (arcfd == NULL)
+		return;
+	flushidx();
+	fclose(arcfd);
+	arcfd = NULL;
+	if (idxfd)
+		fclose(idxfd);
+	idxfd = NULL;
+}
+
+/* archive replay */
+int initReplay(char **argv, int optind)
+{
+	if (argv[optind] == NULL) {
+		fprintf(stderr, "Need at least one archive file after --replay\n");
+		return 1;
+	}
+	replay_files = &(argv[optind]);
+	nbch = 0;
+	return 0;
+}
+
+static int replayrange(FILE *fd, uint64_t start, uint64_t end)
+{
+	arcrec_t rec;
+	msgblk_t blk;
+
+	if (fseek(fd, start, SEEK_SET))
+		return -1;
+
+	while ((end == 0 || (uint64_t)ftell(fd) < end) && fread(&rec, sizeof(rec), 1, fd) == 1) {
+		if (rec.rlen != sizeof(rec) - sizeof(rec.rlen) + rec.len) {
+			fprintf(stderr, "corrupted archive record at %ld\n", ftell(fd) - (long)sizeof(rec));
+			return -1;
+		}
+		if (rec.len > sizeof(blk.txt)) {
+			fprintf(stderr, "corrupted archive record at %ld\n", ftell(fd) - (long)sizeof(rec));
+			return -1;
+		}
+		if (fread(blk.txt, 1, rec.len, fd) != rec.len)
+			return -1;
+		if (signalExit)
+			return 0;
+
+		if (arcsince && rec.sec < arcsince)
+			continue;
+		if (arcuntil && rec.sec > arcuntil)
+			continue;
+		if (arctail && strncmp(arctail, rec.addr, sizeof(rec.addr)))
+			continue;
+		if (rec.chn >= MAXNBCHANNELS)
+			continue;
+
+		blk.prev = NULL;
+		blk.chn = rec.chn;
+		blk.tv.tv_sec = rec.sec;
+		blk.tv.tv_usec = rec.usec;
+		blk.len = rec.len;
+		blk.err = rec.err;
+		blk.lvl = rec.lvl;
+		memcpy(blk.crc, rec.crc, 2);
+		channel[rec.chn].Fr = rec.freq;
+		if (rec.chn >= nbch)
+			nbch = rec.chn + 1;
+
+		outputmsg(&blk);
+	}
+	return 0;
+}
+
+static int replayfile(char *filename)
+{
+	FILE *fd, *ifd;
+	archdr_t hdr;
+	arcidx_t idx;
+	uint64_t pos;
+	char *idxname;
+	uint64_t tmask = 0;
+	int res = 0;
+
+	if ((fd = fopen(filename, "r")) == NULL) {
+		fprintf(stderr, "Could not open archive %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, fd) != 1 || memcmp(hdr.magic, ARCMAGIC, 8)
+	    || hdr.version != ARCVERSION) {
+		fprintf(stderr, "%s is not an acarsdec archive\n", filename);
+		fclose(fd);
+		return -1;
+	}
+	pos = sizeof(hdr);
+
+	idxname = malloc(strlen(filename) + 5);
+	if (idxname == NULL) {
+		fclose(fd);
+		return -1;
+	}
+	sprintf(idxname, "%s.idx", filename);
+	ifd = fopen(idxname, "r");
+	free(idxname);
+
+	if (ifd && (fread(&hdr, sizeof(hdr), 1, ifd) != 1 || memcmp(hdr.magic, IDXMAGIC, 8))) {
+		fclose(ifd);
+		ifd = NULL;
+	}
+
+	if (arctail)
+		tmask = tailbits(arctail);
+
+	if (ifd) {
+		while (res == 0 && fread(&idx, sizeof(idx), 1, ifd) == 1) {
+			/* records of a run stopped before writing their index entry */
+			if (idx.start > pos)
+				res = replayrange(fd, pos, idx.start);
+			if (idx.end > pos)
+				pos = idx.end;
+			if (res || (arcsince && idx.last < arcsince))
+				continue;
+			if (arcuntil && idx.first > arcuntil)
+				continue;
+			if (tmask && (idx.tails & tmask) != tmask)
+				continue;
+			res = replayrange(fd, idx.start, idx.end);
+		}
+		fclose(ifd);
+	}
+
+	/* records not yet covered by an index entry */
+	if (res == 0)
+		res = replayrange(fd, pos, 0);
+
+	fclose(fd);
+	return res;
+}
+
+int runReplay(void)
+{
+	int n, res = 0;
+
+	for (n = 0; replay_files[n] && !signalExit; n++) {
+		if (verbose)
+			fprintf(stderr, "replaying %s\n", replay_files[n]);
+		if (replayfile(replay_files[n]))
+			res = -1;
+	}
+	return res;
+}
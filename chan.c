@@ -0,0 +1,776 @@
+/*
+ *  Copyright (c) 2016 Thierry Leconte
+ *
+ *
+ *   This code is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Library General Public License version 2
+ *   published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Library General Public License for more details.
+ *
+ */
+
+/*
+ * Channelizer shared by the complex IQ front ends (rtl dongle, raw IQ files,
+ * soapy) : each channel is mixed down and decimated by chanMult to INTRATE,
+ * then AM demodulated into its dm_buffer.
+ *
+ * Two decimation chains :
+ *  - boxcar (default) : the chanMult mixed samples are summed (integrate and dump).
+ *    Cheap, but adjacent channels are only attenuated by ~17dB.
+ *  - halfband : integrate and dump by chanMult/4 down to 4*INTRATE
+ *    (a first order CIC, merged with the mixer), then two half band FIR
+ *    decimators by 2. Adjacent channels are attenuated by more than 40dB
+ *    and the passband is flatter, for a mixing about 1.5 times slower.
+ *
+ * The decimated complex samples are then AM demodulated, either by their
+ * envelope (cabsf) or coherently : a carrier PLL, helped by a FLL to pull in
+ * the frequency offset at the start of a burst, turns the channel into real
+ * audio with its in phase component. The quadrature noise is discarded, and
+ * there is no square root. An optional DC block removes the carrier level.
+ *
+ * With --afc, the carrier offset of each channel is measured from the
+ * rotation between its consecutive samples, weighted by their power so that
+ * bursts count and noise averages out, and the mixer is retuned towards it
+ * between two blocks : the channel filter stays centered on drifting tuners.
+ * With --auto-ppm, the offset over the last 40ms of carrier is kept too, for
+ * the tuner error estimation of ppm.c at the end of each frame.
+ * With --survey, the mean power and the carrier duty of each channel are
+ * summed up for the survey.c statistics.
+ *
+ * Each channel is mixed from its own center frequency : with --hop, only
+ * the channels of the current group (hopGroup) are mixed and demodulated,
+ * the others keep their state until the tuner comes back to them.
+ * When survey.c or hop.c need another center frequency, the input thread
+ * asks for it with chanTuneTo and drops its buffers until the front end
+ * control loop, woken by chanWaitTune, has set the device.
+ *
+ * The mixing cost is proportional to the sample rate : chanPlan gives the
+ * rtl and soapy front ends the lowest one where all the channels fit, with
+ * the center frequency keeping them the furthest from the DC spike, the band
+ * edges and the IQ imbalance images of each other (a channel at Fc+d is
+ * mirrored at Fc-d).
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <limits.h>
+#include "acarsdec.h"
+#include "metrics.h"
+
+#define HB1LEN 11	/* 4*INTRATE -> 2*INTRATE */
+#define HB2LEN 19	/* 2*INTRATE -> INTRATE */
+
+/* planner : channels clear of the DC spike and the band edges, and of the images in their bandwidth */
+#define PLANDC (2 * INTRATE)
+#define PLANEDGE (2 * INTRATE)
+#define PLANIMAGE (INTRATE / 2)
+#define PLANSTEP 1000
+
+/*
+ * coherent AM loop, at INTRATE : 190Hz PLL, 16ms FLL and power time constants, 30Hz DC block.
+ * The loop must lock during the 53ms preamble of a burst, a narrower one loses most of the weak ones.
+ */
+#define AMKP 0.04f
+#define AMKI 0.0008f
+#define AMKF 0.005f
+#define AMPWRK (1.0f / 200)
+#define AMFMAX 0.5f
+#define AMDCK 0.015f
+/* noise floor : fast down, 5s up, the carrier being AMCARRIER times above */
+#define AMFLOORDN (1.0f / 16)
+#define AMFLOORUP (1.0f / 65536)
+#define AMCARRIER 2.0f
+/* lock detector, 5ms time constant */
+#define AMLOCKK (1.0f / 64)
+#define AMLOCK 0.3f
+
+typedef struct {
+	/* center frequency, the mixer table restarts every chanMult samples : phase of the current block */
+	unsigned int Fc;
+	float complex rot, rotstep;
+	/* half band filters histories, followed by the samples of the current block */
+	float complex d1[HB1LEN - 1 + 4], d2[HB2LEN - 1 + 2];
+	/* coherent AM : carrier nco, loop frequency, last derotated sample, power, lock and dc estimates */
+	float complex nco, prev;
+	float freq, pwr, floor, lock, dc;
+	int settle;
+	/* afc : last sample, sum of the rotations between samples during bursts,
+	   outputs and burst samples since the last retune */
+	float complex afcprev, afcacc;
+	int afccnt, afcburst;
+	/* auto ppm : mean rotation between samples over the last carrier samples */
+	float complex ppmacc;
+	/* survey : power sum, samples and carrier samples */
+	double svpwr;
+	unsigned long svnb, svcarrier;
+} chstate_t;
+
+/*
+ * afc : retune every 0.25s by half the offset measured on at least 20ms of bursts,
+ * within AFCMAX Hz of the channel
+ */
+#define AFCPERIOD (INTRATE / 4)
+#define AFCMINBURST (INTRATE / 50)
+#define AFCGAIN 0.5f
+#define AFCMAX 5000
+/* auto ppm : 40ms of carrier */
+#define PPMACCK (1.0f / 512)
+
+static int chanMult;
+static int chanBufsz;
+static int chanHb;
+static float chanScale;
+static chstate_t chs[MAXNBCHANNELS];
+static float hb1[HB1LEN], hb2[HB2LEN];
+/* center frequency asked by the input thread, and set by the front end */
+static unsigned int tuneWant, tuneDone;
+static pthread_mutex_t tuneMtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tuneCnd = PTHREAD_COND_INITIALIZER;
+/* control socket : channel change posted by the control thread, applied by the input thread */
+static struct {
+	enum { CHOP_ADD, CHOP_REMOVE, CHOP_RETUNE } op;
+	int n;
+	float Fr;
+	float complex *wf, rotstep;
+} chanOp;
+static int chanOpState;		/* 0 : none, 1 : posted, 2 : being applied */
+static pthread_mutex_t chanOpMtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t chanOpCnd = PTHREAD_COND_INITIALIZER;
+
+/* blackman windowed half band low pass, len = 4k+3 */
+static void halfband(float *h, int len)
+{
+	int i, c = (len - 1) / 2;
+	float sum = 0;
+
+	for (i = 0; i < len; i++) {
+		int k = i - c;
+		double w = 0.42 - 0.5 * cos(2 * M_PI * (i + 1) / (len + 1)) + 0.08 * cos(4 * M_PI * (i + 1) / (len + 1));
+
+		if (k == 0)
+			h[i] = 0.5;
+		else if (k % 2 == 0)
+			h[i] = 0;
+		else
+			h[i] = sin(M_PI * k / 2) / (M_PI * k) * w;
+		sum += h[i];
+	}
+	for (i = 0; i < len; i++)
+		h[i] /= sum;
+}
+
+/* mixer table of a channel at Fr from Fc into wf, and its rotation per block */
+static void mixer(double Fr, unsigned int Fc, float complex *wf, float complex *rotstep)
+{
+	int ind, div = chanHb ? chanMult / 4 : chanMult;
+	double AMFreq;
+
+	AMFreq = (Fr - (double)Fc) / (double)(INTRATE * chanMult) * 2.0 * M_PI;
+	for (ind = 0; ind < chanMult; ind++) {
+		wf[ind] = cexpf(AMFreq * ind * -I) / div * chanScale;
+	}
+	*rotstep = cexp(-I * fmod(AMFreq * chanMult, 2.0 * M_PI));
+}
+
+/* mixer table and block rotation of channel n, tuned at Fr + afcoff */
+static void tuneChan(int n)
+{
+	channel_t *ch = &(channel[n]);
+
+	mixer(ch->Fr + ch->afcoff, chs[n].Fc, ch->wf, &(chs[n].rotstep));
+}
+
+/* restart the state of channel n, centered on Fc */
+static void resetChan(int n, unsigned int Fc)
+{
+	memset(&(chs[n]), 0, sizeof(chstate_t));
+	chs[n].Fc = Fc;
+	chs[n].rot = 1;
+	chs[n].nco = 1;
+	chs[n].settle = 2 / AMPWRK;
+	channel[n].afcoff = 0;
+}
+
+int initChan(unsigned int Fc, int mult, float scale, int bufsz)
+{
+	int n;
+
+	chanMult = mult;
+	chanScale = scale;
+	chanBufsz = bufsz;
+	chanHb = (chanFilter == CHANFLT_HALFBAND);
+	if (chanHb && mult % 4) {
+		fprintf(stderr, "WARNING: sample rate multiplier %d is not a multiple of 4, using boxcar channel filter\n", mult);
+		chanHb = 0;
+	}
+	if (chanHb) {
+		halfband(hb1, HB1LEN);
+		halfband(hb2, HB2LEN);
+	}
+
+	for (n = 0; n < nbch; n++) {
+		channel_t *ch = &(channel[n]);
+
+		ch->wf = malloc(mult * sizeof(float complex));
+		ch->dm_buffer = malloc(bufsz * sizeof(float));
+		if (ch->wf == NULL || ch->dm_buffer == NULL) {
+			fprintf(stderr, "ERROR : malloc\n");
+			return 1;
+		}
+	}
+	retuneChan(Fc);
+	tuneWant = tuneDone = Fc;
+
+	return 0;
+}
+
+/* restart the nbch first channels at their Fr, the input being now centered on Fc */
+void retuneChan(unsigned int Fc)
+{
+	int n;
+
+	for (n = 0; n < nbch; n++) {
+		resetChan(n, Fc);
+		tuneChan(n);
+	}
+}
+
+/* front end, with the input stopped by an outage : restart every channel, return the center frequency to set again */
+unsigned int chanRestart(void)
+{
+	int n;
+
+	for (n = 0; n < nbch; n++) {
+		resetChan(n, chs[n].Fc);
+		tuneChan(n);
+		resetAcars(&(channel[n]));
+	}
+	return tuneDone;
+}
+
+/* mix channel n from Fc, keeping its state */
+void chanSetFc(int n, unsigned int Fc)
+{
+	chs[n].Fc = Fc;
+	tuneChan(n);
+}
+
+/* clearance of the channels fr at Fc from the DC spike, the band edges and their images, -1 if they do not fit in rate */
+static int planClear(const unsigned int *fr, int nb, int rate, int Fc)
+{
+	int i, j, c = rate;
+
+	for (i = 0; i < nb; i++) {
+		int d = (int)fr[i] - Fc;
+
+		if (abs(d) > rate / 2 - PLANEDGE || abs(d) < PLANDC)
+			return -1;
+		if (abs(d) - PLANDC < c)
+			c = abs(d) - PLANDC;
+		if (rate / 2 - PLANEDGE - abs(d) < c)
+			c = rate / 2 - PLANEDGE - abs(d);
+		for (j = i + 1; j < nb; j++) {
+			int m = abs(d + (int)fr[j] - Fc);
+
+			if (m < PLANIMAGE)
+				return -1;
+			if (m - PLANIMAGE < c)
+				c = m - PLANIMAGE;
+		}
+	}
+	return c;
+}
+
+/* center frequency with the most clearance for the channels fr at rate, 0 if they do not fit */
+unsigned int chanPlanFc(const unsigned int *fr, int nb, int rate)
+{
+	int lo = 0, hi = INT_MAX, Fc, c, best = -1;
+	unsigned int bFc = 0;
+	int n;
+
+	for (n = 0; n < nb; n++) {
+		if ((int)fr[n] - rate / 2 + PLANEDGE > lo)
+			lo = fr[n] - rate / 2 + PLANEDGE;
+		if ((int)fr[n] + rate / 2 - PLANEDGE < hi)
+			hi = fr[n] + rate / 2 - PLANEDGE;
+	}
+	for (Fc = lo - lo % PLANSTEP; Fc <= hi; Fc += PLANSTEP) {
+		c = planClear(fr, nb, rate, Fc);
+		if (c > best) {
+			best = c;
+			bFc = Fc;
+		}
+	}
+	return bFc;
+}
+
+/* complex multiply-adds per second to mix and filter nb channels at INTRATE * mult */
+static double planCost(int mult, int nb)
+{
+	double c = (double)INTRATE * mult * nb;
+
+	if (chanFilter == CHANFLT_HALFBAND && mult % 4 == 0)
+		c += (double)INTRATE * nb * (2 * (HB1LEN / 2 + 2) + HB2LEN / 2 + 2);
+	return c;
+}
+
+/*
+ * lowest sample rate multiplier from minmult to maxmult, by 4, that rateok
+ * accepts (if not NULL) and where the channels fr fit, with its center
+ * frequency in *Fc (kept if not 0). Return 0 if none fits.
+ */
+int chanPlan(const unsigned int *fr, int nb, int minmult, int maxmult, int (*rateok)(int rate), unsigned int *Fc)
+{
+	int mult;
+
+	for (mult = minmult; mult <= maxmult; mult += 4) {
+		int rate = INTRATE * mult;
+		unsigned int fc;
+
+		if (rateok && !rateok(rate))
+			continue;
+		if (*Fc)
+			fc = planClear(fr, nb, rate, *Fc) >= 0 ? *Fc : 0;
+		else
+			fc = chanPlanFc(fr, nb, rate);
+		if (fc == 0)
+			continue;
+
+		fprintf(stderr, "Sample rate %.4f MS/s (-m %d), center frequency %.4f MHz : about %.1fM complex MAC/s for %d channels\n",
+			rate / 1e6, mult, fc / 1e6, planCost(mult, nb) / 1e6, nb);
+		*Fc = fc;
+		return mult;
+	}
+	if (*Fc)
+		fprintf(stderr, "Frequencies do not fit around %.4f MHz\n", *Fc / 1e6);
+	else
+		fprintf(stderr, "Frequencies too far apart, see --hop\n");
+	return 0;
+}
+
+/* survey : mean power and noise floor in dB, and carrier duty of channel n since the last call */
+void chanEnergy(int n, float *lvl, float *floor, float *duty)
+{
+	chstate_t *st = &(chs[n]);
+
+	*lvl = st->svnb ? 10 * log10(st->svpwr / st->svnb + 1e-20) : -200;
+	*floor = 10 * log10(st->floor + 1e-20);
+	*duty = st->svnb ? (float)st->svcarrier / st->svnb : 0;
+	st->svpwr = 0;
+	st->svnb = st->svcarrier = 0;
+}
+
+/* half band filter output on the len samples starting at w */
+static inline float complex hbout(const float complex *w, const float *h, int len)
+{
+	int c = (len - 1) / 2, k;
+	float complex y = h[c] * w[c];
+
+	for (k = 1; k <= c; k += 2)
+		y += h[c + k] * (w[c - k] + w[c + k]);
+	return y;
+}
+
+static const char *amnames[] = { "e", "c", "cd" };
+
+int parseAmDetector(const char *s)
+{
+	if (strcmp(s, "envelope") == 0)
+		return AMDET_ENVELOPE;
+	if (strcmp(s, "coherent") == 0)
+		return AMDET_COHERENT;
+	if (strcmp(s, "coherent-dc") == 0)
+		return AMDET_COHERENT_DC;
+	return -1;
+}
+
+/* AM detector of a channel given as freq[:e|:c|:cd], amDetector by default */
+int chanAmDetector(const char *argF)
+{
+	const char *sfx = strchr(argF, ':');
+	int d;
+
+	if (sfx == NULL)
+		return amDetector;
+	for (d = 0; d < 3; d++)
+		if (strcmp(sfx + 1, amnames[d]) == 0)
+			return d;
+	fprintf(stderr, "WARNING: unknown AM detector %s for %s\n", sfx + 1, argF);
+	return amDetector;
+}
+
+/* channel power and noise floor, for the coherent detector and the afc */
+static inline void chanpower(chstate_t *st, float complex y)
+{
+	float p = crealf(y) * crealf(y) + cimagf(y) * cimagf(y);
+
+	st->pwr += (p - st->pwr) * AMPWRK;
+	/* no carrier detection until the power estimate has settled */
+	if (st->settle) {
+		st->settle--;
+		st->floor = st->pwr;
+	} else if (st->pwr < st->floor)
+		st->floor += (st->pwr - st->floor) * AMFLOORDN;
+	else
+		st->floor += (st->pwr - st->floor) * AMFLOORUP;
+}
+
+static inline float amdetect(const channel_t *ch, chstate_t *st, float complex y)
+{
+	float complex z;
+	float re, im, perr, ferr, dphi, out;
+
+	if (ch->amdet == AMDET_ENVELOPE)
+		return cabsf(y);
+
+	z = y * st->nco;
+	re = crealf(z);
+	im = cimagf(z);
+
+	/* like sin(phase error), but with no false lock at pi as the AM carrier is never inverted */
+	perr = im / (fabsf(re) + fabsf(im) + 1e-20f);
+	/* rotation since the previous sample : residual frequency */
+	ferr = cimagf(z * conjf(st->prev)) / (st->pwr + 1e-20f);
+	st->prev = z;
+	/* power in phase minus in quadrature : near 1 once locked, 0 if not */
+	st->lock += ((re * re - im * im) / (st->pwr + 1e-20f) - st->lock) * AMLOCKK;
+
+	/* between bursts the loop would random walk on noise : hold it until a carrier shows up */
+	if (st->pwr > AMCARRIER * st->floor) {
+		/* the FLL pulls the frequency in, then lets the much less noisy PLL alone */
+		st->freq += AMKI * perr;
+		if (st->lock < AMLOCK)
+			st->freq += AMKF * ferr;
+		if (st->freq > AMFMAX)
+			st->freq = AMFMAX;
+		if (st->freq < -AMFMAX)
+			st->freq = -AMFMAX;
+		dphi = st->freq + AMKP * perr;
+	} else
+		dphi = st->freq;
+	st->nco *= 1 - dphi * I;
+	st->nco *= 1.5f - 0.5f * (crealf(st->nco) * crealf(st->nco) + cimagf(st->nco) * cimagf(st->nco));
+
+	out = re;
+	if (ch->amdet == AMDET_COHERENT_DC) {
+		st->dc += (re - st->dc) * AMDCK;
+		out -= st->dc;
+	}
+	return out;
+}
+
+/* measure the carrier offset of channel n, and retune its mixer between two blocks */
+static inline void afcChan(int n, float complex y)
+{
+	channel_t *ch = &(channel[n]);
+	chstate_t *st = &(chs[n]);
+	float off;
+
+	/* noise alone would make the offset random walk */
+	if (st->pwr > AMCARRIER * st->floor) {
+		st->afcacc += y * conjf(st->afcprev);
+		st->afcburst++;
+	}
+	if (++(st->afccnt) < AFCPERIOD)
+		return;
+	if (st->afcburst < AFCMINBURST) {
+		st->afcacc = 0;
+		st->afccnt = st->afcburst = 0;
+		return;
+	}
+
+	off = ch->afcoff + AFCGAIN * cargf(st->afcacc) * INTRATE / (2 * M_PI);
+	if (off > AFCMAX)
+		off = AFCMAX;
+	if (off < -AFCMAX)
+		off = -AFCMAX;
+	if (fabsf(off - ch->afcoff) >= 1) {
+		ch->afcoff = off;
+		tuneChan(n);
+		METRIC_SET(metrics.ch[n].afc, lrintf(off));
+	}
+	st->afcacc = 0;
+	st->afccnt = st->afcburst = 0;
+}
+
+/* demodulate output sample m of channel n, then go to the phase of the next block */
+static inline void chanout(int n, int m, float complex y)
+{
+	channel_t *ch = &(channel[n]);
+	chstate_t *st = &(chs[n]);
+
+	if (ch->amdet != AMDET_ENVELOPE || afc || autoPpm || surveyBand)
+		chanpower(st, y);
+	if (surveyBand) {
+		st->svpwr += st->pwr;
+		st->svnb++;
+		st->svcarrier += st->pwr > AMCARRIER * st->floor;
+	}
+	ch->dm_buffer[m] = amdetect(ch, st, y);
+	if (autoPpm && st->pwr > AMCARRIER * st->floor)
+		st->ppmacc += (y * conjf(st->afcprev) - st->ppmacc) * PPMACCK;
+	if (afc)
+		afcChan(n, y);
+	st->afcprev = y;
+
+	/* keep |rot| at 1, first order is enough as it is corrected every block */
+	st->rot *= st->rotstep;
+	st->rot *= 1.5f - 0.5f * (crealf(st->rot) * crealf(st->rot) + cimagf(st->rot) * cimagf(st->rot));
+}
+
+/* carrier offset of channel n from its frequency, over its last 40ms of carrier, in Hz */
+float chanOffset(int n)
+{
+	return channel[n].afcoff + cargf(chs[n].ppmacc) * INTRATE / (2 * M_PI);
+}
+
+/* input thread, between two blocks : apply the posted channel change */
+static void chanApply(void)
+{
+	int posted = 1, n = chanOp.n;
+	float complex *wf;
+
+	if (!__atomic_compare_exchange_n(&chanOpState, &posted, 2, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	switch (chanOp.op) {
+	case CHOP_ADD:
+		channel[n].hopgrp = 0;
+		if (n == nbch)
+			nbch++;
+		break;
+	case CHOP_REMOVE:
+		channel[n].hopgrp = CHANOFF;
+		resetAcars(&(channel[n]));
+		break;
+	case CHOP_RETUNE:
+		resetChan(n, chs[n].Fc);
+		wf = channel[n].wf;
+		channel[n].wf = chanOp.wf;
+		chanOp.wf = wf;
+		chs[n].rotstep = chanOp.rotstep;
+		channel[n].Fr = chanOp.Fr;
+		resetAcars(&(channel[n]));
+		break;
+	}
+
+	pthread_mutex_lock(&chanOpMtx);
+	__atomic_store_n(&chanOpState, 0, __ATOMIC_RELEASE);
+	pthread_cond_signal(&chanOpCnd);
+	pthread_mutex_unlock(&chanOpMtx);
+}
+
+/* mix and decimate chanMult input samples into output sample m of every channel */
+void mixChan(const float complex *vb, int m)
+{
+	int n;
+
+	if (m == 0 && __atomic_load_n(&chanOpState, __ATOMIC_ACQUIRE))
+		chanApply();
+
+	if (chanHb) {
+		int q = chanMult / 4;
+
+		for (n = 0; n < nbch; n++) {
+			channel_t *ch = &(channel[n]);
+			chstate_t *st = &(chs[n]);
+			const float complex *wf = ch->wf;
+			int s, ind;
+
+			if (ch->hopgrp != hopGroup)
+				continue;
+
+			/* integrate and dump by q, then back to the phase of the block */
+			for (s = 0; s < 4; s++) {
+				const float complex *v = vb + s * q, *w = wf + s * q;
+				float complex d = 0;
+
+				for (ind = 0; ind < q; ind++)
+					d += v[ind] * w[ind];
+				st->d1[HB1LEN - 1 + s] = d * st->rot;
+			}
+			/* half band decimations by 2 */
+			st->d2[HB2LEN - 1] = hbout(st->d1 + 1, hb1, HB1LEN);
+			st->d2[HB2LEN] = hbout(st->d1 + 3, hb1, HB1LEN);
+			chanout(n, m, hbout(st->d2 + 1, hb2, HB2LEN));
+			memmove(st->d1, st->d1 + 4, (HB1LEN - 1) * sizeof(float complex));
+			memmove(st->d2, st->d2 + 2, (HB2LEN - 1) * sizeof(float complex));
+		}
+		return;
+	}
+
+	for (n = 0; n < nbch; n++) {
+		channel_t *ch = &(channel[n]);
+		float complex D, *wf;
+
+		if (ch->hopgrp != hopGroup)
+			continue;
+
+		wf = ch->wf;
+		D = 0;
+		for (int ind = 0; ind < chanMult; ind++) {
+			D += vb[ind] * wf[ind];
+		}
+		chanout(n, m, D * chs[n].rot);
+	}
+}
+
+/* input thread : ask the front end to center the device on Fc */
+void chanTuneTo(unsigned int Fc)
+{
+	pthread_mutex_lock(&tuneMtx);
+	tuneWant = Fc;
+	pthread_cond_signal(&tuneCnd);
+	pthread_mutex_unlock(&tuneMtx);
+}
+
+/* input thread : 1 once the device is on the last asked center frequency */
+int chanTuned(void)
+{
+	int r;
+
+	pthread_mutex_lock(&tuneMtx);
+	r = (tuneDone == tuneWant);
+	pthread_mutex_unlock(&tuneMtx);
+	return r;
+}
+
+/* front end control loop : wait up to ms for a center frequency to set, 0 if none */
+unsigned int chanWaitTune(int ms)
+{
+	struct timespec ts;
+	unsigned int Fc;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += (long)ms * 1000000;
+	ts.tv_sec += ts.tv_nsec / 1000000000;
+	ts.tv_nsec %= 1000000000;
+
+	pthread_mutex_lock(&tuneMtx);
+	while (tuneWant == tuneDone)
+		if (pthread_cond_timedwait(&tuneCnd, &tuneMtx, &ts))
+			break;
+	Fc = tuneWant != tuneDone ? tuneWant : 0;
+	pthread_mutex_unlock(&tuneMtx);
+	return Fc;
+}
+
+/* front end control loop : the device is now on Fc */
+void chanTuneDone(unsigned int Fc)
+{
+	pthread_mutex_lock(&tuneMtx);
+	tuneDone = Fc;
+	pthread_mutex_unlock(&tuneMtx);
+}
+
+/* control thread : have chanOp applied by the input thread, 0 if it did not within 2s */
+static int chanPost(void)
+{
+	struct timespec ts;
+	int posted = 1, r = 1;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += 2;
+
+	pthread_mutex_lock(&chanOpMtx);
+	__atomic_store_n(&chanOpState, 1, __ATOMIC_RELEASE);
+	while (__atomic_load_n(&chanOpState, __ATOMIC_ACQUIRE)) {
+		/* withdraw it, unless the input thread is applying it right now */
+		if (pthread_cond_timedwait(&chanOpCnd, &chanOpMtx, &ts) &&
+		    __atomic_compare_exchange_n(&chanOpState, &posted, 0, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			r = 0;
+			break;
+		}
+		posted = 1;
+	}
+	pthread_mutex_unlock(&chanOpMtx);
+	return r;
+}
+
+/* control thread : the decoded channel at Fr, -1 if none */
+int chanFind(float Fr)
+{
+	int n;
+
+	for (n = 0; n < nbch; n++)
+		if (channel[n].hopgrp != CHANOFF && channel[n].Fr == Fr)
+			return n;
+	return -1;
+}
+
+/* control thread : can Fr be decoded with the current tuning */
+int chanFits(unsigned int Fr)
+{
+	return planClear(&Fr, 1, INTRATE * chanMult, tuneDone) >= 0;
+}
+
+/* control thread : decode Fr with the amdet AM detector, return its channel, -1 if none is free, -2 on failure */
+int chanAdd(float Fr, int amdet)
+{
+	channel_t *ch;
+	int n;
+
+	/* a removed channel, or a new one */
+	for (n = 0; n < nbch && channel[n].hopgrp != CHANOFF; n++)
+		;
+	if (n == MAXNBCHANNELS)
+		return -1;
+
+	/* the input thread does not use it until it is added */
+	ch = &(channel[n]);
+	if (ch->wf == NULL)
+		ch->wf = malloc(chanMult * sizeof(float complex));
+	if (ch->dm_buffer == NULL)
+		ch->dm_buffer = malloc(chanBufsz * sizeof(float));
+	if (ch->wf == NULL || ch->dm_buffer == NULL)
+		return -2;
+	free(ch->inb);
+	free(ch->blk);
+	ch->blk = NULL;
+	ch->chn = n;
+	ch->Fr = Fr;
+	ch->amdet = amdet;
+	if (initMsk(ch))
+		return -2;
+	resetAcars(ch);
+	resetChan(n, tuneDone);
+	tuneChan(n);
+	memset(&(metrics.ch[n]), 0, sizeof(chmetrics_t));
+
+	chanOp.op = CHOP_ADD;
+	chanOp.n = n;
+	return chanPost() ? n : -2;
+}
+
+/* control thread : stop decoding channel n */
+int chanRemove(int n)
+{
+	chanOp.op = CHOP_REMOVE;
+	chanOp.n = n;
+	return chanPost() ? 0 : -1;
+}
+
+/* control thread : decode Fr on channel n instead, with a mixer table built here */
+int chanRetune(int n, float Fr)
+{
+	int r;
+
+	chanOp.wf = malloc(chanMult * sizeof(float complex));
+	if (chanOp.wf == NULL)
+		return -1;
+	mixer(Fr, chs[n].Fc, chanOp.wf, &chanOp.rotstep);
+	chanOp.op = CHOP_RETUNE;
+	chanOp.n = n;
+	chanOp.Fr = Fr;
+	r = chanPost() ? 0 : -1;
+	/* the replaced table, or the new one if it was not applied */
+	free(chanOp.wf);
+	return r;
+}
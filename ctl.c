@@ -0,0 +1,274 @@
+/*
+ *  Copyright (c) 2015 Thierry Leconte
+ *
+ *
+ *   This code is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Library General Public License version 2
+ *   published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Library General Public License for more details.
+ *
+ */
+
+/*
+ * --control path : change the decoding at runtime through a unix socket,
+ * without restarting, which would lose the messages being reassembled, the
+ * flights table and the traffic while the tuner starts again.
+ * One command per line, answered by "ok" or "error reason" :
+ *   list                        one "channel n freq" line per decoded channel
+ *   add freq[:am]               decode freq, in the tuned band
+ *   remove freq                 stop decoding freq
+ *   retune freq newfreq         decode newfreq instead of freq
+ *   gain dB                     tuner gain, -10 for AGC
+ *   labels l1:l2:... | all      only output these labels
+ *   net pp|native|json host:port | net off
+ * The channel changes are prepared here and applied by the input thread
+ * between two blocks (see chanAdd), the output ones between two messages.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "acarsdec.h"
+
+extern int inmode;
+
+static int ctlfd = -1;
+static char *ctlPath;
+static pthread_t ctlth;
+static char *ctlNetaddr;
+
+static unsigned int parsefreq(const char *s)
+{
+	unsigned int Fr = ((int)(1000000 * atof(s) + INTRATE / 2) / INTRATE) * INTRATE;
+
+	if (Fr < 118000000 || Fr > 138000000)
+		return 0;
+	return Fr;
+}
+
+static const char *chancmd(char *cmd, char *a1, char *a2)
+{
+	unsigned int Fr, Fn;
+	int n;
+
+	if (a1 == NULL || (Fr = parsefreq(a1)) == 0)
+		return "invalid frequency";
+	n = chanFind(Fr);
+
+	if (strcmp(cmd, "add") == 0) {
+		if (n >= 0)
+			return "already decoded";
+		if (!chanFits(Fr))
+			return "not in the tuned band";
+		n = chanAdd(Fr, chanAmDetector(a1));
+		if (n == -1)
+			return "too many channels";
+		if (n < 0)
+			return "not applied";
+		return NULL;
+	}
+
+	if (n < 0)
+		return "not decoded";
+	if (strcmp(cmd, "remove") == 0)
+		return chanRemove(n) ? "not applied" : NULL;
+
+	if (a2 == NULL || (Fn = parsefreq(a2)) == 0)
+		return "invalid frequency";
+	if (chanFind(Fn) >= 0)
+		return "already decoded";
+	if (!chanFits(Fn))
+		return "not in the tuned band";
+	return chanRetune(n, Fn) ? "not applied" : NULL;
+}
+
+static const char *gaincmd(char *a1)
+{
+	if (a1 == NULL)
+		return "missing gain";
+	switch (inmode) {
+#ifdef WITH_RTL
+	case 3:
+		return rtlSetGain(atof(a1)) ? "failed" : NULL;
+#endif
+#ifdef WITH_SOAPY
+	case 6:
+		return soapySetGain(atof(a1)) ? "failed" : NULL;
+#endif
+	default:
+		return "no gain for this input";
+	}
+}
+
+static const char *netcmd(char *a1, char *a2)
+{
+	char *old = ctlNetaddr;
+	int fmt;
+
+	if (a1 == NULL)
+		return "missing format";
+	if (netout == NETLOG_MQTT)
+		return "mqtt output can't be changed";
+	if (strcmp(a1, "off") == 0) {
+		outputNet(NETLOG_NONE, NULL);
+		ctlNetaddr = NULL;
+		free(old);
+		return NULL;
+	}
+	if (strcmp(a1, "pp") == 0)
+		fmt = NETLOG_PLANEPLOTTER;
+	else if (strcmp(a1, "native") == 0)
+		fmt = NETLOG_NATIVE;
+	else if (strcmp(a1, "json") == 0)
+		fmt = NETLOG_JSON;
+	else
+		return "unknown format";
+	if (a2 == NULL)
+		return "missing address";
+
+	/* kept by netout.c for reconnections */
+	ctlNetaddr = strdup(a2);
+	if (ctlNetaddr == NULL || outputNet(fmt, ctlNetaddr)) {
+		outputNet(NETLOG_NONE, NULL);
+		free(ctlNetaddr);
+		ctlNetaddr = NULL;
+		free(old);
+		return "failed, network output stopped";
+	}
+	free(old);
+	return NULL;
+}
+
+static void command(FILE *fo, char *line)
+{
+	char *cmd, *a1, *a2, *save;
+	const char *err;
+	int n;
+
+	cmd = strtok_r(line, " \t\r\n", &save);
+	if (cmd == NULL)
+		return;
+	a1 = strtok_r(NULL, " \t\r\n", &save);
+	a2 = strtok_r(NULL, " \t\r\n", &save);
+
+	if (strcmp(cmd, "list") == 0) {
+		for (n = 0; n < nbch; n++)
+			if (channel[n].hopgrp != CHANOFF)
+				fprintf(fo, "channel %d %.4f\n", n + 1, channel[n].Fr / 1e6);
+		err = NULL;
+	} else if (strcmp(cmd, "add") == 0 || strcmp(cmd, "remove") == 0 || strcmp(cmd, "retune") == 0) {
+		err = chancmd(cmd, a1, a2);
+	} else if (strcmp(cmd, "gain") == 0) {
+		err = gaincmd(a1);
+	} else if (strcmp(cmd, "labels") == 0) {
+		if (a1 == NULL)
+			err = "missing labels";
+		else {
+			outputLabels(strcmp(a1, "all") ? a1 : NULL);
+			err = NULL;
+		}
+	} else if (strcmp(cmd, "net") == 0) {
+		err = netcmd(a1, a2);
+	} else {
+		err = "unknown command";
+	}
+
+	if (err)
+		fprintf(fo, "error %s\n", err);
+	else
+		fprintf(fo, "ok\n");
+	if (verbose)
+		fprintf(stderr, "control : %s %s%s\n", cmd, err ? "error " : "ok", err ? err : "");
+}
+
+/* one client at a time */
+static void *ctl_thread(void *arg)
+{
+	char line[256];
+
+	stageThread(STAGE_AUX, "acarsdec-ctl");
+	for (;;) {
+		FILE *fi, *fo;
+		int fd = accept(ctlfd, NULL, NULL);
+
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		fi = fdopen(fd, "r");
+		fo = fdopen(dup(fd), "w");
+		if (fi == NULL || fo == NULL) {
+			if (fi)
+				fclose(fi);
+			else
+				close(fd);
+			if (fo)
+				fclose(fo);
+			continue;
+		}
+		while (fgets(line, sizeof(line), fi)) {
+			command(fo, line);
+			fflush(fo);
+		}
+		fclose(fi);
+		fclose(fo);
+	}
+	return NULL;
+}
+
+int initControl(char *path)
+{
+	struct sockaddr_un sa;
+
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		fprintf(stderr, "control socket path too long\n");
+		return 1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+
+	ctlfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (ctlfd < 0) {
+		perror("control socket");
+		return 1;
+	}
+	unlink(path);
+	if (bind(ctlfd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(ctlfd, 4) < 0) {
+		fprintf(stderr, "could not listen on %s : %s\n", path, strerror(errno));
+		close(ctlfd);
+		return 1;
+	}
+	ctlPath = path;
+
+	/* a client leaving before its answer */
+	signal(SIGPIPE, SIG_IGN);
+
+	if (pthread_create(&ctlth, NULL, ctl_thread, NULL)) {
+		fprintf(stderr, "could not start the control thread\n");
+		return 1;
+	}
+	if (verbose)
+		fprintf(stderr, "Control socket on %s\n", path);
+	return 0;
+}
+
+void closeControl(void)
+{
+	if (ctlfd < 0)
+		return;
+	shutdown(ctlfd, SHUT_RDWR);
+	close(ctlfd);
+	unlink(ctlPath);
+}
@@ -71,6 +71,7 @@ FILE* Fileoutinit(char* logfilename)
               if(ext != NULL && (ext <= basename || ext[1] == '\0')) {
                      ext = NULL;
               }
+              free(extension);
               if(ext) {
                      extension = strdup(ext);
                      *ext = '\0';
@@ -0,0 +1,229 @@
+/*
+ *  Copyright (c) 2015 Thierry Leconte
+ *
+ *
+ *   This code is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Library General Public License version 2
+ *   published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Library General Public License for more details.
+ *
+ */
+
+/*
+ * Raw frame capture : every block put in the message queue by decodeAcars
+ * is saved before any error correction, so that it could be decoded again
+ * later, with --redecode, without any radio.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <errno.h>
+
+#include "acarsdec.h"
+
+#define CAPMAGIC "ACARSFRM"
+#define CAPVERSION 1
+/* frames corrected in parallel between two outputs */
+#define CAPBATCH 8192
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+} __attribute__((packed)) caphdr_t;
+
+typedef struct {
+	uint8_t chn;
+	uint8_t len;
+	int64_t sec;
+	uint32_t usec;
+	float lvl;
+	unsigned char crc[2];
+	/* followed by len bytes of raw text */
+} __attribute__((packed)) caprec_t;
+
+static FILE *capfd = NULL;
+static char **redecode_files = NULL;
+
+int Frmcapinit(char *filename)
+{
+	caphdr_t hdr;
+
+	if ((capfd = fopen(filename, "a")) == NULL) {
+		fprintf(stderr, "Could not open capture file %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	if (ftell(capfd) == 0) {
+		memcpy(hdr.magic, CAPMAGIC, 8);
+		hdr.version = CAPVERSION;
+		fwrite(&hdr, sizeof(hdr), 1, capfd);
+		fflush(capfd);
+	}
+	return 0;
+}
+
+void Frmcapwrite(const msgblk_t *blk)
+{
+	caprec_t rec;
+
+	if (capfd == NULL || blk->len < 0 || blk->len > (int)sizeof(blk->txt))
+		return;
+
+	rec.chn = blk->chn;
+	rec.len = blk->len;
+	rec.sec = blk->tv.tv_sec;
+	rec.usec = blk->tv.tv_usec;
+	rec.lvl = blk->lvl;
+	memcpy(rec.crc, blk->crc, 2);
+
+	fwrite(&rec, sizeof(rec), 1, capfd);
+	fwrite(blk->txt, 1, blk->len, capfd);
+	fflush(capfd);
+}
+
+void Frmcapclose(void)
+{
+	if (capfd)
+		fclose(capfd);
+	capfd = NULL;
+}
+
+/* offline decoding of captured frames */
+int initRedecode(char **argv, int optind)
+{
+	if (argv[optind] == NULL) {
+		fprintf(stderr, "Need at least one capture file after --redecode\n");
+		return 1;
+	}
+	redecode_files = &(argv[optind]);
+	nbch = 0;
+	return 0;
+}
+
+typedef struct {
+	msgblk_t *blks;
+	char *ok;
+	int first, last;
+} fixjob_t;
+
+static void *fix_thread(void *arg)
+{
+	fixjob_t *job = arg;
+	int n;
+
+	stageThread(-1, "acarsdec-fix");
+
+	for (n = job->first; n < job->last; n++)
+		job->ok[n] = (fixAcars(&(job->blks[n])) == 0);
+
+	return NULL;
+}
+
+/* read up to max frames, *bad set on a record that can't be from a capture */
+static int readframes(FILE *fd, msgblk_t *blks, int max, int *bad)
+{
+	caprec_t rec;
+	int n;
+
+	for (n = 0; n < max; n++) {
+		msgblk_t *blk = &(blks[n]);
+
+		if (fread(&rec, sizeof(rec), 1, fd) != 1)
+			break;
+		if (rec.len > sizeof(blk->txt)) {
+			*bad = 1;
+			break;
+		}
+		if (fread(blk->txt, 1, rec.len, fd) != rec.len)
+			break;
+		blk->prev = NULL;
+		blk->chn = rec.chn < MAXNBCHANNELS ? rec.chn : 0;
+		blk->len = rec.len;
+		blk->err = 0;
+		blk->lvl = rec.lvl;
+		blk->tv.tv_sec = rec.sec;
+		blk->tv.tv_usec = rec.usec;
+		memcpy(blk->crc, rec.crc, 2);
+		if (blk->chn >= nbch)
+			nbch = blk->chn + 1;
+	}
+	return n;
+}
+
+int runRedecode(void)
+{
+	msgblk_t *blks;
+	char *ok;
+	int nbth, f, n, nb;
+	unsigned long tot = 0, good = 0;
+
+	nbth = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nbth < 1)
+		nbth = 1;
+
+	blks = malloc(CAPBATCH * sizeof(msgblk_t));
+	ok = malloc(CAPBATCH);
+	if (blks == NULL || ok == NULL) {
+		fprintf(stderr, "redecode: failed to allocate memory\n");
+		return -1;
+	}
+
+	for (f = 0; redecode_files[f] && !signalExit; f++) {
+		FILE *fd;
+		caphdr_t hdr;
+		int bad = 0;
+
+		if ((fd = fopen(redecode_files[f], "r")) == NULL) {
+			fprintf(stderr, "Could not open capture file %s: %s\n", redecode_files[f], strerror(errno));
+			continue;
+		}
+		if (fread(&hdr, sizeof(hdr), 1, fd) != 1 || memcmp(hdr.magic, CAPMAGIC, 8)
+		    || hdr.version != CAPVERSION) {
+			fprintf(stderr, "%s is not an acarsdec frame capture\n", redecode_files[f]);
+			fclose(fd);
+			continue;
+		}
+
+		while (!signalExit && !bad && (nb = readframes(fd, blks, CAPBATCH, &bad)) > 0) {
+			pthread_t th[nbth];
+			fixjob_t job[nbth];
+			int t;
+
+			/* correction is done in parallel, output stays in capture order */
+			for (t = 0; t < nbth; t++) {
+				job[t].blks = blks;
+				job[t].ok = ok;
+				job[t].first = nb * t / nbth;
+				job[t].last = nb * (t + 1) / nbth;
+				pthread_create(&th[t], NULL, fix_thread, &job[t]);
+			}
+			for (t = 0; t < nbth; t++)
+				pthread_join(th[t], NULL);
+
+			for (n = 0; n < nb; n++) {
+				if (ok[n]) {
+					outputmsg(&(blks[n]));
+					good++;
+				}
+			}
+			tot += nb;
+		}
+		if (bad)
+			fprintf(stderr, "%s is corrupted, frames after %lu not decoded\n", redecode_files[f], tot);
+		fclose(fd);
+	}
+
+	if (verbose)
+		fprintf(stderr, "redecode: %lu frames, %lu valid\n", tot, good);
+
+	free(blks);
+	free(ok);
+	return 0;
+}
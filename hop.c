@@ -0,0 +1,214 @@
+/*
+ *  Copyright (c) 2015 Thierry Leconte
+ *
+ *
+ *   This code is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Library General Public License version 2
+ *   published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Library General Public License for more details.
+ *
+ */
+
+/*
+ * --hop : time sliced decoding of channels too far apart for one tuning.
+ *
+ * The channels are split, in frequency order, into groups that each fit in
+ * the sample rate, with their own center frequency. The tuner cycles through
+ * the groups : only the channels of the current one (hopGroup) are decoded,
+ * the others keep their state until it comes back to them.
+ * A cycle lasts about hopDwell ms per group, shared in proportion to the
+ * frames per second each group decoded during its last visits, plus
+ * HOPMINRATE so that a quiet group is still listened to, and never less than
+ * hopDwell/2 per group. A dwell is extended, up to HOPMAXEXT, while one of
+ * the channels of the group is receiving a frame.
+ * hopInput runs in the input thread : at the end of a dwell it asks for the
+ * next center frequency, then drops the buffers until the front end has set
+ * the device, and one more.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "acarsdec.h"
+#include "metrics.h"
+
+#define HOPMINRATE 0.05f		/* frames per second */
+#define HOPRATEK 0.25f			/* smoothing of the groups frame rates */
+#define HOPMAXEXT (INTRATE * 3 / 2)	/* 1.5s, the longest frame */
+
+typedef struct {
+	unsigned int Fc;
+	float rate;
+	unsigned long frames;
+} hopgrp_t;
+
+int hopGroup;
+
+static hopgrp_t grps[MAXNBCHANNELS];
+static int nbgrps;
+static enum { HP_INIT, HP_TUNE, HP_MUTE, HP_RUN } hpState;
+static int hpNext;
+static unsigned long hpCount, hpDwell;
+
+static int cmpchan(const void *a, const void *b)
+{
+	float x = channel[*(const int *)a].Fr, y = channel[*(const int *)b].Fr;
+
+	return (x > y) - (x < y);
+}
+
+int initHop(int rate, unsigned int *Fc)
+{
+	int idx[MAXNBCHANNELS];
+	unsigned int fr[MAXNBCHANNELS];
+	int n, g, nb;
+
+	for (n = 0; n < nbch; n++)
+		idx[n] = n;
+	qsort(idx, nbch, sizeof(int), cmpchan);
+
+	nbgrps = 0;
+	nb = 0;
+	for (n = 0; n < nbch; n++) {
+		unsigned int fc;
+
+		fr[nb] = channel[idx[n]].Fr;
+		fc = chanPlanFc(fr, nb + 1, rate);
+		if (fc == 0 && nb == 0) {
+			fprintf(stderr, "No center frequency for %.4f\n", fr[0] / 1e6);
+			return 1;
+		}
+		if (fc == 0) {
+			/* start a new group with this channel */
+			nbgrps++;
+			fr[0] = fr[nb];
+			nb = 0;
+			fc = chanPlanFc(fr, 1, rate);
+		}
+		grps[nbgrps].Fc = fc;
+		channel[idx[n]].hopgrp = nbgrps;
+		nb++;
+	}
+	nbgrps++;
+
+	fprintf(stderr, "Hopping between %d groups :\n", nbgrps);
+	for (g = 0; g < nbgrps; g++) {
+		grps[g].rate = 0;
+		fprintf(stderr, " %.4f :", grps[g].Fc / 1e6);
+		for (n = 0; n < nbch; n++)
+			if (channel[n].hopgrp == g)
+				fprintf(stderr, " %.4f", channel[n].Fr / 1e6);
+		fprintf(stderr, "\n");
+	}
+
+	hopGroup = 0;
+	hpState = HP_INIT;
+	*Fc = grps[0].Fc;
+	return 0;
+}
+
+/* frames put in the queue by the channels of group g */
+static unsigned long groupFrames(int g)
+{
+	unsigned long f = 0;
+	int n;
+
+	for (n = 0; n < nbch; n++)
+		if (channel[n].hopgrp == g)
+			f += METRIC_GET(metrics.ch[n].queued);
+	return f;
+}
+
+/* is a channel of the current group receiving a frame */
+static int groupBusy(void)
+{
+	int n;
+
+	for (n = 0; n < nbch; n++)
+		if (channel[n].hopgrp == hopGroup && channel[n].Acarsstate != WSYN)
+			return 1;
+	return 0;
+}
+
+/* dwell of group g, in INTRATE samples */
+static unsigned long groupDwell(int g)
+{
+	float sum = 0, d;
+	int n;
+
+	for (n = 0; n < nbgrps; n++)
+		sum += grps[n].rate + HOPMINRATE;
+	d = (float)hopDwell * nbgrps * (grps[g].rate + HOPMINRATE) / sum;
+	if (d < hopDwell / 2.0f)
+		d = hopDwell / 2.0f;
+	return (unsigned long)(d * INTRATE / 1000);
+}
+
+static void startDwell(void)
+{
+	hopGroup = hpNext;
+	grps[hopGroup].frames = groupFrames(hopGroup);
+	hpDwell = groupDwell(hopGroup);
+	hpCount = 0;
+}
+
+static void endDwell(void)
+{
+	hopgrp_t *gp = &(grps[hopGroup]);
+	float r = (float)(groupFrames(hopGroup) - gp->frames) * INTRATE / hpCount;
+	int n;
+
+	/* a frame cut by the end of the dwell would not complete on the next visit */
+	for (n = 0; n < nbch; n++)
+		if (channel[n].hopgrp == hopGroup && channel[n].Acarsstate != WSYN)
+			resetAcars(&(channel[n]));
+
+	gp->rate += HOPRATEK * (r - gp->rate);
+	hpNext = (hopGroup + 1) % nbgrps;
+	chanTuneTo(grps[hpNext].Fc);
+}
+
+/*
+ * input thread, before mixing a buffer of len INTRATE samples :
+ * return 1 if the buffer must be dropped
+ */
+int hopInput(int len)
+{
+	int n;
+
+	switch (hpState) {
+	case HP_INIT:
+		for (n = 0; n < nbch; n++)
+			chanSetFc(n, grps[channel[n].hopgrp].Fc);
+		hpNext = 0;
+		startDwell();
+		hpState = HP_RUN;
+		return 0;
+	case HP_RUN:
+		if (nbgrps == 1)
+			return 0;
+		hpCount += len;
+		if (hpCount < hpDwell)
+			return 0;
+		if (groupBusy() && hpCount < hpDwell + HOPMAXEXT)
+			return 0;
+		endDwell();
+		hpState = HP_TUNE;
+		return 1;
+	case HP_TUNE:
+		if (!chanTuned())
+			return 1;
+		hpState = HP_MUTE;
+		return 1;
+	case HP_MUTE:
+		/* the buffer may still have samples from before the retune */
+		startDwell();
+		hpState = HP_RUN;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,236 @@
+/*
+ *  Copyright (c) 2016 Thierry Leconte
+ *
+ *
+ *   This code is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Library General Public License version 2
+ *   published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Library General Public License for more details.
+ *
+ */
+
+/*
+ * IQ recording tap.
+ *
+ * The sdr callbacks append their sample buffers to a pool of preallocated,
+ * page aligned, slots. Full slots are handed to a writer thread which
+ * does large writes to disk. The callback never waits : when no free slot
+ * is available the samples are dropped and counted as an overrun.
+ * Recording could be toggled with SIGUSR1 and files are rotated by size
+ * and/or time.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "acarsdec.h"
+
+#define IQRECNBSLOT 16
+#define IQRECSLOTSZ (2*1024*1024)
+
+static unsigned char *slots[IQRECNBSLOT];
+static size_t slotlen[IQRECNBSLOT];
+static char slotend[IQRECNBSLOT];	/* close the file after this slot */
+static unsigned int slothead, slottail;	/* slots filled by the callback / written by the thread */
+static sem_t slotsem;
+static pthread_t iqrec_th;
+static int iqrec_shutdown;
+
+static char *iqrec_prefix;
+static const char *iqrec_ext;
+static int iqfd = -1;
+static size_t iqfilelen;
+static time_t iqfilestart;
+
+volatile int iqrecActive = 0;
+unsigned long iqrecOverruns = 0;
+unsigned long long iqrecBytes = 0;
+
+static void openiq(void)
+{
+	char *filename;
+	char tstr[32];
+	struct tm tm;
+	int n;
+
+	iqfilestart = time(NULL);
+	gmtime_r(&iqfilestart, &tm);
+	strftime(tstr, sizeof(tstr), "_%Y%m%d_%H%M%S", &tm);
+
+	filename = malloc(strlen(iqrec_prefix) + strlen(tstr) + strlen(iqrec_ext) + 16);
+	if (filename == NULL)
+		return;
+	sprintf(filename, "%s%s.%s", iqrec_prefix, tstr, iqrec_ext);
+
+	/* never overwrite a file rotated within the same second */
+	for (n = 1; (iqfd = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0 && errno == EEXIST && n < 1000; n++)
+		sprintf(filename, "%s%s_%d.%s", iqrec_prefix, tstr, n, iqrec_ext);
+	if (iqfd < 0)
+		fprintf(stderr, "Could not open IQ record file %s: %s\n", filename, strerror(errno));
+	else if (verbose)
+		fprintf(stderr, "Recording IQ to %s\n", filename);
+	iqfilelen = 0;
+	free(filename);
+}
+
+static void closeiq(void)
+{
+	if (iqfd >= 0)
+		close(iqfd);
+	iqfd = -1;
+}
+
+static void writeslot(int s)
+{
+	size_t off = 0;
+
+	if (iqfd >= 0 && ((iqrecMaxSize && iqfilelen >= iqrecMaxSize) ||
+			  (iqrecMaxTime && time(NULL) - iqfilestart >= iqrecMaxTime)))
+		closeiq();
+	if (iqfd < 0)
+		openiq();
+	if (iqfd < 0)
+		return;
+
+	while (off < slotlen[s]) {
+		ssize_t r = write(iqfd, slots[s] + off, slotlen[s] - off);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "IQ record write error: %s\n", strerror(errno));
+			closeiq();
+			return;
+		}
+		off += r;
+	}
+	iqfilelen += off;
+	iqrecBytes += off;
+	posix_fadvise(iqfd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+static void *iqrec_thread(void *arg)
+{
+	stageThread(STAGE_AUX, "acarsdec-iqrec");
+	while (1) {
+		unsigned int head;
+		int stop;
+
+		sem_wait(&slotsem);
+
+		/* read the flag first so that the last slot published before shutdown is seen */
+		stop = __atomic_load_n(&iqrec_shutdown, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&slothead, __ATOMIC_ACQUIRE);
+		while (slottail != head) {
+			int s = slottail % IQRECNBSLOT;
+
+			if (slotlen[s])
+				writeslot(s);
+			if (slotend[s])
+				closeiq();
+			slotlen[s] = 0;
+			slotend[s] = 0;
+			__atomic_store_n(&slottail, slottail + 1, __ATOMIC_RELEASE);
+		}
+		if (stop)
+			break;
+	}
+	closeiq();
+	return NULL;
+}
+
+int IQrecinit(char *prefix, const char *ext)
+{
+	int n;
+
+	iqrec_prefix = prefix;
+	iqrec_ext = ext;
+
+	for (n = 0; n < IQRECNBSLOT; n++) {
+		if (posix_memalign((void **)&(slots[n]), 4096, IQRECSLOTSZ)) {
+			fprintf(stderr, "IQ record : failed to allocate buffers\n");
+			return -1;
+		}
+		slotlen[n] = 0;
+		slotend[n] = 0;
+	}
+	slothead = slottail = 0;
+	sem_init(&slotsem, 0, 0);
+	iqrec_shutdown = 0;
+
+	if (pthread_create(&iqrec_th, NULL, iqrec_thread, NULL))
+		return -1;
+
+	iqrecActive = 1;
+	return 0;
+}
+
+static int publish(unsigned int head)
+{
+	if (head + 1 - __atomic_load_n(&slottail, __ATOMIC_ACQUIRE) >= IQRECNBSLOT)
+		return -1;
+	__atomic_store_n(&slothead, head + 1, __ATOMIC_RELEASE);
+	sem_post(&slotsem);
+	return 0;
+}
+
+/* called from the sdr callback : must never block */
+void IQrecput(const void *buf, size_t len)
+{
+	static int wasActive = 0;
+	unsigned int head = slothead;
+	int s = head % IQRECNBSLOT;
+
+	if (!iqrecActive) {
+		/* recording stopped : flush and close the current file */
+		if (wasActive) {
+			slotend[s] = 1;
+			if (publish(head) == 0)
+				wasActive = 0;
+		}
+		return;
+	}
+	wasActive = 1;
+
+	if (len > IQRECSLOTSZ)
+		len = IQRECSLOTSZ;
+
+	if (slotlen[s] + len > IQRECSLOTSZ) {
+		/* hand the full slot to the writer */
+		if (publish(head)) {
+			/* writer too slow : drop */
+			iqrecOverruns++;
+			return;
+		}
+		s = (head + 1) % IQRECNBSLOT;
+	}
+
+	memcpy(slots[s] + slotlen[s], buf, len);
+	slotlen[s] += len;
+}
+
+void IQrecclose(void)
+{
+	if (slots[0] == NULL)
+		return;
+
+	if (slotlen[slothead % IQRECNBSLOT])
+		publish(slothead);
+	__atomic_store_n(&iqrec_shutdown, 1, __ATOMIC_RELEASE);
+	sem_post(&slotsem);
+	pthread_join(iqrec_th, NULL);
+
+	if (iqrecOverruns || verbose)
+		fprintf(stderr, "IQ record : %llu bytes written, %lu buffer overruns\n",
+			iqrecBytes, iqrecOverruns);
+}
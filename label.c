@@ -5,6 +5,7 @@
 #include "acarsdec.h"
 
 static char *lblfilter[1024];
+static char *lblbuf=NULL;
 
 void build_label_filter(char *arg)
 {
@@ -12,9 +13,12 @@ void build_label_filter(char *arg)
    char *aptr;
 
    lblfilter[0]=NULL;
+   free(lblbuf);
+   lblbuf=NULL;
    if(arg==NULL) return;
 
-   aptr=strtok(strdup(arg),":");
+   lblbuf=strdup(arg);
+   aptr=strtok(lblbuf,":");
    while(aptr) {
 	lblfilter[i]=aptr; i++;
 	aptr=strtok(NULL,":");
@@ -0,0 +1,298 @@
+/*
+ *  Copyright (c) 2015 Thierry Leconte
+ *
+ *
+ *   This code is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Library General Public License version 2
+ *   published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Library General Public License for more details.
+ *
+ */
+
+/*
+ * Metrics export, in prometheus text format : periodically written to a
+ * file (ie: for the node_exporter textfile collector) and/or served over
+ * http on a local tcp port.
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "acarsdec.h"
+#include "metrics.h"
+
+metrics_t metrics;
+
+static pthread_t metrics_th;
+static volatile int metrics_running = 0;
+static int listenfd = -1;
+
+static const char *sinkname[NBSINKS] = { "out", "net", "mqtt", "archive" };
+static const char *latname[NBLATSTAGES] = { "demod", "queue", "fix", "output", "total" };
+
+void latency(int stage, unsigned long long from, unsigned long long to)
+{
+	lathist_t *lh = &(metrics.lat[stage]);
+	unsigned long long us, max;
+	int b;
+
+	if (from == 0 || to < from)
+		return;
+	us = to - from;
+	b = us ? 64 - __builtin_clzll(us) : 0;
+	if (b >= LATBUCKETS)
+		b = LATBUCKETS - 1;
+	METRIC_INC(lh->hist[b]);
+	METRIC_INC(lh->count);
+
+	max = METRIC_GET(lh->max);
+	while (us > max && !__atomic_compare_exchange_n(&(lh->max), &max, us, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* upper bound of the log2 bucket holding the q quantile */
+static unsigned long long latquantile(const lathist_t *lh, double q)
+{
+	unsigned long count = METRIC_GET(lh->count), acc = 0;
+	int b;
+
+	if (count == 0)
+		return 0;
+	for (b = 0; b < LATBUCKETS; b++) {
+		acc += METRIC_GET(lh->hist[b]);
+		if (acc >= q * count)
+			break;
+	}
+	return b ? 1ULL << b : 0;
+}
+
+static void chmetric(FILE *fd, const char *name, const char *help, size_t off)
+{
+	int n;
+
+	fprintf(fd, "# HELP acarsdec_%s %s\n# TYPE acarsdec_%s counter\n", name, help, name);
+	for (n = 0; n < nbch; n++) {
+		unsigned long v = __atomic_load_n((unsigned long *)((char *)&(metrics.ch[n]) + off), __ATOMIC_RELAXED);
+
+		fprintf(fd, "acarsdec_%s{channel=\"%d\",freq=\"%.3f\"} %lu\n",
+			name, n + 1, channel[n].Fr / 1000000.0, v);
+	}
+}
+
+static void sinkmetric(FILE *fd, const char *name, const char *help, size_t off)
+{
+	int s;
+
+	fprintf(fd, "# HELP acarsdec_%s %s\n# TYPE acarsdec_%s counter\n", name, help, name);
+	for (s = 0; s < NBSINKS; s++) {
+		unsigned long v = __atomic_load_n((unsigned long *)((char *)&(metrics.sink[s]) + off), __ATOMIC_RELAXED);
+
+		fprintf(fd, "acarsdec_%s{sink=\"%s\"} %lu\n", name, sinkname[s], v);
+	}
+}
+
+static void writemetrics(FILE *fd)
+{
+	int n;
+	unsigned long long outage, since;
+
+	chmetric(fd, "syn_total", "SYN SYN sequences detected", offsetof(chmetrics_t, syn));
+	chmetric(fd, "soh_total", "frame starts detected", offsetof(chmetrics_t, soh));
+	chmetric(fd, "frames_total", "complete frames queued for error correction", offsetof(chmetrics_t, queued));
+	chmetric(fd, "parity_errors_total", "frames with parity errors", offsetof(chmetrics_t, parity));
+	chmetric(fd, "crc_errors_total", "frames with a crc error", offsetof(chmetrics_t, crc));
+	chmetric(fd, "fixed_total", "frames with errors that were corrected", offsetof(chmetrics_t, fixed));
+	chmetric(fd, "unfixed_total", "frames dropped by error correction", offsetof(chmetrics_t, unfixed));
+	chmetric(fd, "squelched_samples_total", "samples not demodulated because the channel was idle", offsetof(chmetrics_t, squelched));
+
+	fprintf(fd, "# HELP acarsdec_level_db_sum sum of the levels of queued frames, divide by frames_total for the mean\n"
+		"# TYPE acarsdec_level_db_sum counter\n");
+	for (n = 0; n < nbch; n++)
+		fprintf(fd, "acarsdec_level_db_sum{channel=\"%d\",freq=\"%.3f\"} %.1f\n",
+			n + 1, channel[n].Fr / 1000000.0, METRIC_GET(metrics.ch[n].lvlsum) / 10.0);
+
+	if (afc) {
+		fprintf(fd, "# HELP acarsdec_afc_offset_hz carrier offset corrected by --afc\n"
+			"# TYPE acarsdec_afc_offset_hz gauge\n");
+		for (n = 0; n < nbch; n++)
+			fprintf(fd, "acarsdec_afc_offset_hz{channel=\"%d\",freq=\"%.3f\"} %ld\n",
+				n + 1, channel[n].Fr / 1000000.0, METRIC_GET(metrics.ch[n].afc));
+	}
+
+	sinkmetric(fd, "sent_total", "messages sent", offsetof(sinkmetrics_t, sent));
+	sinkmetric(fd, "dropped_total", "messages that could not be formatted", offsetof(sinkmetrics_t, dropped));
+	sinkmetric(fd, "sink_errors_total", "message write errors", offsetof(sinkmetrics_t, errors));
+
+	fprintf(fd, "# HELP acarsdec_filtered_total valid messages not output because of filters\n"
+		"# TYPE acarsdec_filtered_total counter\nacarsdec_filtered_total %lu\n", METRIC_GET(metrics.filtered));
+	if (autoPpm)
+		fprintf(fd, "# HELP acarsdec_tuner_ppm tuner frequency correction set by --auto-ppm\n"
+			"# TYPE acarsdec_tuner_ppm gauge\nacarsdec_tuner_ppm %ld\n", METRIC_GET(metrics.ppm));
+	fprintf(fd, "# HELP acarsdec_input_overruns_total overruns or partial reads reported by the input device\n"
+		"# TYPE acarsdec_input_overruns_total counter\nacarsdec_input_overruns_total %lu\n", METRIC_GET(metrics.inoverruns));
+	fprintf(fd, "# HELP acarsdec_input_outages_total times the input device stopped sending data and was reopened\n"
+		"# TYPE acarsdec_input_outages_total counter\nacarsdec_input_outages_total %lu\n", METRIC_GET(metrics.outages));
+	outage = METRIC_GET(metrics.outageus);
+	if ((since = METRIC_GET(metrics.outagets)))
+		outage += monotonic_us() - since;
+	fprintf(fd, "# HELP acarsdec_input_outage_seconds_total time without data from the input device, including the current outage\n"
+		"# TYPE acarsdec_input_outage_seconds_total counter\nacarsdec_input_outage_seconds_total %.1f\n", outage / 1e6);
+	fprintf(fd, "# HELP acarsdec_iq_record_overruns_total IQ record buffers dropped\n"
+		"# TYPE acarsdec_iq_record_overruns_total counter\nacarsdec_iq_record_overruns_total %lu\n", METRIC_GET(iqrecOverruns));
+	fprintf(fd, "# HELP acarsdec_queue_depth frames waiting for error correction and output\n"
+		"# TYPE acarsdec_queue_depth gauge\nacarsdec_queue_depth %lu\n", METRIC_GET(metrics.blkqdepth));
+	fprintf(fd, "# HELP acarsdec_queue_depth_max maximum queue depth since start\n"
+		"# TYPE acarsdec_queue_depth_max gauge\nacarsdec_queue_depth_max %lu\n", METRIC_GET(metrics.blkqmax));
+
+	fprintf(fd, "# HELP acarsdec_latency_us per stage latency in us (log2 bucket upper bound)\n"
+		"# TYPE acarsdec_latency_us summary\n");
+	for (n = 0; n < NBLATSTAGES; n++) {
+		const lathist_t *lh = &(metrics.lat[n]);
+
+		fprintf(fd, "acarsdec_latency_us{stage=\"%s\",quantile=\"0.5\"} %llu\n", latname[n], latquantile(lh, 0.5));
+		fprintf(fd, "acarsdec_latency_us{stage=\"%s\",quantile=\"0.99\"} %llu\n", latname[n], latquantile(lh, 0.99));
+		fprintf(fd, "acarsdec_latency_us_count{stage=\"%s\"} %lu\n", latname[n], METRIC_GET(lh->count));
+	}
+	fprintf(fd, "# HELP acarsdec_latency_us_max per stage maximum latency in us\n"
+		"# TYPE acarsdec_latency_us_max gauge\n");
+	for (n = 0; n < NBLATSTAGES; n++)
+		fprintf(fd, "acarsdec_latency_us_max{stage=\"%s\"} %llu\n", latname[n], METRIC_GET(metrics.lat[n].max));
+}
+
+/* write to a temporary file then rename, so that readers never see a partial file */
+static void writemetricsfile(void)
+{
+	char *tmpname;
+	FILE *fd;
+
+	tmpname = malloc(strlen(metricsfile) + 5);
+	if (tmpname == NULL)
+		return;
+	sprintf(tmpname, "%s.tmp", metricsfile);
+
+	fd = fopen(tmpname, "w");
+	if (fd == NULL) {
+		fprintf(stderr, "Could not open metrics file %s: %s\n", tmpname, strerror(errno));
+		free(tmpname);
+		return;
+	}
+	writemetrics(fd);
+	if (fclose(fd) == 0)
+		rename(tmpname, metricsfile);
+	free(tmpname);
+}
+
+static void servemetrics(void)
+{
+	char req[1024];
+	struct pollfd pfd;
+	FILE *fd;
+	int cfd;
+
+	cfd = accept(listenfd, NULL, NULL);
+	if (cfd < 0)
+		return;
+
+	/* whatever the request, answer with the metrics */
+	pfd.fd = cfd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 1000) > 0)
+		if (read(cfd, req, sizeof(req)) < 0) {
+			close(cfd);
+			return;
+		}
+
+	fd = fdopen(cfd, "w");
+	if (fd == NULL) {
+		close(cfd);
+		return;
+	}
+	fprintf(fd, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+	writemetrics(fd);
+	fclose(fd);
+}
+
+static void *metrics_thread(void *arg)
+{
+	struct pollfd pfd;
+	time_t next = 0;
+
+	stageThread(STAGE_AUX, "acarsdec-metric");
+
+	while (!signalExit && metrics_running) {
+		time_t now = time(NULL);
+
+		if (metricsfile && now >= next) {
+			writemetricsfile();
+			next = now + metricsInterval;
+		}
+
+		pfd.fd = listenfd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, listenfd >= 0 ? 1 : 0, 1000) > 0)
+			servemetrics();
+	}
+	return NULL;
+}
+
+int initMetrics(void)
+{
+	if (metricsInterval <= 0)
+		metricsInterval = 10;
+
+	if (metricsport) {
+		struct sockaddr_in addr;
+		int on = 1;
+
+		listenfd = socket(AF_INET, SOCK_STREAM, 0);
+		if (listenfd < 0) {
+			perror("metrics socket");
+			return -1;
+		}
+		setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(metricsport);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenfd, 4) < 0) {
+			fprintf(stderr, "Could not listen on metrics port %d: %s\n", metricsport, strerror(errno));
+			close(listenfd);
+			listenfd = -1;
+			return -1;
+		}
+	}
+
+	metrics_running = 1;
+	if (pthread_create(&metrics_th, NULL, metrics_thread, NULL)) {
+		metrics_running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+void closeMetrics(void)
+{
+	if (!metrics_running)
+		return;
+	metrics_running = 0;
+	pthread_join(metrics_th, NULL);
+
+	/* final values */
+	if (metricsfile)
+		writemetricsfile();
+	if (listenfd >= 0)
+		close(listenfd);
+}
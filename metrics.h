@@ -0,0 +1,89 @@
+/*
+ *  Copyright (c) 2015 Thierry Leconte
+ *
+ *
+ *   This code is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Library General Public License version 2
+ *   published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Library General Public License for more details.
+ *
+ */
+
+/* runtime counters, updated lock free from the decoding threads */
+
+#define METRIC_ADD(v, n) __atomic_add_fetch(&(v), (n), __ATOMIC_RELAXED)
+#define METRIC_INC(v) METRIC_ADD(v, 1)
+#define METRIC_DEC(v) __atomic_sub_fetch(&(v), 1, __ATOMIC_RELAXED)
+#define METRIC_GET(v) __atomic_load_n(&(v), __ATOMIC_RELAXED)
+#define METRIC_SET(v, x) __atomic_store_n(&(v), (x), __ATOMIC_RELAXED)
+
+/* input buffer arrival time, set by the front ends before demodulation */
+#define METRIC_INPUT() METRIC_SET(metrics.inputts, monotonic_us())
+
+static inline unsigned long long monotonic_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+typedef struct {
+	unsigned long syn;	/* SYN SYN sequences */
+	unsigned long soh;	/* frame starts */
+	unsigned long queued;	/* complete frames put in the message queue */
+	unsigned long parity;	/* frames with parity errors */
+	unsigned long crc;	/* frames with a crc error */
+	unsigned long fixed;	/* frames with errors that were corrected */
+	unsigned long unfixed;	/* frames dropped by error correction */
+	long lvlsum;		/* sum of queued frames levels, in 0.1 dB */
+	unsigned long squelched;	/* samples not demodulated because of --squelch */
+	long afc;		/* --afc mixer correction, in Hz */
+} chmetrics_t;
+
+enum { SINK_OUT, SINK_NET, SINK_MQTT, SINK_ARCHIVE, NBSINKS };
+
+/* latency stages : buffer arrival -> frame complete -> dequeued -> corrected -> output */
+enum { LAT_DEMOD, LAT_QUEUE, LAT_FIX, LAT_OUTPUT, LAT_TOTAL, NBLATSTAGES };
+#define LATBUCKETS 32
+
+typedef struct {
+	unsigned long hist[LATBUCKETS];	/* log2 buckets of microseconds */
+	unsigned long count;
+	unsigned long long max;
+} lathist_t;
+
+typedef struct {
+	unsigned long sent;
+	unsigned long dropped;	/* not sent, ie: no json built */
+	unsigned long errors;
+} sinkmetrics_t;
+
+typedef struct {
+	chmetrics_t ch[MAXNBCHANNELS];
+	sinkmetrics_t sink[NBSINKS];
+	long ppm;		/* tuner correction, changed by --auto-ppm */
+	unsigned long inoverruns;	/* overruns or partial reads reported by the input device */
+	unsigned long blkqdepth;	/* frames waiting for error correction and output */
+	unsigned long blkqmax;
+	unsigned long filtered;		/* valid messages not output because of -A, -b or -e */
+	unsigned long long inputts;	/* last input buffer arrival, in us */
+	unsigned long outages;		/* the input device stopped sending data, and was reopened */
+	unsigned long long outageus;	/* time without data of the outages that are over, in us */
+	unsigned long long outagets;	/* start of the current outage, 0 if none */
+	lathist_t lat[NBLATSTAGES];
+} metrics_t;
+
+extern metrics_t metrics;
+
+extern char *metricsfile;
+extern int metricsport;
+extern int metricsInterval;
+
+extern void latency(int stage, unsigned long long from, unsigned long long to);
+extern int initMetrics(void);
+extern void closeMetrics(void);
@@ -15,8 +15,10 @@
 #define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include "acarsdec.h"
+#include "metrics.h"
 
 pthread_mutex_t chmtx;
 pthread_cond_t chprcd,chcscd;
@@ -27,6 +29,14 @@ int chmsk,tmsk;
 #define FLENO (FLEN*MFLTOVER+1)
 static float h[FLENO];
 
+/* squelch energy block and closing delay, in samples and blocks */
+#define SQLBLK 128
+#define SQLHOLD 8
+static float sqlratio;
+
+/* channel parallel demodulator state must be loaded from the channels */
+static int soaready;
+
 int initMsk(channel_t * ch)
 {
 	int i;
@@ -37,11 +47,20 @@ int initMsk(channel_t * ch)
 	ch->MskDf = 0;
 
 	ch->idx = 0;
+
+	soaready = 0;
+	sqlratio = powf(10, squelch / 10.0);
+	ch->sqlfloor = -1;
+	ch->sqlopen = !squelch;
+	ch->sqlhold = 0;
+	ch->sqllen = 0;
+
 	ch->inb = calloc(FLEN, sizeof(float complex));
 	if(ch->inb == NULL) 
 		return -1;
 
-	if(ch->chn==0) 
+	/* the filter is shared by all channels, including batch decoding ones */
+	if(ch->chn==0 && h[(FLENO-1)/2]==0)
 		for (i = 0; i < FLENO; i++) {
 			h[i] = cosf(2.0*M_PI*600.0/INTRATE/MFLTOVER*(i-(FLENO-1)/2));
 			if(h[i]<0) h[i]=0;
@@ -64,7 +83,38 @@ static inline void putbit(float v, channel_t * ch)
 
 const float PLLG=38e-4;
 const float PLLC=0.52;
-void demodMSK(channel_t *ch,int len)
+
+/* bit decision and PLL update from the matched filter output */
+static inline void mskbit(channel_t *ch, float complex v)
+{
+	double dphi;
+	float vo,lvl;
+
+	/* normalize */
+	lvl=cabsf(v);
+	v/=lvl+1e-8;
+	ch->MskLvlSum += lvl * lvl / 4;
+	ch->MskBitCount++;
+
+	if(ch->MskS&1) {
+		vo=cimagf(v);
+		if(vo>=0) dphi=-crealf(v); else dphi=crealf(v);
+	} else {
+		vo=crealf(v);
+		if(vo>=0) dphi=cimagf(v); else dphi=-cimagf(v);
+	}
+	if(ch->MskS&2) {
+		putbit(-vo, ch);
+	} else {
+		putbit(vo, ch);
+	}
+	ch->MskS++;
+
+	/* PLL filter */
+	ch->MskDf=PLLC*ch->MskDf+(1.0-PLLC)*PLLG*dphi;
+}
+
+static void demodblk(channel_t *ch, const float *buf, int len)
 {
    /* MSK demod */
    int n;
@@ -77,13 +127,15 @@ void demodMSK(channel_t *ch,int len)
 	float complex v;
 	int j,o;
 
+	ch->smpcnt++;
+
 	/* VCO */
 	s = 1800.0/INTRATE*2.0*M_PI + ch->MskDf;
 	p+=s;
 	if (p >= 2.0*M_PI) p -= 2.0*M_PI; 
 
 	/* mixer */
-	in = ch->dm_buffer[n];
+	in = buf[n];
 #ifdef DEBUG
 	if(ch->chn==1) SndWrite(&in);
 #endif
@@ -94,9 +146,6 @@ void demodMSK(channel_t *ch,int len)
 	/* bit clock */
 	ch->MskClk+=s;
 	if (ch->MskClk >=3*M_PI/2.0-s/2) {
-		double dphi;
-		float vo,lvl;
-
 		ch->MskClk -= 3*M_PI/2.0;
 
 		/* matched filter */
@@ -106,28 +155,7 @@ void demodMSK(channel_t *ch,int len)
 			v += h[o]*ch->inb[(j+idx)%FLEN];
 		}
 
-		/* normalize */
-		lvl=cabsf(v);
-		v/=lvl+1e-8;
-		ch->MskLvlSum += lvl * lvl / 4;
-		ch->MskBitCount++;
-
-		if(ch->MskS&1) {
-			vo=cimagf(v);
-			if(vo>=0) dphi=-crealf(v); else dphi=crealf(v);
-		} else {
-			vo=crealf(v);
-			if(vo>=0) dphi=cimagf(v); else dphi=-cimagf(v);
-		}
-		if(ch->MskS&2) {
-			putbit(-vo, ch);
-		} else {
-			putbit(vo, ch);
-		}
-		ch->MskS++;
-
-		/* PLL filter */
-		ch->MskDf=PLLC*ch->MskDf+(1.0-PLLC)*PLLG*dphi;
+		mskbit(ch, v);
 	}
     }
 
@@ -136,3 +164,245 @@ void demodMSK(channel_t *ch,int len)
 
 }
 
+
+/*
+ * Squelch : the AC energy of each SQLBLK samples block is compared to a slowly
+ * tracked noise floor. The demodulator is started when it is squelch dB above
+ * the floor, beginning with the last SQLPREROLL idle samples so that the
+ * preamble is not lost, and stopped when the energy has been back under half
+ * this threshold for SQLHOLD blocks while no frame is being received.
+ */
+static float acenergy(const float *buf, int len)
+{
+	float s = 0, s2 = 0;
+	int n;
+
+	for (n = 0; n < len; n++) {
+		s += buf[n];
+		s2 += buf[n] * buf[n];
+	}
+	s /= len;
+	return s2 / len - s * s;
+}
+
+static void sqlkeep(channel_t *ch, const float *buf, int len)
+{
+	if (len >= SQLPREROLL) {
+		memcpy(ch->sqlhist, buf + len - SQLPREROLL, SQLPREROLL * sizeof(float));
+		ch->sqllen = SQLPREROLL;
+		return;
+	}
+	if (ch->sqllen + len > SQLPREROLL) {
+		int d = ch->sqllen + len - SQLPREROLL;
+
+		memmove(ch->sqlhist, ch->sqlhist + d, (ch->sqllen - d) * sizeof(float));
+		ch->sqllen -= d;
+	}
+	memcpy(ch->sqlhist + ch->sqllen, buf, len * sizeof(float));
+	ch->sqllen += len;
+}
+
+void demodMSK(channel_t *ch,int len)
+{
+	int n;
+
+#ifdef WITH_SNDFILE
+	if (bbprefix)
+		BBrecwrite(ch, len);
+#endif
+
+	if (squelch == 0) {
+		demodblk(ch, ch->dm_buffer, len);
+		return;
+	}
+	for (n = 0; n < len; n += SQLBLK) {
+		const float *buf = ch->dm_buffer + n;
+		int l = len - n < SQLBLK ? len - n : SQLBLK;
+		float e = acenergy(buf, l);
+
+		if (ch->sqlfloor < 0)
+			ch->sqlfloor = e;
+
+		if (ch->sqlopen) {
+			demodblk(ch, buf, l);
+			if (e < ch->sqlfloor * sqlratio / 2 && ch->Acarsstate == WSYN) {
+				if (++ch->sqlhold >= SQLHOLD)
+					ch->sqlopen = 0;
+			} else
+				ch->sqlhold = 0;
+			continue;
+		}
+
+		if (e > ch->sqlfloor * sqlratio) {
+			ch->sqlopen = 1;
+			ch->sqlhold = 0;
+			/* pre-roll samples were already counted */
+			ch->smpcnt -= ch->sqllen;
+			METRIC_ADD(metrics.ch[ch->chn].squelched, -ch->sqllen);
+			demodblk(ch, ch->sqlhist, ch->sqllen);
+			ch->sqllen = 0;
+			demodblk(ch, buf, l);
+			continue;
+		}
+
+		/* idle : fast down, slow up noise floor */
+		ch->sqlfloor += (e - ch->sqlfloor) / (e < ch->sqlfloor ? 4 : 64);
+		if (ch->sqlfloor < 1e-12)
+			ch->sqlfloor = 1e-12;
+		sqlkeep(ch, buf, l);
+		ch->smpcnt += l;
+		METRIC_ADD(metrics.ch[ch->chn].squelched, l);
+	}
+}
+
+/*
+ * Channel parallel demodulator (--demod soa) : the same algorithm as demodblk
+ * for all channels at once, with their NCO, mixer and bit clock states laid
+ * out as arrays so that each sample advances every channel with vector
+ * instructions. The NCO is a normalized complex rotator instead of a phase.
+ * Only the channels whose bit clock ticked then go through the matched
+ * filter and the bit decision, one by one.
+ */
+#define SOABLK 256
+
+static struct {
+	int idx;
+	float ncor[MAXNBCHANNELS], ncoi[MAXNBCHANNELS];	/* e^-jp */
+	float stepr[MAXNBCHANNELS], stepi[MAXNBCHANNELS];	/* e^-js */
+	float s[MAXNBCHANNELS];
+	float clk[MAXNBCHANNELS];
+	float clkthr[MAXNBCHANNELS];
+	float inbr[FLEN][MAXNBCHANNELS], inbi[FLEN][MAXNBCHANNELS];
+	float in[SOABLK][MAXNBCHANNELS];
+} soa __attribute__ ((aligned(64)));
+
+static void soastep(int c)
+{
+	float s = 1800.0/INTRATE*2.0*M_PI + channel[c].MskDf;
+
+	soa.s[c] = s;
+	soa.stepr[c] = cosf(s);
+	soa.stepi[c] = -sinf(s);
+	soa.clkthr[c] = 3*M_PI/2.0 - s/2;
+}
+
+static void soainit(void)
+{
+	int c, j;
+
+	for (c = 0; c < nbch; c++) {
+		channel_t *ch = &(channel[c]);
+
+		soa.ncor[c] = cos(ch->MskPhi);
+		soa.ncoi[c] = -sin(ch->MskPhi);
+		soa.clk[c] = ch->MskClk;
+		for (j = 0; j < FLEN; j++) {
+			soa.inbr[j][c] = crealf(ch->inb[(j + ch->idx) % FLEN]);
+			soa.inbi[j][c] = cimagf(ch->inb[(j + ch->idx) % FLEN]);
+		}
+		soastep(c);
+	}
+	soa.idx = 0;
+	soaready = 1;
+}
+
+static void soabit(int c)
+{
+	channel_t *ch = &(channel[c]);
+	float complex v = 0;
+	int j, o, k;
+
+	soa.clk[c] -= 3*M_PI/2.0;
+
+	/* matched filter */
+	o = MFLTOVER*(soa.clk[c]/soa.s[c]+0.5);
+	if (o > MFLTOVER) o = MFLTOVER;
+	for (j = 0, k = soa.idx; j < FLEN; j++, o += MFLTOVER) {
+		v += h[o] * (soa.inbr[k][c] + soa.inbi[k][c] * I);
+		if (++k == FLEN) k = 0;
+	}
+
+	mskbit(ch, v);
+	soastep(c);
+}
+
+static void demodsoa(int len)
+{
+	int nb = nbch;
+	int m, n, c;
+
+	if (!soaready)
+		soainit();
+
+	for (m = 0; m < len; m += SOABLK) {
+		int bl = len - m < SOABLK ? len - m : SOABLK;
+
+		for (c = 0; c < nb; c++) {
+			const float *dm = channel[c].dm_buffer + m;
+
+			for (n = 0; n < bl; n++)
+				soa.in[n][c] = dm[n];
+		}
+
+		for (n = 0; n < bl; n++) {
+			int idx = soa.idx, any = 0;
+			int tick[MAXNBCHANNELS];
+
+			for (c = 0; c < nb; c++) {
+				/* VCO */
+				float r = soa.ncor[c] * soa.stepr[c] - soa.ncoi[c] * soa.stepi[c];
+				float i = soa.ncor[c] * soa.stepi[c] + soa.ncoi[c] * soa.stepr[c];
+				float g = 1.5f - 0.5f * (r * r + i * i);
+
+				soa.ncor[c] = r * g;
+				soa.ncoi[c] = i * g;
+
+				/* mixer */
+				soa.inbr[idx][c] = soa.in[n][c] * soa.ncor[c];
+				soa.inbi[idx][c] = soa.in[n][c] * soa.ncoi[c];
+
+				/* bit clock */
+				soa.clk[c] += soa.s[c];
+				tick[c] = soa.clk[c] >= soa.clkthr[c];
+				any |= tick[c];
+			}
+			soa.idx = idx + 1 < FLEN ? idx + 1 : 0;
+
+			if (any)
+				for (c = 0; c < nb; c++)
+					if (tick[c])
+						soabit(c);
+		}
+	}
+
+	for (c = 0; c < nb; c++) {
+		channel_t *ch = &(channel[c]);
+		double p = atan2(-soa.ncoi[c], soa.ncor[c]);
+
+		ch->MskPhi = p < 0 ? p + 2.0*M_PI : p;
+		ch->MskClk = soa.clk[c];
+		ch->smpcnt += len;
+	}
+}
+
+/* demodulate the len samples of every channel dm_buffer */
+void demodChannels(int len)
+{
+	int n;
+
+	if (demodEngine == DEMOD_SOA) {
+#ifdef WITH_SNDFILE
+		if (bbprefix)
+			for (n = 0; n < nbch; n++)
+				BBrecwrite(&(channel[n]), len);
+#endif
+		demodsoa(len);
+		return;
+	}
+
+	for (n = 0; n < nbch; n++) {
+		if (channel[n].hopgrp != hopGroup)
+			continue;
+		demodMSK(&(channel[n]), len);
+	}
+}
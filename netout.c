@@ -10,6 +10,7 @@
 #include <errno.h>
 
 #include "acarsdec.h"
+#include "metrics.h"
 
 static int sockfd = -1;
 static char *netOutputRawaddr = NULL;
@@ -65,6 +66,7 @@ int Netoutinit(char *Rawaddr)
 
 		if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
 			close(sockfd);
+			sockfd = -1;
 			continue;
 		}
 		break;
@@ -89,20 +91,25 @@ static int Netwrite(const void *buf, size_t count) {
     if (res == -1) {
         perror("Netwrite");
         close(sockfd);
+        sockfd = -1;
         // retry the write if the reconnect succeeds
         if (Netoutinit(netOutputRawaddr) == 0) {
             res = write(sockfd, buf, count);
         }
     }
+    if (res == -1)
+        METRIC_INC(metrics.sink[SINK_NET].errors);
+    else
+        METRIC_INC(metrics.sink[SINK_NET].sent);
     return res;
 }
 
 
-void Netoutpp(acarsmsg_t * msg)
+int Netoutpp(acarsmsg_t * msg)
 {
 	char pkt[3600]; // max. 16 blocks * 220 characters + extra space for msg prefix
 	char *pstr;
-	int res;
+	int res = -1;
 
 	char *txt = strdup(msg->txt);
 	for (pstr = txt; *pstr != 0; pstr++)
@@ -117,13 +124,14 @@ void Netoutpp(acarsmsg_t * msg)
 		res=Netwrite(pkt, strlen(pkt));
 	}
 	free(txt);
+	return res;
 }
 
-void Netoutsv(acarsmsg_t * msg, char *idstation, int chn, struct timeval tv)
+int Netoutsv(acarsmsg_t * msg, char *idstation, int chn, struct timeval tv)
 {
 	char pkt[3600]; // max. 16 blocks * 220 characters + extra space for msg prefix
 	struct tm tmp;
-	int res;
+	int res = -1;
 
 	gmtime_r(&(tv.tv_sec), &tmp);
 
@@ -137,17 +145,25 @@ void Netoutsv(acarsmsg_t * msg, char *idstation, int chn, struct timeval tv)
 	if (netOutputRawaddr) {
 		res=Netwrite(pkt, strlen(pkt));
 	}
+	return res;
 }
 
-void Netoutjson(char *jsonbuf)
+int Netoutjson(char *jsonbuf)
 {
 	char pkt[3600];
-	int res;
+	int res = -1;
 
 	snprintf(pkt, sizeof(pkt), "%s\n", jsonbuf);
 	if (netOutputRawaddr) {
 		res=Netwrite(pkt, strlen(pkt));
 	}
+	return res;
 }
 
-
+void Netoutclose(void)
+{
+	if (sockfd >= 0)
+		close(sockfd);
+	sockfd = -1;
+	netOutputRawaddr = NULL;
+}
@@ -7,6 +7,7 @@
 #include <sys/time.h>
 #include <time.h>
 #include <errno.h>
+#include <pthread.h>
 #ifdef HAVE_LIBACARS
 #include <sys/time.h>
 #include <libacars/libacars.h>
@@ -17,17 +18,29 @@
 #include "acarsdec.h"
 #include "cJSON.h"
 #include "output.h"
+#include "metrics.h"
+#include "probes.h"
 
 extern int label_filter(char *lbl);
+extern void build_label_filter(char *arg);
 
 extern int inmode;
 extern char *idstation;
 
 static FILE *fdout;
+/* current log file and network address, to tell what a reload changes */
+static char *outLogname = NULL;
+static char *outRawaddr = NULL;
+/* copies given by outputReload to Fileoutinit and Netoutinit, that keep them */
+static char *reloadLogname = NULL;
+static char *reloadRawaddr = NULL;
 
 static char *jsonbuf=NULL;
 #define JSONBUFLEN 30000
 
+/* the control socket and SIGHUP change the sinks and the filters between two messages */
+static pthread_mutex_t outMtx = PTHREAD_MUTEX_INITIALIZER;
+
 #define IS_DOWNLINK_BLK(bid) ((bid) >= '0' && (bid) <= '9')
 
 #ifdef HAVE_LIBACARS
@@ -105,8 +118,24 @@ static inline void cls(void)
 	printf("\x1b[H\x1b[2J");
 }
 
+static char *strdup0(const char *s)
+{
+	return s ? strdup(s) : NULL;
+}
+
+static int strcmp0(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return a != b;
+	return strcmp(a, b);
+}
+
 int initOutput(char *logfilename, char *Rawaddr)
 {
+	/* before Fileoutinit cuts the extension off */
+	outLogname = strdup0(logfilename);
+	outRawaddr = strdup0(Rawaddr);
+
 	if (outtype != OUTTYPE_NONE && logfilename) {
 		if((fdout=Fileoutinit(logfilename)) == NULL)
 			return -1;
@@ -118,6 +147,10 @@ int initOutput(char *logfilename, char *Rawaddr)
 		if(Netoutinit(Rawaddr))
 			return -1;
 
+	if (arcfilename)
+		if(Binoutinit(arcfilename))
+			return -1;
+
 	if (outtype == OUTTYPE_MONITOR ) {
 		verbose=0;
 		cls();
@@ -163,12 +196,10 @@ static void printmsg(acarsmsg_t * msg, int chn, struct timeval tv)
 {
 	oooi_t oooi;
 
-#if defined (WITH_RTL) || defined (WITH_AIR) || defined (WITH_SOAPY)
-	if (inmode >= 3)
+	if (channel[chn].Fr != 0)
 		fprintf(fdout, "\n[#%1d (F:%3.3f L:%+5.1f E:%1d) ", chn + 1,
 			channel[chn].Fr / 1000000.0, msg->lvl, msg->err);
 	else
-#endif
 		fprintf(fdout, "\n[#%1d (L:%+5.1f E:%1d) ", chn + 1, msg->lvl, msg->err);
 
 	if (inmode != 2)
@@ -228,11 +259,7 @@ static int buildjson(acarsmsg_t * msg, int chn, struct timeval tv)
 {
 
 	oooi_t oooi;
-#if defined (WITH_RTL) || defined (WITH_AIR) || defined (WITH_SOAPY)
 	float freq = channel[chn].Fr / 1000000.0;
-#else
-	float freq = 0;
-#endif
 	cJSON *json_obj;
 	int ok = 0;
 	char convert_tmp[8];
@@ -483,13 +510,15 @@ static void printmonitor(acarsmsg_t * msg, int chn, struct timeval tv)
 	fflush(stdout);
 }
 
-void outputmsg(const msgblk_t * blk)
+static void outmsg(const msgblk_t * blk)
 {
 	acarsmsg_t msg;
 	int i, j, k;
+	int txt_len;
 	int jok=0;
 	int outflg=0;
-	flight_t *fl;
+	int res;
+	flight_t *fl=NULL;
 
 	/* fill msg struct */
 	memset(&msg, 0, sizeof(msg));
@@ -534,14 +563,10 @@ void outputmsg(const msgblk_t * blk)
 	msg.bs = blk->txt[k];
 	k++;
 
-	if (airflt && !down)
-		return;
-	if(label_filter(msg.label)==0)
-		return;
-
 	/* txt end */
 	msg.be = blk->txt[blk->len - 1];
 
+	txt_len = 0;
 	if (msg.bs != 0x03) {
 		if (down) {
 			/* message no */
@@ -565,7 +590,7 @@ void outputmsg(const msgblk_t * blk)
 
 			outflg=1;
 		}
-		int txt_len = blk->len - k - 1;
+		txt_len = blk->len - k - 1;
 #ifdef HAVE_LIBACARS
 
 		// Extract sublabel and MFI if present
@@ -575,7 +600,20 @@ void outputmsg(const msgblk_t * blk)
 			k += offset;
 			txt_len -= offset;
 		}
+#endif
+	}
+
+	/* archive every valid block, whatever the output filters */
+	if (arcfilename)
+		Binoutwrite(blk, &msg);
 
+	if ((airflt && !down) || label_filter(msg.label)==0) {
+		METRIC_INC(metrics.filtered);
+		return;
+	}
+
+	if (msg.bs != 0x03) {
+#ifdef HAVE_LIBACARS
 		la_reasm_table *acars_rtable = NULL;
 		if(msg.bid != 0 && reasm_ctx != NULL) { // not a squitter && reassembly engine is enabled
 			acars_rtable = la_reasm_table_lookup(reasm_ctx, &la_DEF_acars_message);
@@ -647,8 +685,10 @@ void outputmsg(const msgblk_t * blk)
 	if(outflg)
 		fl=addFlight(&msg,blk->chn,blk->tv);
 
-	if(emptymsg && ( msg.txt == NULL || msg.txt[0] == '\0'))
-			return;
+	if(emptymsg && ( msg.txt == NULL || msg.txt[0] == '\0')) {
+		METRIC_INC(metrics.filtered);
+		return;
+	}
 
 	if(jsonbuf) {
 		if(outtype == OUTTYPE_ROUTEJSON ) {
@@ -667,35 +707,59 @@ void outputmsg(const msgblk_t * blk)
 		break;
 	case OUTTYPE_ONELINE:
 		printoneline(&msg, blk->chn, blk->tv);
+		METRIC_INC(metrics.sink[SINK_OUT].sent);
+		PROBE3(output_sink, blk->chn, SINK_OUT, 0);
 		break;
 	case OUTTYPE_STD:
 		printmsg(&msg, blk->chn, blk->tv);
+		METRIC_INC(metrics.sink[SINK_OUT].sent);
+		PROBE3(output_sink, blk->chn, SINK_OUT, 0);
 		break;
 	case OUTTYPE_MONITOR:
 		printmonitor(&msg, blk->chn, blk->tv);
+		METRIC_INC(metrics.sink[SINK_OUT].sent);
+		PROBE3(output_sink, blk->chn, SINK_OUT, 0);
 		break;
 	case OUTTYPE_ROUTEJSON:
 	case OUTTYPE_JSON:
 		if(jok) {
 			fprintf(fdout, "%s\n", jsonbuf);
 			fflush(fdout);
-		}
+			METRIC_INC(metrics.sink[SINK_OUT].sent);
+			PROBE3(output_sink, blk->chn, SINK_OUT, 0);
+		} else
+			METRIC_INC(metrics.sink[SINK_OUT].dropped);
 		break;
 	}
 
 	switch (netout) {
 		case NETLOG_PLANEPLOTTER:
-			Netoutpp(&msg);
+			res = Netoutpp(&msg);
+			PROBE3(output_sink, blk->chn, SINK_NET, res);
 			break;
 		case NETLOG_NATIVE:
-			Netoutsv(&msg, idstation, blk->chn, blk->tv);
+			res = Netoutsv(&msg, idstation, blk->chn, blk->tv);
+			PROBE3(output_sink, blk->chn, SINK_NET, res);
 			break;
 		case NETLOG_JSON:
-			if(jok) Netoutjson(jsonbuf);
+			if(jok) {
+				res = Netoutjson(jsonbuf);
+				PROBE3(output_sink, blk->chn, SINK_NET, res);
+			} else
+				METRIC_INC(metrics.sink[SINK_NET].dropped);
 			break;
 #ifdef WITH_MQTT
 		case NETLOG_MQTT:
-			MQTTsend(jsonbuf);
+			if(!jok) {
+				METRIC_INC(metrics.sink[SINK_MQTT].dropped);
+				break;
+			}
+			res = MQTTsend(jsonbuf);
+			if(res)
+				METRIC_INC(metrics.sink[SINK_MQTT].errors);
+			else
+				METRIC_INC(metrics.sink[SINK_MQTT].sent);
+			PROBE3(output_sink, blk->chn, SINK_MQTT, res ? -1 : 0);
 			break;
 #endif
 	}
@@ -704,3 +768,123 @@ void outputmsg(const msgblk_t * blk)
 	la_proto_tree_destroy(msg.decoded_tree);
 #endif
 }
+
+void outputmsg(const msgblk_t * blk)
+{
+	pthread_mutex_lock(&outMtx);
+	outmsg(blk);
+	pthread_mutex_unlock(&outMtx);
+}
+
+/* control socket : send the messages to Rawaddr in the netfmt format, or stop with NETLOG_NONE */
+int outputNet(int netfmt, char *Rawaddr)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&outMtx);
+	Netoutclose();
+	netout = NETLOG_NONE;
+	free(outRawaddr);
+	/* Netoutinit cuts host:port in Rawaddr */
+	outRawaddr = strdup0(Rawaddr);
+	if (netfmt == NETLOG_JSON && jsonbuf == NULL)
+		jsonbuf = malloc(JSONBUFLEN+1);
+	if (netfmt != NETLOG_NONE) {
+		if ((netfmt == NETLOG_JSON && jsonbuf == NULL) || Netoutinit(Rawaddr))
+			res = -1;
+		else
+			netout = netfmt;
+	}
+	if (netout == NETLOG_NONE) {
+		free(outRawaddr);
+		outRawaddr = NULL;
+	}
+	pthread_mutex_unlock(&outMtx);
+	return res;
+}
+
+/* control socket : only output the labels of arg (l1:l2:...), all if NULL */
+void outputLabels(char *arg)
+{
+	pthread_mutex_lock(&outMtx);
+	build_label_filter(arg);
+	pthread_mutex_unlock(&outMtx);
+}
+
+/*
+ * SIGHUP : apply the output settings read again from the config file, all of them between
+ * two messages. The log file and the network output are only reopened if they changed ;
+ * if one can't be, it is stopped (the log going to stdout). The strings of oc are kept.
+ */
+int outputReload(const outconf_t *oc)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&outMtx);
+
+	build_label_filter(oc->lblf);
+	airflt = oc->airflt;
+	emptymsg = oc->emptymsg;
+	mdly = oc->mdly;
+	free(idstation);
+	idstation = strdup(oc->idstation);
+
+	if ((oc->outtype == OUTTYPE_NONE) != (outtype == OUTTYPE_NONE) || strcmp0(oc->logfilename, outLogname) ||
+	    oc->hourly != hourly || oc->daily != daily) {
+		if (fdout != stdout)
+			fclose(fdout);
+		fdout = stdout;
+		hourly = oc->hourly;
+		daily = oc->daily;
+		free(outLogname);
+		outLogname = strdup0(oc->logfilename);
+		if (oc->outtype != OUTTYPE_NONE && oc->logfilename) {
+			free(reloadLogname);
+			reloadLogname = strdup(oc->logfilename);
+			if (reloadLogname == NULL || (fdout = Fileoutinit(reloadLogname)) == NULL) {
+				fprintf(stderr, "Log file not reopened, output to stdout\n");
+				fdout = stdout;
+				res = -1;
+			}
+		}
+	}
+	if (oc->outtype == OUTTYPE_MONITOR && outtype != OUTTYPE_MONITOR) {
+		verbose = 0;
+		cls();
+		fflush(stdout);
+	}
+	outtype = oc->outtype;
+
+	if (oc->netout == NETLOG_MQTT || netout == NETLOG_MQTT) {
+		if (oc->netout != netout) {
+			fprintf(stderr, "MQTT output is only changed at restart\n");
+			res = -1;
+		}
+	} else if (oc->netout != netout || strcmp0(oc->Rawaddr, outRawaddr)) {
+		Netoutclose();
+		netout = NETLOG_NONE;
+		free(outRawaddr);
+		outRawaddr = NULL;
+		free(reloadRawaddr);
+		reloadRawaddr = NULL;
+		if (oc->netout != NETLOG_NONE) {
+			/* Netoutinit cuts host:port, and keeps its copy for the reconnections */
+			outRawaddr = strdup0(oc->Rawaddr);
+			reloadRawaddr = strdup0(oc->Rawaddr);
+			if (reloadRawaddr == NULL || Netoutinit(reloadRawaddr)) {
+				fprintf(stderr, "Network output to %s not started\n", outRawaddr);
+				free(outRawaddr);
+				outRawaddr = NULL;
+				res = -1;
+			} else {
+				netout = oc->netout;
+			}
+		}
+	}
+
+	if ((outtype == OUTTYPE_JSON || outtype == OUTTYPE_ROUTEJSON || netout == NETLOG_JSON) && jsonbuf == NULL)
+		jsonbuf = malloc(JSONBUFLEN+1);
+
+	pthread_mutex_unlock(&outMtx);
+	return res;
+}
@@ -1,8 +1,13 @@
 extern int Netoutinit(char *Rawaddr);
-extern void Netoutpp(acarsmsg_t * msg);
-extern void Netoutsv(acarsmsg_t * msg, char * idstation, int chn, struct timeval tv);
-extern void Netoutjson(char *jsonbuf);
+extern int Netoutpp(acarsmsg_t * msg);
+extern int Netoutsv(acarsmsg_t * msg, char * idstation, int chn, struct timeval tv);
+extern int Netoutjson(char *jsonbuf);
+extern void Netoutclose(void);
 
 extern FILE *Fileoutinit(char* logfilename);
 extern FILE *Fileoutrotate(FILE *fd);
 
+
+extern int Binoutinit(char *arcfilename);
+extern void Binoutwrite(const msgblk_t *blk, const acarsmsg_t *msg);
+extern void Binoutclose(void);
@@ -0,0 +1,104 @@
+/*
+ *  Copyright (c) 2015 Thierry Leconte
+ *
+ *
+ *   This code is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Library General Public License version 2
+ *   published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Library General Public License for more details.
+ *
+ */
+
+/*
+ * --auto-ppm : tuner frequency error estimation from the decoded traffic.
+ *
+ * Every frame that passes error correction brings the carrier offset of its
+ * channel at the end of the frame (see chanOffset). Divided by the channel
+ * frequency, it is the tuner error, plus the error of the transmitter and
+ * the doppler of the aircraft (up to 1ppm) : the median of the last
+ * PPMNBSAMPLES frames, of all channels, removes them.
+ * The rtl and soapy front ends poll ppmUpdate and change the tuner correction,
+ * in whole ppm, when the estimated error rounds to at least 1ppm. Frames
+ * are tagged with the number of changes at their end, those that ended
+ * before the last change are ignored.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "acarsdec.h"
+
+#define PPMNBSAMPLES 15
+#define PPMMAX 200
+
+static pthread_mutex_t ppmMtx = PTHREAD_MUTEX_INITIALIZER;
+static float ppmSamples[PPMNBSAMPLES];
+static int ppmNbSamples;
+static int ppmGen;
+
+/* called from the decoding threads at the end of a frame */
+void ppmTag(msgblk_t *blk)
+{
+	blk->foff = chanOffset(blk->chn);
+	blk->ppmgen = __atomic_load_n(&ppmGen, __ATOMIC_RELAXED);
+}
+
+/* called from the message thread for each valid frame */
+void ppmSample(const msgblk_t *blk)
+{
+	/* a tuner too high by e ppm sees the carriers e ppm too low */
+	float e = -blk->foff / channel[blk->chn].Fr * 1e6;
+
+	pthread_mutex_lock(&ppmMtx);
+	if (blk->ppmgen == ppmGen && ppmNbSamples < PPMNBSAMPLES)
+		ppmSamples[ppmNbSamples++] = e;
+	pthread_mutex_unlock(&ppmMtx);
+}
+
+static int cmpfloat(const void *a, const void *b)
+{
+	float x = *(const float *)a, y = *(const float *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* new tuner correction from the cur ppm one, return 1 if it should be changed to *newppm */
+int ppmUpdate(int cur, int *newppm)
+{
+	float s[PPMNBSAMPLES];
+	int p;
+
+	pthread_mutex_lock(&ppmMtx);
+	if (ppmNbSamples < PPMNBSAMPLES) {
+		pthread_mutex_unlock(&ppmMtx);
+		return 0;
+	}
+	memcpy(s, ppmSamples, sizeof(s));
+	ppmNbSamples = 0;
+	pthread_mutex_unlock(&ppmMtx);
+
+	qsort(s, PPMNBSAMPLES, sizeof(float), cmpfloat);
+	p = cur + lrintf(s[PPMNBSAMPLES / 2]);
+	if (p > PPMMAX)
+		p = PPMMAX;
+	if (p < -PPMMAX)
+		p = -PPMMAX;
+	if (p == cur)
+		return 0;
+
+	pthread_mutex_lock(&ppmMtx);
+	__atomic_add_fetch(&ppmGen, 1, __ATOMIC_RELAXED);
+	ppmNbSamples = 0;
+	pthread_mutex_unlock(&ppmMtx);
+
+	if (verbose)
+		fprintf(stderr, "tuner error estimated at %+.1fppm, correction set to %dppm\n", s[PPMNBSAMPLES / 2], p);
+	*newppm = p;
+	return 1;
+}
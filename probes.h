@@ -0,0 +1,38 @@
+/*
+ *  Copyright (c) 2015 Thierry Leconte
+ *
+ *
+ *   This code is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Library General Public License version 2
+ *   published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Library General Public License for more details.
+ *
+ */
+
+/*
+ * USDT static tracepoints (provider "acarsdec"), usable with bpftrace or perf :
+ *  input_block(len)			an input buffer of len samples (or bytes for rtl) arrived
+ *  acars_state(chn, state)		decodeAcars changed state (see channel_t Acarsstate)
+ *  acars_frame(chn, len, err)		a frame was queued for error correction
+ *  acars_fix(chn, res, perr, trials)	correction result (0 : valid), parity errors and crc trials
+ *  output_sink(chn, sink, res)		a message was written to a sink (see metrics.h), res < 0 on error
+ * Each probe is a single nop when not traced, and nothing at all without sys/sdt.h.
+ */
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define PROBE1(name, a) DTRACE_PROBE1(acarsdec, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(acarsdec, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(acarsdec, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(acarsdec, name, a, b, c, d)
+#else
+/* arguments are still referenced, so that variables only used by probes do not warn */
+#define PROBE1(name, a) do { (void)(a); } while (0)
+#define PROBE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+#define PROBE3(name, a, b, c) do { (void)(a); (void)(b); (void)(c); } while (0)
+#define PROBE4(name, a, b, c, d) do { (void)(a); (void)(b); (void)(c); (void)(d); } while (0)
+#endif
@@ -0,0 +1,266 @@
+/*
+ *  Copyright (c) 2016 Thierry Leconte
+ *
+ *
+ *   This code is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Library General Public License version 2
+ *   published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Library General Public License for more details.
+ *
+ */
+
+/*
+ * Raw IQ input : decode IQ samples recorded at INTRATE*rawMult samples/s
+ * (ie: rtl_sdr output) from a file or from stdin.
+ * Regular files are memory mapped, pipes are read by large blocks.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "acarsdec.h"
+#include "metrics.h"
+
+#define RAWMULTMAX 320
+#define RAWOUTBUFSZ 1024
+
+static int rawfd = -1;
+static const unsigned char *rawmap = NULL;
+static size_t rawmaplen = 0;
+static unsigned char *rawbuf = NULL;
+static int rawBps;
+
+static int rawsize(void)
+{
+	switch (rawFormat) {
+	case RAWFMT_CS16:
+		return 2 * sizeof(int16_t);
+	case RAWFMT_CF32:
+		return 2 * sizeof(float);
+	default:
+		return 2;
+	}
+}
+
+int initRaw(char **argv, int optind)
+{
+	char *argF;
+	unsigned int Fc;
+	struct stat st;
+	float scale;
+
+	if (argv[optind] == NULL || argv[optind + 1] == NULL) {
+		fprintf(stderr, "Need a file name (or - for stdin) and a center frequency after -R\n");
+		return 1;
+	}
+
+	if (rawMult <= 0 || rawMult > RAWMULTMAX) {
+		fprintf(stderr, "raw sample rate multiplier must be between 1 and %d\n", RAWMULTMAX);
+		return 1;
+	}
+	rawBps = rawsize();
+
+	if (strcmp(argv[optind], "-") == 0) {
+		rawfd = STDIN_FILENO;
+	} else {
+		rawfd = open(argv[optind], O_RDONLY);
+		if (rawfd < 0) {
+			fprintf(stderr, "could not open %s: %s\n", argv[optind], strerror(errno));
+			return 1;
+		}
+	}
+	optind++;
+
+	if (fstat(rawfd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		rawmaplen = st.st_size;
+		rawmap = mmap(NULL, rawmaplen, PROT_READ, MAP_PRIVATE, rawfd, 0);
+		if (rawmap == MAP_FAILED) {
+			rawmap = NULL;
+		} else {
+			madvise((void *)rawmap, rawmaplen, MADV_SEQUENTIAL);
+		}
+	}
+	if (rawmap == NULL) {
+		rawbuf = malloc(RAWOUTBUFSZ * rawMult * rawBps);
+		if (rawbuf == NULL) {
+			fprintf(stderr, "ERROR : malloc\n");
+			return 1;
+		}
+	}
+
+	Fc = (unsigned int)(1000000 * atof(argv[optind]) + 0.5);
+	optind++;
+
+	nbch = 0;
+	while (surveyBand == NULL && (argF = argv[optind]) && nbch < MAXNBCHANNELS) {
+		unsigned int Fd;
+
+		Fd = ((int)(1000000 * atof(argF) + INTRATE / 2) / INTRATE) * INTRATE;
+		optind++;
+		if (Fd < 118000000 || Fd > 138000000) {
+			fprintf(stderr, "WARNING: Invalid frequency %d\n", Fd);
+			continue;
+		}
+		if (abs((int)Fd - (int)Fc) > INTRATE * rawMult / 2 - INTRATE) {
+			fprintf(stderr, "WARNING: frequency %d outside of recorded band\n", Fd);
+			continue;
+		}
+		channel[nbch].chn = nbch;
+		channel[nbch].Fr = (float)Fd;
+		channel[nbch].amdet = chanAmDetector(argF);
+		nbch++;
+	}
+
+	if (surveyBand) {
+		/* a recording can't be retuned : the survey stays in its band */
+		if (initSurvey(INTRATE * rawMult, Fc, &Fc))
+			return 1;
+	} else if (nbch == 0) {
+		fprintf(stderr, "Need a least one frequency\n");
+		return 1;
+	}
+
+	switch (rawFormat) {
+	case RAWFMT_CS16:
+		scale = 1.0 / 32768.0;
+		break;
+	case RAWFMT_CF32:
+		scale = 1.0;
+		break;
+	default:
+		scale = 1.0 / 127.5;
+		break;
+	}
+
+	if (verbose)
+		fprintf(stderr, "Raw IQ input at %.4f MS/s centered on %dHz\n", INTRATE * rawMult / 1e6, Fc);
+
+	return initChan(Fc, rawMult, scale, RAWOUTBUFSZ);
+}
+
+/* read a full block from a pipe, return the number of complete output samples */
+static int readblk(void)
+{
+	size_t len = RAWOUTBUFSZ * rawMult * rawBps;
+	size_t got = 0;
+
+	while (got < len) {
+		ssize_t r = read(rawfd, rawbuf + got, len - got);
+		if (r < 0) {
+			if (errno == EINTR && !signalExit)
+				continue;
+			if (errno == EINTR)
+				break;
+			fprintf(stderr, "raw input read error: %s\n", strerror(errno));
+			break;
+		}
+		if (r == 0)
+			break;
+		got += r;
+	}
+	return got / (rawMult * rawBps);
+}
+
+static void processblk(const unsigned char *in, int nbo)
+{
+	float complex vb[RAWMULTMAX];
+	int m, ind;
+
+	if (surveyBand && surveyInput(nbo))
+		return;
+
+	METRIC_INPUT();
+	for (m = 0; m < nbo; m++) {
+		switch (rawFormat) {
+		case RAWFMT_CS16: {
+			const int16_t *s = (const int16_t *)in;
+			for (ind = 0; ind < rawMult; ind++)
+				vb[ind] = (float)s[2 * ind] + (float)s[2 * ind + 1] * I;
+			break;
+		}
+		case RAWFMT_CF32: {
+			const float *s = (const float *)in;
+			for (ind = 0; ind < rawMult; ind++)
+				vb[ind] = s[2 * ind] + s[2 * ind + 1] * I;
+			break;
+		}
+		default:
+			for (ind = 0; ind < rawMult; ind++)
+				vb[ind] = ((float)in[2 * ind] - 127.37f) + ((float)in[2 * ind + 1] - 127.37f) * I;
+			break;
+		}
+		in += rawMult * rawBps;
+
+		mixChan(vb, m);
+	}
+
+	demodChannels(nbo);
+}
+
+int runRawSample(void)
+{
+	struct timespec start, now;
+	unsigned long long nbout = 0;
+	size_t off = 0;
+	size_t blklen = RAWOUTBUFSZ * rawMult * rawBps;
+
+	/* the main thread reads and decodes */
+	stageThread(STAGE_INPUT, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (!signalExit) {
+		int nbo;
+
+		if (rawmap) {
+			size_t len = rawmaplen - off;
+			if (len > blklen)
+				len = blklen;
+			nbo = len / (rawMult * rawBps);
+			if (nbo == 0)
+				break;
+			processblk(rawmap + off, nbo);
+			off += len;
+		} else {
+			nbo = readblk();
+			if (nbo == 0)
+				break;
+			processblk(rawbuf, nbo);
+		}
+		nbout += nbo;
+		if (surveyBand && surveyOver())
+			break;
+
+		if (rawRealtime) {
+			double late;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			late = (double)nbout / INTRATE - (now.tv_sec - start.tv_sec) - (now.tv_nsec - start.tv_nsec) / 1e9;
+			if (late > 0)
+				usleep(late * 1e6);
+		}
+	}
+
+	if (verbose)
+		fprintf(stderr, "raw input: %llu samples decoded\n", nbout * rawMult);
+
+	if (rawmap)
+		munmap((void *)rawmap, rawmaplen);
+	if (rawfd > STDIN_FILENO)
+		close(rawfd);
+	free(rawbuf);
+
+	return 0;
+}
@@ -26,16 +26,21 @@
 #include <math.h>
 #include <rtl-sdr.h>
 #include "acarsdec.h"
+#include "metrics.h"
+#include "probes.h"
 #include <signal.h>
 #include <unistd.h>
 
 // set the sameple rate by changing RTMULT
-// 2.5Ms/s is the best but could be over limit for some hardware
-// 2.0Ms/s is safer
-// rtlMult 160	// 2.0000 Ms/s
-// rtlMult 192	// 2.4000 Ms/s
+// by default (rtlMult 0), the lowest one where all the channels fit :
+// rtlMult 80	// 1.0000 Ms/s, the dongle is not reliable below
+// rtlMult 160	// 2.0000 Ms/s, for --survey and --hop
+// rtlMult 192	// 2.4000 Ms/s, the highest safe one
 // rtlMult 200   // 2.5000 Ms/s
 
+#define RTLMULTMIN 80
+#define RTLMULTDEF 160
+#define RTLMULTPLAN 192
 #define RTLMULTMAX 320 // this is well beyond the rtl-sdr capabilities
 
 static rtlsdr_dev_t *dev = NULL;
@@ -44,7 +49,15 @@ static int rtlInBufSize = 0;
 static int rtlInRate = 0;
 
 static int watchdogCounter = 50;
+static int readEnded = 0;
 static pthread_mutex_t cbMutex = PTHREAD_MUTEX_INITIALIZER;
+/* dev is closed and reopened by rtlReopen while the control thread may set the gain */
+static pthread_mutex_t devMutex = PTHREAD_MUTEX_INITIALIZER;
+/* serial of the device, to find it again after an outage */
+static char rtlSerial[256];
+
+/* reopening the device after an outage : 1s, 2s, 4s ... up to RTLRETRYMAX */
+#define RTLRETRYMAX 30
 
 #define RTLOUTBUFSZ 1024
 
@@ -128,45 +141,6 @@ int verbose_device_search(char *s)
 	return -1;
 }
 
-static unsigned int chooseFc(unsigned int *Fd, unsigned int nbch)
-{
-	int n;
-	int ne;
-	int Fc;
-	do {
-		ne = 0;
-		for (n = 0; n < nbch - 1; n++) {
-			if (Fd[n] > Fd[n + 1]) {
-				unsigned int t;
-				t = Fd[n + 1];
-				Fd[n + 1] = Fd[n];
-				Fd[n] = t;
-				ne = 1;
-			}
-		}
-	} while (ne);
-
-	if ((Fd[nbch - 1] - Fd[0]) > rtlInRate - 4 * INTRATE) {
-		fprintf(stderr, "Frequencies too far apart\n");
-		return 0;
-	}
-
-	for (Fc = Fd[nbch - 1] + 2 * INTRATE; Fc > Fd[0] - 2 * INTRATE; Fc--) {
-		for (n = 0; n < nbch; n++) {
-			if (abs(Fc - Fd[n]) > rtlInRate / 2 - 2 * INTRATE)
-				break;
-			if (abs(Fc - Fd[n]) < 2 * INTRATE)
-				break;
-			if (n > 0 && Fc - Fd[n - 1] == Fd[n] - Fc)
-				break;
-		}
-		if (n == nbch)
-			break;
-	}
-
-	return Fc;
-}
-
 int nearest_gain(int target_gain)
 {
 	int i, err1, err2, count, close_gain;
@@ -190,32 +164,15 @@ int nearest_gain(int target_gain)
 	return close_gain;
 }
 
-int initRtl(char **argv, int optind)
+/* open device dev_index, with the current gain and ppm */
+static int rtlOpen(int dev_index)
 {
-	int r, n;
-	int dev_index;
-	char *argF;
-	unsigned int Fc;
-	unsigned int Fd[MAXNBCHANNELS];
-
-	if (argv[optind] == NULL) {
-		fprintf(stderr, "Need device name or index (ex: 0) after -r\n");
-		exit(1);
-	}
-	dev_index = verbose_device_search(argv[optind]);
-	optind++;
-
-	if (rtlMult > RTLMULTMAX) {
-		fprintf(stderr, "rtlMult can't be larger than 360\n");
-		return 1;
-	}
-
-    rtlInBufSize = RTLOUTBUFSZ * rtlMult * 2;
-    rtlInRate = INTRATE * rtlMult;
+	int r;
 
 	r = rtlsdr_open(&dev, dev_index);
 	if (r < 0) {
 		fprintf(stderr, "Failed to open rtlsdr device\n");
+		dev = NULL;
 		return r;
 	}
 
@@ -233,15 +190,75 @@ int initRtl(char **argv, int optind)
 	if (r < 0)
 		fprintf(stderr, "WARNING: Failed to set gain.\n");
 
+	METRIC_SET(metrics.ppm, ppm);
 	if (ppm != 0) {
 		r = rtlsdr_set_freq_correction(dev, ppm);
 		if (r < 0)
 			fprintf(stderr,
 				"WARNING: Failed to set freq. correction\n");
 	}
+	return 0;
+}
+
+/* center the device on Fc at rtlInRate, ready to stream */
+static int rtlStart(unsigned int Fc)
+{
+	int r;
+
+	if (verbose)
+		fprintf(stderr, "Set center freq. to %dHz\n", (int)Fc);
+
+	r = rtlsdr_set_center_freq(dev, Fc);
+	if (r < 0) {
+		fprintf(stderr, "WARNING: Failed to set center freq.\n");
+		return 1;
+	}
+
+    fprintf(stderr, "Setting sample rate: %.4f MS/s\n", rtlInRate / 1e6);
+	r = rtlsdr_set_sample_rate(dev, (unsigned) rtlInRate);
+	if (r < 0) {
+		fprintf(stderr, "WARNING: Failed to set sample rate.\n");
+		return 1;
+	}
+
+	r = rtlsdr_reset_buffer(dev);
+	if (r < 0) {
+		fprintf(stderr, "WARNING: Failed to reset buffers.\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+int initRtl(char **argv, int optind)
+{
+	int r;
+	int dev_index;
+	char *argF;
+	unsigned int Fc;
+	unsigned int Fd[MAXNBCHANNELS];
+	char vendor[256], product[256];
+
+	if (argv[optind] == NULL) {
+		fprintf(stderr, "Need device name or index (ex: 0) after -r\n");
+		exit(1);
+	}
+	dev_index = verbose_device_search(argv[optind]);
+	if (dev_index < 0 || rtlsdr_get_device_usb_strings(dev_index, vendor, product, rtlSerial) || rtlSerial[0] == 0)
+		strncpy(rtlSerial, argv[optind], sizeof(rtlSerial) - 1);
+	optind++;
+
+	if (rtlMult > RTLMULTMAX) {
+		fprintf(stderr, "rtlMult can't be larger than 360\n");
+		return 1;
+	}
+
+	r = rtlOpen(dev_index);
+	if (r < 0)
+		return r;
 
 	nbch = 0;
-	while ((argF = argv[optind]) && nbch < MAXNBCHANNELS) {
+	while (surveyBand == NULL && (argF = argv[optind]) && nbch < MAXNBCHANNELS) {
 		Fd[nbch] =
 		    ((int)(1000000 * atof(argF) + INTRATE / 2) / INTRATE) *
 		    INTRATE;
@@ -253,6 +270,7 @@ int initRtl(char **argv, int optind)
 		}
 		channel[nbch].chn = nbch;
 		channel[nbch].Fr = (float)Fd[nbch];
+		channel[nbch].amdet = chanAmDetector(argF);
 		nbch++;
 	};
 	if (nbch > MAXNBCHANNELS)
@@ -260,71 +278,67 @@ int initRtl(char **argv, int optind)
 			"WARNING: too many frequencies, using only the first %d\n",
 			MAXNBCHANNELS);
 
-	if (nbch == 0) {
-		fprintf(stderr, "Need a least one frequency\n");
-		return 1;
+	if (surveyBand || hopDwell) {
+		if (rtlMult == 0)
+			rtlMult = RTLMULTDEF;
+		rtlInRate = INTRATE * rtlMult;
 	}
 
-	Fc = chooseFc(Fd, nbch);
-	if (Fc == 0)
-		return 1;
-
-	for (n = 0; n < nbch; n++) {
-		channel_t *ch = &(channel[n]);
-		int ind;
-		float AMFreq;
-
-		ch->wf = malloc(rtlMult * sizeof(float complex));
-		ch->dm_buffer=malloc(RTLOUTBUFSZ*sizeof(float));
-		if( ch->wf == NULL || ch->dm_buffer == NULL) {
-			fprintf(stderr, "ERROR : malloc\n");
+	if (surveyBand) {
+		if (initSurvey(rtlInRate, 0, &Fc))
+			return 1;
+	} else {
+		if (nbch == 0) {
+			fprintf(stderr, "Need a least one frequency\n");
 			return 1;
 		}
-		AMFreq = (ch->Fr - (float)Fc) / (float)(rtlInRate) * 2.0 * M_PI;
-		for (ind = 0; ind < rtlMult; ind++) {
-			ch->wf[ind]=cexpf(AMFreq*ind*-I)/rtlMult/127.5;
+
+		if (hopDwell) {
+			if (initHop(rtlInRate, &Fc))
+				return 1;
+		} else {
+			Fc = 0;
+			if (rtlMult)
+				rtlMult = chanPlan(Fd, nbch, rtlMult, rtlMult, NULL, &Fc);
+			else
+				rtlMult = chanPlan(Fd, nbch, RTLMULTMIN, RTLMULTPLAN, NULL, &Fc);
+			if (rtlMult == 0)
+				return 1;
 		}
 	}
 
-	if (verbose)
-		fprintf(stderr, "Set center freq. to %dHz\n", (int)Fc);
+	rtlInBufSize = RTLOUTBUFSZ * rtlMult * 2;
+	rtlInRate = INTRATE * rtlMult;
 
-	r = rtlsdr_set_center_freq(dev, Fc);
-	if (r < 0) {
-		fprintf(stderr, "WARNING: Failed to set center freq.\n");
+	if (initChan(Fc, rtlMult, 1.0 / 127.5, RTLOUTBUFSZ))
 		return 1;
-	}
 
-    fprintf(stderr, "Setting sample rate: %.4f MS/s\n", rtlInRate / 1e6);
-	r = rtlsdr_set_sample_rate(dev, (unsigned) rtlInRate);
-	if (r < 0) {
-		fprintf(stderr, "WARNING: Failed to set sample rate.\n");
-		return 1;
-	}
-
-	r = rtlsdr_reset_buffer(dev);
-	if (r < 0) {
-		fprintf(stderr, "WARNING: Failed to reset buffers.\n");
-		return 1;
-	}
-
-	return 0;
+	return rtlStart(Fc);
 }
 
 static void in_callback(unsigned char *rtlinbuff, uint32_t nread, void *ctx)
 {
-	int n;
-
 	pthread_mutex_lock(&cbMutex);
 	watchdogCounter = 50;
 	pthread_mutex_unlock(&cbMutex);
 
 	if (nread != rtlInBufSize) {
 		fprintf(stderr, "warning: partial read\n");
+		METRIC_INC(metrics.inoverruns);
 		return;
 
 	}
 	status=0;
+	METRIC_INPUT();
+	PROBE1(input_block, nread);
+
+	if (iqrecprefix)
+		IQrecput(rtlinbuff, nread);
+
+	if (surveyBand && surveyInput(RTLOUTBUFSZ))
+		return;
+	if (hopDwell && hopInput(RTLOUTBUFSZ))
+		return;
 
 	// code requires this relationship set in initRtl:
 	// rtlInBufSize = RTLOUTBUFSZ * rtlMult * 2;
@@ -341,86 +355,205 @@ static void in_callback(unsigned char *rtlinbuff, uint32_t nread, void *ctx)
 			vb[ind]=r+g*I;
 		}
 
-		for (n = 0; n < nbch; n++) {
-			channel_t *ch = &(channel[n]);
-			float complex D,*wf;
-
-			wf = ch->wf;
-			D = 0;
-			for (int ind = 0; ind < rtlMult; ind++) {
-				D += vb[ind] * wf[ind];
-			}
-			ch->dm_buffer[m]=cabsf(D);
-		}
+		mixChan(vb, m);
 	}
 
-	for (n = 0; n < nbch; n++) {
-		channel_t *ch = &(channel[n]);
-		demodMSK(ch,RTLOUTBUFSZ);
-	}
+	demodChannels(RTLOUTBUFSZ);
 }
 
 static void *readThreadEntryPoint(void *arg) {
+	/* the usb callbacks run in this thread */
+	stageThread(STAGE_INPUT, "acarsdec-in");
 	rtlsdr_read_async(dev, in_callback, NULL, 4, rtlInBufSize);
 	pthread_mutex_lock(&cbMutex);
-	signalExit = 1;
+	readEnded = 1;
 	pthread_mutex_unlock(&cbMutex);
 	return NULL;
 }
 
-int runRtlSample(void)
+/* apply the tuner correction estimated from the decoded messages */
+static void rtlAutoPpm(void)
 {
-	pthread_t readThread;
-	pthread_create(&readThread, NULL, readThreadEntryPoint, NULL);
+	int p;
+
+	if (ppmUpdate(ppm, &p) == 0)
+		return;
+	if (rtlsdr_set_freq_correction(dev, p) != 0) {
+		fprintf(stderr, "WARNING: Failed to set freq. correction\n");
+		return;
+	}
+	ppm = p;
+	METRIC_SET(metrics.ppm, ppm);
+}
+
+/* wait up to 0.1s for the survey or the hopping to ask for another center frequency, and set it */
+static void rtlTune(void)
+{
+	unsigned int Fc = chanWaitTune(100);
+
+	if (Fc == 0)
+		return;
+	if (rtlsdr_set_center_freq(dev, Fc) < 0)
+		fprintf(stderr, "WARNING: Failed to set center freq.\n");
+	chanTuneDone(Fc);
+}
+
+/* control loop while the device streams : return 1 if it stopped sending data, 0 to exit */
+static int rtlWatch(void)
+{
+	int stalled = 0;
 
 	pthread_mutex_lock(&cbMutex);
+	watchdogCounter = 50;
 
 	while (!signalExit) {
-		if (--watchdogCounter <= 0) {
-			fprintf(stderr, "No data from the SDR for 5 seconds, exiting ...\n");
-			runRtlCancel(); // watchdog triggered after 5 seconds of no data from SDR
+		if (readEnded || --watchdogCounter <= 0) {
+			stalled = 1;
 			break;
 		}
 		pthread_mutex_unlock(&cbMutex);
-		usleep(100 * 1000); // 0.1 seconds
+		if (autoPpm)
+			rtlAutoPpm();
+		if (surveyBand && surveyOver()) {
+			pthread_mutex_lock(&cbMutex);
+			break;
+		}
+		rtlTune(); // 0.1 seconds
 		pthread_mutex_lock(&cbMutex);
 	}
 
 	pthread_mutex_unlock(&cbMutex);
+	return stalled;
+}
 
-	int count = 100; // 10 seconds
-	int err = 0;
-	// Wait on reader thread exit
-	while (count-- > 0 && (err = pthread_tryjoin_np(readThread, NULL))) {
-		usleep(100 * 1000); // 0.1 seconds
+/* with devMutex held */
+static int rtlCloseDev(void)
+{
+	int res = 0;
+	if (dev) {
+		res = rtlsdr_close(dev);
+		dev = NULL;
 	}
-	if (err) {
-		fprintf(stderr, "Receive thread termination failed, will raise SIGKILL to ensure we die!\n");
-		raise(SIGKILL);
-		return 1;
+	if (res) {
+		fprintf(stderr, "rtlsdr_close: %d\n", res);
 	}
 
-	return 0;
+	return res;
 }
 
-int runRtlCancel(void) {
-	if (dev) {
-		rtlsdr_cancel_async(dev); // interrupt read_async
+int runRtlClose(void) {
+	int res;
+
+	pthread_mutex_lock(&devMutex);
+	res = rtlCloseDev();
+	pthread_mutex_unlock(&devMutex);
+	return res;
+}
+
+/*
+ * the device stopped sending data : close it, and reopen it with a growing delay
+ * between tries, restarting the channels where they were. Return 1 to exit.
+ */
+static int rtlReopen(void)
+{
+	unsigned long long t0 = METRIC_GET(metrics.inputts);
+	int delay = 1;
+
+	if (t0 == 0)
+		t0 = monotonic_us();
+	METRIC_INC(metrics.outages);
+	METRIC_SET(metrics.outagets, t0);
+	runRtlClose();
+
+	for (;;) {
+		int t, dev_index, ok;
+
+		fprintf(stderr, "Reopening the SDR in %ds ...\n", delay);
+		for (t = 0; t < delay * 10; t++) {
+			if (signalExit)
+				return 1;
+			usleep(100 * 1000);
+		}
+		dev_index = verbose_device_search(rtlSerial);
+		pthread_mutex_lock(&devMutex);
+		ok = dev_index >= 0 && rtlOpen(dev_index) == 0 && rtlStart(chanRestart()) == 0;
+		if (!ok)
+			rtlCloseDev();
+		pthread_mutex_unlock(&devMutex);
+		if (ok)
+			break;
+		if (delay < RTLRETRYMAX)
+			delay = delay * 2 < RTLRETRYMAX ? delay * 2 : RTLRETRYMAX;
 	}
+
+	METRIC_ADD(metrics.outageus, monotonic_us() - t0);
+	METRIC_SET(metrics.outagets, 0);
+	fprintf(stderr, "SDR back after %.1fs without data\n", (monotonic_us() - t0) / 1e6);
 	return 0;
 }
 
-int runRtlClose(void) {
-	int res = 0;
-	if (dev) {
-		res = rtlsdr_close(dev);
-		dev = NULL;
+int runRtlSample(void)
+{
+	pthread_t readThread;
+
+	/* the tuner control loop */
+	stageThread(STAGE_AUX, NULL);
+
+	for (;;) {
+		int stalled;
+
+		readEnded = 0;
+		pthread_create(&readThread, NULL, readThreadEntryPoint, NULL);
+
+		stalled = rtlWatch();
+		if (stalled)
+			fprintf(stderr, "No data from the SDR for 5 seconds ...\n");
+		runRtlCancel();
+
+		int count = 100; // 10 seconds
+		int err = 0;
+		// Wait on reader thread exit
+		while (count-- > 0 && (err = pthread_tryjoin_np(readThread, NULL))) {
+			usleep(100 * 1000); // 0.1 seconds
+		}
+		if (err) {
+			fprintf(stderr, "Receive thread termination failed, will raise SIGKILL to ensure we die!\n");
+			raise(SIGKILL);
+			return 1;
+		}
+
+		if (!stalled || rtlReopen())
+			break;
 	}
-	if (res) {
-		fprintf(stderr, "rtlsdr_close: %d\n", res);
+
+	return 0;
+}
+
+/* control socket : tuner gain in dB, AGC if over 52 or -10 */
+int rtlSetGain(float g)
+{
+	int r;
+
+	pthread_mutex_lock(&devMutex);
+	if (dev == NULL) {
+		r = -1;
+	} else if (g > 52 || g == -10) {
+		r = rtlsdr_set_tuner_gain_mode(dev, 0);
+	} else {
+		rtlsdr_set_tuner_gain_mode(dev, 1);
+		r = rtlsdr_set_tuner_gain(dev, nearest_gain(lrintf(10 * g)));
 	}
+	if (r >= 0)
+		gain = lrintf(10 * g);
+	pthread_mutex_unlock(&devMutex);
+	return r < 0;
+}
 
-	return res;
+int runRtlCancel(void) {
+	if (dev) {
+		rtlsdr_cancel_async(dev); // interrupt read_async
+	}
+	return 0;
 }
 
 
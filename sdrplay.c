@@ -30,6 +30,8 @@
 #include <pthread.h>
 #include <math.h>
 #include "acarsdec.h"
+#include "metrics.h"
+#include "probes.h"
 #include <mirsdrapi-rsp.h>
 
 #define SDRPLAY_MULT 160
@@ -211,7 +213,15 @@ void myStreamCallback (int16_t		*xi,
 	               void		*cbContext) {
 int n, i;
 int	local_ind;
+static int placed = 0;
 
+	/* the sdrplay api thread */
+	if (!placed) {
+		stageThread(STAGE_INPUT, "acarsdec-in");
+		placed = 1;
+	}
+	METRIC_INPUT();
+	PROBE1(input_block, numSamples);
 	for (n = 0; n < nbch; n ++) {
 	   local_ind = current_index;
 	   channel_t *ch = &(channel [n]);
@@ -281,9 +291,10 @@ int	localGRdB	= (20 <= GRdB) && (GRdB <= 59) ? GRdB : 20;
 	mir_sdr_SetDcTrackTime (63);
 //
 	mir_sdr_DCoffsetIQimbalanceControl (0, 1);
-	while (1)
-	   sleep(2);
+	while (!signalExit)
+	   usleep(100000);
 
+	mir_sdr_StreamUninit ();
 	mir_sdr_ReleaseDeviceIdx ();
 	return 0;
 }
@@ -15,6 +15,8 @@
 #include <unistd.h>
 
 #include "acarsdec.h"
+#include "metrics.h"
+#include "probes.h"
 
 static SoapySDRDevice *dev = NULL;
 static SoapySDRStream *stream = NULL;
@@ -22,73 +24,55 @@ static int16_t* soapyInBuf = NULL;
 static int soapyInBufSize = 0;
 static int soapyInRate = 0;
 static int watchdogCounter = 50;
-static int current_index = 0;
+static float complex *soapyVb = NULL;
+static int soapyVbInd = 0;
+static int soapyDmInd = 0;
+static int soapyStop = 0;
+static int readEnded = 0;
 static pthread_mutex_t cbMutex = PTHREAD_MUTEX_INITIALIZER;
+/* dev is closed and reopened by soapyReopen while the control thread may set the gain */
+static pthread_mutex_t devMutex = PTHREAD_MUTEX_INITIALIZER;
+/* device string, to open it again after an outage */
+static char *soapyArgs = NULL;
+
+extern char *antenna;
+
+/* reopening the device after an outage : 1s, 2s, 4s ... up to SOAPYRETRYMAX */
+#define SOAPYRETRYMAX 30
 
 #define SOAPYOUTBUFSZ 1024
 
-static unsigned int chooseFc(unsigned int *Fd, unsigned int nbch)
-{
-	int n;
-	int ne;
-	int Fc;
-	do {
-		ne = 0;
-		for (n = 0; n < nbch - 1; n++) {
-			if (Fd[n] > Fd[n + 1]) {
-				unsigned int t;
-				t = Fd[n + 1];
-				Fd[n + 1] = Fd[n];
-				Fd[n] = t;
-				ne = 1;
-			}
-		}
-	} while (ne);
+/* by default (rateMult 0), the lowest sample rate of the device where all the channels fit */
+#define SOAPYMULTMIN 8
+#define SOAPYMULTDEF 160	/* 2 MS/s, for --survey and --hop */
+#define SOAPYMULTMAX 800
 
-	if ((Fd[nbch - 1] - Fd[0]) > soapyInRate - 4 * INTRATE) {
-		fprintf(stderr, "Frequencies too far apart\n");
-		return 0;
-	}
+static SoapySDRRange *soapyRates = NULL;
+static size_t soapyNbRates = 0;
 
-	for (Fc = Fd[nbch - 1] + 2 * INTRATE; Fc > Fd[0] - 2 * INTRATE; Fc--) {
-		for (n = 0; n < nbch; n++) {
-			if (abs(Fc - Fd[n]) > soapyInRate / 2 - 2 * INTRATE)
-				break;
-			if (abs(Fc - Fd[n]) < 2 * INTRATE)
-				break;
-			if (n > 0 && Fc - Fd[n - 1] == Fd[n] - Fc)
-				break;
-		}
-		if (n == nbch)
-			break;
-	}
+/* planner : is the sample rate supported by the device */
+static int soapyRateOk(int rate)
+{
+	size_t i;
 
-	return Fc;
+	if (soapyNbRates == 0)
+		return rate == INTRATE * SOAPYMULTDEF;
+	for (i = 0; i < soapyNbRates; i++)
+		if (rate >= soapyRates[i].minimum && rate <= soapyRates[i].maximum)
+			return 1;
+	return 0;
 }
 
-int initSoapy(char **argv, int optind)
+/* open the soapyArgs device, with the current gain and ppm */
+static int soapyOpen(void)
 {
-	int r, n;
-	char *argF;
-	unsigned int Fc;
-	unsigned int Fd[MAXNBCHANNELS];
+	int r;
 
-	if (argv[optind] == NULL) {
-		fprintf(stderr, "Need device string (ex: driver=rtltcp,rtltcp=127.0.0.1) after -d\n");
-		exit(1);
-	}
-
-	dev = SoapySDRDevice_makeStrArgs(argv[optind]);
+	dev = SoapySDRDevice_makeStrArgs(soapyArgs);
 	if(dev == NULL) {
-		fprintf(stderr, "Error opening SoapySDR device using string \"%s\": %s", argv[optind], SoapySDRDevice_lastError());
+		fprintf(stderr, "Error opening SoapySDR device using string \"%s\": %s", soapyArgs, SoapySDRDevice_lastError());
 		return -1;
 	}
-	optind++;
-
-    soapyInBufSize = SOAPYOUTBUFSZ * rateMult * 2;
-    soapyInRate = INTRATE * rateMult;
-
-	soapyInBuf = malloc(sizeof(int16_t) * soapyInBufSize);
 
 	if (gain == -10.0) {
 		if (verbose)
@@ -107,14 +91,58 @@ int initSoapy(char **argv, int optind)
 			fprintf(stderr, "WARNING: Failed to set gain: %s\n", SoapySDRDevice_lastError());
 	}
 
+	METRIC_SET(metrics.ppm, ppm);
 	if (ppm != 0) {
 		r = SoapySDRDevice_setFrequencyCorrection(dev, SOAPY_SDR_RX, 0, ppm);
 		if (r != 0)
 			fprintf(stderr, "WARNING: Failed to set freq correction: %s\n", SoapySDRDevice_lastError());
 	}
+	return 0;
+}
+
+/* center the device on Fc at soapyInRate, and set up its stream */
+static int soapyStart(unsigned int Fc)
+{
+	int r;
+
+	if (verbose)
+		fprintf(stderr, "Set center freq. to %dHz\n", (int)Fc);
+	r = SoapySDRDevice_setFrequency(dev, SOAPY_SDR_RX, 0, Fc, NULL);
+	if (r != 0)
+		fprintf(stderr, "WARNING: Failed to set frequency: %s\n", SoapySDRDevice_lastError());
+
+	if (verbose)
+		fprintf(stderr, "Setting sample rate: %.4f MS/s\n", soapyInRate / 1e6);
+	r = SoapySDRDevice_setSampleRate(dev, SOAPY_SDR_RX, 0, soapyInRate);
+	if (r != 0)
+		fprintf(stderr, "WARNING: Failed to set sample rate: %s\n", SoapySDRDevice_lastError());
+
+	stream = SoapySDRDevice_setupStream(dev, SOAPY_SDR_RX, SOAPY_SDR_CS16, NULL, 0, NULL);
+	if (stream == NULL) {
+		fprintf(stderr, "WARNING: Failed to set up the stream: %s\n", SoapySDRDevice_lastError());
+		return 1;
+	}
+	return 0;
+}
+
+int initSoapy(char **argv, int optind)
+{
+	char *argF;
+	unsigned int Fc;
+	unsigned int Fd[MAXNBCHANNELS];
+
+	if (argv[optind] == NULL) {
+		fprintf(stderr, "Need device string (ex: driver=rtltcp,rtltcp=127.0.0.1) after -d\n");
+		exit(1);
+	}
+
+	soapyArgs = argv[optind];
+	if (soapyOpen())
+		return -1;
+	optind++;
 
 	nbch = 0;
-	while ((argF = argv[optind]) && nbch < MAXNBCHANNELS) {
+	while (surveyBand == NULL && (argF = argv[optind]) && nbch < MAXNBCHANNELS) {
 		Fd[nbch] = ((int)(1000000 * atof(argF) + INTRATE / 2) / INTRATE) * INTRATE;
 		optind++;
 		if (Fd[nbch] < 118000000 || Fd[nbch] > 138000000) {
@@ -124,6 +152,7 @@ int initSoapy(char **argv, int optind)
 		}
 		channel[nbch].chn = nbch;
 		channel[nbch].Fr = (float)Fd[nbch];
+		channel[nbch].amdet = chanAmDetector(argF);
 		nbch++;
 	};
 	if (nbch > MAXNBCHANNELS)
@@ -131,56 +160,52 @@ int initSoapy(char **argv, int optind)
 			"WARNING: too many frequencies, using only the first %d\n",
 			MAXNBCHANNELS);
 
-	if (nbch == 0) {
- 		fprintf(stderr, "Need a least one frequency\n");
-		return 1;
+	if (surveyBand || hopDwell) {
+		if (rateMult == 0)
+			rateMult = SOAPYMULTDEF;
+		soapyInRate = INTRATE * rateMult;
 	}
 
-	if(freq == 0)
-		freq = chooseFc(Fd, nbch);
-
-	if(freq == 0)
+	if (surveyBand) {
+		/* with -c, the survey stays in the tuned band */
+		if (initSurvey(soapyInRate, freq, &Fc))
+			return 1;
+		freq = Fc;
+	} else if (nbch == 0) {
+ 		fprintf(stderr, "Need a least one frequency\n");
 		return 1;
-
-	for (n = 0; n < nbch; n++) {
-		if (Fd[n] < freq - soapyInRate/2 || Fd[n] > freq + soapyInRate/2) {
-			fprintf(stderr, "WARNING: frequency not in tuned range %d-%d: %d\n",
-				freq - soapyInRate/2, freq + soapyInRate/2, Fd[n]);
-			continue;
+	} else if (hopDwell) {
+		/* -c is ignored, each group has its own center frequency */
+		if (initHop(soapyInRate, &Fc))
+			return 1;
+		freq = Fc;
+	} else {
+		Fc = freq;
+		if (rateMult) {
+			rateMult = chanPlan(Fd, nbch, rateMult, rateMult, NULL, &Fc);
+		} else {
+			soapyRates = SoapySDRDevice_getSampleRateRange(dev, SOAPY_SDR_RX, 0, &soapyNbRates);
+			rateMult = chanPlan(Fd, nbch, SOAPYMULTMIN, SOAPYMULTMAX, soapyRateOk, &Fc);
+			free(soapyRates);
 		}
+		if (rateMult == 0)
+			return 1;
+		freq = Fc;
 	}
 
-	for (n = 0; n < nbch; n++) {
-		channel_t *ch = &(channel[n]);
-		int ind;
-		float AMFreq;
-
-		ch->counter = 0;
-		ch->D = 0;
-		ch->oscillator = malloc(rateMult * sizeof(float complex));
-		ch->dm_buffer = malloc(SOAPYOUTBUFSZ*sizeof(float));
+	soapyInBufSize = SOAPYOUTBUFSZ * rateMult * 2;
+	soapyInRate = INTRATE * rateMult;
+	soapyInBuf = malloc(sizeof(int16_t) * soapyInBufSize);
 
-		AMFreq = (ch->Fr - (float)freq) / (float)(soapyInRate) * 2.0 * M_PI;
-		for (ind = 0; ind < rateMult; ind++) {
-			ch->oscillator[ind] = cexpf(AMFreq*ind*-I)/rateMult;
-		}
+	soapyVb = malloc(rateMult * sizeof(float complex));
+	if (soapyInBuf == NULL || soapyVb == NULL) {
+		fprintf(stderr, "ERROR : malloc\n");
+		return 1;
 	}
+	if (initChan(freq, rateMult, 1.0 / 32768.0, SOAPYOUTBUFSZ))
+		return 1;
 
-	if (verbose)
-		fprintf(stderr, "Set center freq. to %dHz\n", (int)freq);
-	r = SoapySDRDevice_setFrequency(dev, SOAPY_SDR_RX, 0, freq, NULL);
-	if (r != 0)
-		fprintf(stderr, "WARNING: Failed to set frequency: %s\n", SoapySDRDevice_lastError());
-
-	if (verbose)
-		fprintf(stderr, "Setting sample rate: %.4f MS/s\n", soapyInRate / 1e6);
-	r = SoapySDRDevice_setSampleRate(dev, SOAPY_SDR_RX, 0, soapyInRate);
-	if (r != 0)
-		fprintf(stderr, "WARNING: Failed to set sample rate: %s\n", SoapySDRDevice_lastError());
-
-	stream = SoapySDRDevice_setupStream(dev, SOAPY_SDR_RX, SOAPY_SDR_CS16, NULL, 0, NULL);
-
-	return 0;
+	return soapyStart(freq);
 }
 
 int soapySetAntenna(const char *antenna) {
@@ -202,6 +227,26 @@ int soapySetAntenna(const char *antenna) {
 	return 0;
 }
 
+/* control socket : gain in dB, AGC if -10 */
+int soapySetGain(double g)
+{
+	int r;
+
+	pthread_mutex_lock(&devMutex);
+	if (dev == NULL) {
+		r = 1;
+	} else if (g == -10.0) {
+		r = SoapySDRDevice_setGainMode(dev, SOAPY_SDR_RX, 0, 1) != 0;
+	} else {
+		SoapySDRDevice_setGainMode(dev, SOAPY_SDR_RX, 0, 0);
+		r = SoapySDRDevice_setGain(dev, SOAPY_SDR_RX, 0, g) != 0;
+	}
+	if (r == 0)
+		gain = g;
+	pthread_mutex_unlock(&devMutex);
+	return r;
+}
+
 static void *readThreadEntryPoint(void *arg) {
 	int n;
 	int res = 0;
@@ -209,106 +254,133 @@ static void *readThreadEntryPoint(void *arg) {
 	long long timens = 0;
 	void* bufs[] = { soapyInBuf };
 
+	stageThread(STAGE_INPUT, "acarsdec-in");
 	SoapySDRDevice_activateStream(dev, stream, 0, 0, 0);
 
-	while(!signalExit) {
+	while(!signalExit && !soapyStop) {
 		pthread_mutex_lock(&cbMutex);
 		watchdogCounter = 50;
 		pthread_mutex_unlock(&cbMutex);
 
 		flags = 0;
 		res = SoapySDRDevice_readStream(dev, stream, bufs, soapyInBufSize/2, &flags, &timens, 10000000);
+		if(res == SOAPY_SDR_OVERFLOW) {
+			/* samples lost, the stream goes on */
+			METRIC_INC(metrics.inoverruns);
+			continue;
+		}
 		if(res <= 0) {
 			fprintf(stderr, "WARNING: Failed to read SoapySDR stream (%d): %s\n", res, SoapySDRDevice_lastError());
 			pthread_mutex_lock(&cbMutex);
-			signalExit = 1;
+			readEnded = 1;
 			pthread_mutex_unlock(&cbMutex);
 			return NULL;
 		}
 
-		int n, i;
-		int	local_ind;
-
-		for (n = 0; n < nbch; n++) {
-	   		local_ind = current_index;
-			channel_t *ch = &(channel[n]);
-			float complex D = ch->D;
-
-			for (i = 0; i < res*2; i+=2) {
-				float r = (float)soapyInBuf[i];
-				float g = (float)soapyInBuf[i+1];
-				float complex v = r + g*I;
-				D += v * ch->oscillator[local_ind++] / 32768.0;
-				if (local_ind >= rateMult) {
-					ch->dm_buffer[ch->counter++] = cabsf(D);
-					local_ind = 0;
-					D = 0;
-					if (ch->counter >= SOAPYOUTBUFSZ) {
-						demodMSK(ch, SOAPYOUTBUFSZ);
-						ch->counter = 0;
-					}
+		METRIC_INPUT();
+		PROBE1(input_block, res);
+
+		if (iqrecprefix)
+			IQrecput(soapyInBuf, res * 2 * sizeof(int16_t));
+
+		/* dropped while the survey or the hopping retunes, with the partial block of the old channels */
+		if ((surveyBand && surveyInput(res / rateMult)) || (hopDwell && hopInput(res / rateMult))) {
+			soapyVbInd = soapyDmInd = 0;
+			continue;
+		}
+
+		int i;
+
+		/* reads are not aligned on rateMult : keep the partial block in soapyVb */
+		for (i = 0; i < res*2; i+=2) {
+			soapyVb[soapyVbInd++] = (float)soapyInBuf[i] + (float)soapyInBuf[i+1] * I;
+			if (soapyVbInd >= rateMult) {
+				mixChan(soapyVb, soapyDmInd++);
+				soapyVbInd = 0;
+				if (soapyDmInd >= SOAPYOUTBUFSZ) {
+					demodChannels(SOAPYOUTBUFSZ);
+					soapyDmInd = 0;
 				}
 			}
-			ch->D = D;
 		}
-		current_index = (current_index + res) % rateMult;
 	}
 
 	pthread_mutex_lock(&cbMutex);
-	signalExit = 1;
+	readEnded = 1;
 	pthread_mutex_unlock(&cbMutex);
 	return NULL;
 }
 
-int runSoapySample(void)
+/* apply the tuner correction estimated from the decoded messages */
+static void soapyAutoPpm(void)
 {
-	pthread_t readThread;
-	pthread_create(&readThread, NULL, readThreadEntryPoint, NULL);
+	int p;
+
+	if (ppmUpdate(ppm, &p) == 0)
+		return;
+	if (SoapySDRDevice_setFrequencyCorrection(dev, SOAPY_SDR_RX, 0, p) != 0) {
+		fprintf(stderr, "WARNING: Failed to set freq. correction\n");
+		return;
+	}
+	ppm = p;
+	METRIC_SET(metrics.ppm, ppm);
+}
+
+/* wait up to 0.1s for the survey or the hopping to ask for another center frequency, and set it */
+static void soapyTune(void)
+{
+	unsigned int Fc = chanWaitTune(100);
+
+	if (Fc == 0)
+		return;
+	if (SoapySDRDevice_setFrequency(dev, SOAPY_SDR_RX, 0, Fc, NULL) != 0)
+		fprintf(stderr, "WARNING: Failed to set frequency: %s\n", SoapySDRDevice_lastError());
+	chanTuneDone(Fc);
+}
+
+/* control loop while the device streams : return 1 if it stopped sending data, 0 to exit */
+static int soapyWatch(void)
+{
+	int stalled = 0;
 
 	pthread_mutex_lock(&cbMutex);
+	watchdogCounter = 50;
 
 	while (!signalExit) {
-		if (--watchdogCounter <= 0) {
-			fprintf(stderr, "No data from SoapySDR for 5 seconds, exiting ...\n");
+		if (readEnded || --watchdogCounter <= 0) {
+			stalled = 1;
 			break;
 		}
 		pthread_mutex_unlock(&cbMutex);
-		usleep(100 * 1000); // 0.1 seconds
+		if (autoPpm)
+			soapyAutoPpm();
+		if (surveyBand && surveyOver()) {
+			pthread_mutex_lock(&cbMutex);
+			signalExit = 1;
+			break;
+		}
+		soapyTune(); // 0.1 seconds
 		pthread_mutex_lock(&cbMutex);
 	}
 
 	pthread_mutex_unlock(&cbMutex);
-
-	int count = 100; // 10 seconds
-	int err = 0;
-	// Wait on reader thread exit
-	while (count-- > 0 && (err = pthread_tryjoin_np(readThread, NULL))) {
-		usleep(100 * 1000); // 0.1 seconds
-	}
-	if (err) {
-		fprintf(stderr, "Receive thread termination failed, will raise SIGKILL to ensure we die!\n");
-		raise(SIGKILL);
-		return 1;
-	}
-	return 0;
+	return stalled;
 }
 
-int runSoapyClose(void) {
+/* with devMutex held */
+static int soapyCloseDev(void)
+{
 	int res = 0;
-	if (soapyInBuf) {
-		free(soapyInBuf);
-		soapyInBuf = NULL;
-	}
+
 	if (stream) {
-		res = SoapySDRDevice_closeStream(dev, stream);
-		stream = NULL;
+		res = SoapySDRDevice_deactivateStream(dev, stream, 0, 0);
 		if (res != 0)
-			fprintf(stderr, "WARNING: Failed to close SoapySDR stream: %s\n", SoapySDRDevice_lastError());
+			fprintf(stderr, "WARNING: Failed to deactivate SoapySDR stream: %s\n", SoapySDRDevice_lastError());
 
-		res = SoapySDRDevice_deactivateStream(dev, stream, 0, 0);
+		res = SoapySDRDevice_closeStream(dev, stream);
 		stream = NULL;
 		if (res != 0)
-			fprintf(stderr, "WARNING: Failed to deactivate SoapySDR stream: %s\n", SoapySDRDevice_lastError());
+			fprintf(stderr, "WARNING: Failed to close SoapySDR stream: %s\n", SoapySDRDevice_lastError());
 	}
 	if (dev) {
 		res = SoapySDRDevice_unmake(dev);
@@ -320,4 +392,106 @@ int runSoapyClose(void) {
 	return res;
 }
 
+/*
+ * the device stopped sending data : close it, and reopen it with a growing delay
+ * between tries, restarting the channels where they were. Return 1 to exit.
+ */
+static int soapyReopen(void)
+{
+	unsigned long long t0 = METRIC_GET(metrics.inputts);
+	int delay = 1;
+
+	if (t0 == 0)
+		t0 = monotonic_us();
+	METRIC_INC(metrics.outages);
+	METRIC_SET(metrics.outagets, t0);
+	pthread_mutex_lock(&devMutex);
+	soapyCloseDev();
+	pthread_mutex_unlock(&devMutex);
+
+	for (;;) {
+		int t, ok = 0;
+
+		fprintf(stderr, "Reopening the SDR in %ds ...\n", delay);
+		for (t = 0; t < delay * 10; t++) {
+			if (signalExit)
+				return 1;
+			usleep(100 * 1000);
+		}
+		pthread_mutex_lock(&devMutex);
+		if (soapyOpen() == 0) {
+			if (antenna)
+				soapySetAntenna(antenna);
+			ok = soapyStart(chanRestart()) == 0;
+			if (!ok)
+				soapyCloseDev();
+		}
+		pthread_mutex_unlock(&devMutex);
+		if (ok)
+			break;
+		if (delay < SOAPYRETRYMAX)
+			delay = delay * 2 < SOAPYRETRYMAX ? delay * 2 : SOAPYRETRYMAX;
+	}
+
+	/* the partial block was for the channels before the outage */
+	soapyVbInd = soapyDmInd = 0;
+	METRIC_ADD(metrics.outageus, monotonic_us() - t0);
+	METRIC_SET(metrics.outagets, 0);
+	fprintf(stderr, "SDR back after %.1fs without data\n", (monotonic_us() - t0) / 1e6);
+	return 0;
+}
+
+int runSoapySample(void)
+{
+	pthread_t readThread;
+
+	/* the tuner control loop */
+	stageThread(STAGE_AUX, NULL);
+
+	for (;;) {
+		int stalled;
+
+		soapyStop = readEnded = 0;
+		pthread_create(&readThread, NULL, readThreadEntryPoint, NULL);
+
+		stalled = soapyWatch();
+		if (stalled)
+			fprintf(stderr, "No data from SoapySDR for 5 seconds ...\n");
+		soapyStop = 1;
+
+		int count = 100; // 10 seconds
+		int err = 0;
+		// Wait on reader thread exit
+		while (count-- > 0 && (err = pthread_tryjoin_np(readThread, NULL))) {
+			usleep(100 * 1000); // 0.1 seconds
+		}
+		if (err) {
+			fprintf(stderr, "Receive thread termination failed, will raise SIGKILL to ensure we die!\n");
+			raise(SIGKILL);
+			return 1;
+		}
+
+		if (!stalled || soapyReopen())
+			break;
+	}
+	return 0;
+}
+
+int runSoapyClose(void) {
+	int res;
+
+	if (soapyInBuf) {
+		free(soapyInBuf);
+		soapyInBuf = NULL;
+	}
+	if (soapyVb) {
+		free(soapyVb);
+		soapyVb = NULL;
+	}
+	pthread_mutex_lock(&devMutex);
+	res = soapyCloseDev();
+	pthread_mutex_unlock(&devMutex);
+	return res;
+}
+
 #endif
@@ -20,9 +20,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
+#include <unistd.h>
 #include <pthread.h>
+#include <sys/stat.h>
 #include <sndfile.h>
 #include "acarsdec.h"
+#include "metrics.h"
 
 #define MAXNBFRAMES 4096
 static SNDFILE *insnd;
@@ -60,6 +64,7 @@ int runSoundfileSample(void)
 	int nbi, n, i;
 	sample_t sndbuff[MAXNBFRAMES * MAXNBCHANNELS];
 
+	stageThread(STAGE_INPUT, NULL);
 	do {
 
 		nbi = sf_read_float(insnd, sndbuff, MAXNBFRAMES * nbch);
@@ -67,19 +72,389 @@ int runSoundfileSample(void)
 		if (nbi == 0) {
 			return -1;
 		}
+		METRIC_INPUT();
 
 		for (n = 0; n < nbch; n++) {
 			int len = nbi / nbch;
 			for (i = 0; i < len; i++)
 				channel[n].dm_buffer[i]=sndbuff[n + i * nbch];
+		}
+		demodChannels(nbi / nbch);
+
+	} while (!signalExit);
+	return 0;
+}
+
+/*
+ * Batch decoding : many files, or segments of long files, are decoded in
+ * parallel by a pool of workers, each with its own set of channels.
+ * Segments are decoded with some overlap on both sides, so that the demodulator
+ * is settled at the segment start and frames crossing its end are complete.
+ * A frame belongs to the segment where its SOH is received.
+ * Messages are timestamped from the sample clock, taking the file modification
+ * time as the end of the recording, and are output in time order at the end.
+ */
+#define BATCHOVERLAP (3 * INTRATE)
+
+typedef struct {
+	char *filename;
+	int nbch;
+	struct timeval tvbase;
+	sf_count_t start, end;	/* frames owned by this job */
+	msgblk_t **blks;	/* valid messages */
+	int nbblks;
+} batchjob_t;
+
+static batchjob_t *batchjobs;
+static int nbbatchjobs;
+static int batchnext, batchdone;
+static unsigned long long batchsamples;
+
+int initBatch(char **argv, int optind)
+{
+	int f;
+
+	if (argv[optind] == NULL) {
+		fprintf(stderr, "Need at least one wav file after --batch\n");
+		return (1);
+	}
+
+	nbch = 0;
+	for (f = optind; argv[f]; f++) {
+		SF_INFO infsnd;
+		SNDFILE *snd;
+		struct stat st;
+		sf_count_t seg, start;
+		double t0;
 
-			demodMSK(&(channel[n]),len);
+		infsnd.format = 0;
+		snd = sf_open(argv[f], SFM_READ, &infsnd);
+		if (snd == NULL) {
+			fprintf(stderr, "could not open %s\n", argv[f]);
+			return (1);
 		}
+		sf_close(snd);
+		if (infsnd.channels > MAXNBCHANNELS) {
+			fprintf(stderr, "Too much input channels in %s : %d\n", argv[f], infsnd.channels);
+			return (1);
+		}
+		if (infsnd.samplerate != INTRATE) {
+			fprintf(stderr, "unsupported sample rate in %s : %d (must be %d)\n", argv[f], infsnd.samplerate, INTRATE);
+			return (1);
+		}
+		if (infsnd.channels > nbch)
+			nbch = infsnd.channels;
+
+		seg = (sf_count_t)batchSegment * INTRATE;
+		if (seg <= 0 || !infsnd.seekable)
+			seg = infsnd.frames;
+
+		if (stat(argv[f], &st))
+			st.st_mtime = 0;
+		t0 = st.st_mtime - (double)infsnd.frames / INTRATE;
+
+		start = 0;
+		do {
+			batchjob_t *job;
+
+			batchjobs = realloc(batchjobs, (nbbatchjobs + 1) * sizeof(batchjob_t));
+			if (batchjobs == NULL) {
+				fprintf(stderr, "ERROR : malloc\n");
+				return (1);
+			}
+			job = &(batchjobs[nbbatchjobs++]);
+			job->filename = argv[f];
+			job->nbch = infsnd.channels;
+			job->tvbase.tv_sec = floor(t0);
+			job->tvbase.tv_usec = (t0 - floor(t0)) * 1000000;
+			job->start = start;
+			job->end = start + seg;
+			job->blks = NULL;
+			job->nbblks = 0;
+			start += seg;
+		} while (start < infsnd.frames);
+	}
+
+	return (0);
+}
+
+static int cmpblk(const void *a, const void *b)
+{
+	const msgblk_t *ba = *(const msgblk_t **)a;
+	const msgblk_t *bb = *(const msgblk_t **)b;
+
+	if (ba->tv.tv_sec != bb->tv.tv_sec)
+		return ba->tv.tv_sec < bb->tv.tv_sec ? -1 : 1;
+	if (ba->tv.tv_usec != bb->tv.tv_usec)
+		return ba->tv.tv_usec < bb->tv.tv_usec ? -1 : 1;
+	return ba->chn - bb->chn;
+}
+
+static void batchkeep(batchjob_t *job, msgblk_t *blk, const struct timeval *tvs, const struct timeval *tve)
+{
+	if (timercmp(&(blk->tv), tvs, <) || !timercmp(&(blk->tv), tve, <)
+	    || fixAcars(blk)) {
+		free(blk);
+		return;
+	}
+	if ((job->nbblks & 255) == 0)
+		job->blks = realloc(job->blks, (job->nbblks + 256) * sizeof(msgblk_t *));
+	job->blks[job->nbblks++] = blk;
+}
+
+static void batchtime(const batchjob_t *job, sf_count_t smp, struct timeval *tv)
+{
+	unsigned long long us = smp * 1000000ULL / INTRATE + job->tvbase.tv_usec;
+
+	tv->tv_sec = job->tvbase.tv_sec + us / 1000000;
+	tv->tv_usec = us % 1000000;
+}
+
+static void decodejob(batchjob_t *job, channel_t *chs, sample_t *sndbuff)
+{
+	SF_INFO infsnd;
+	SNDFILE *snd;
+	sf_count_t from, to, pos;
+	struct timeval tvs, tve;
+	int n, i;
+
+	infsnd.format = 0;
+	snd = sf_open(job->filename, SFM_READ, &infsnd);
+	if (snd == NULL) {
+		fprintf(stderr, "could not open %s\n", job->filename);
+		return;
+	}
+
+	from = job->start > BATCHOVERLAP ? job->start - BATCHOVERLAP : 0;
+	to = job->end + BATCHOVERLAP;
+	if (from && sf_seek(snd, from, SEEK_SET) < 0) {
+		fprintf(stderr, "could not seek in %s\n", job->filename);
+		sf_close(snd);
+		return;
+	}
+
+	for (n = 0; n < job->nbch; n++) {
+		channel_t *ch = &(chs[n]);
+
+		ch->chn = n;
+		ch->Fr = 0;
+		initMsk(ch);
+		ch->MskLvlSum = 0;
+		ch->MskBitCount = 0;
+		ch->outbits = 0;
+		ch->nbits = 8;
+		ch->Acarsstate = WSYN;
+		ch->blk = NULL;
+		ch->batch = 1;
+		ch->smpcnt = from;
+		ch->tvbase = job->tvbase;
+		ch->blkl = NULL;
+	}
+
+	for (pos = from; pos < to && !signalExit;) {
+		sf_count_t nbf = to - pos < MAXNBFRAMES ? to - pos : MAXNBFRAMES;
+
+		nbf = sf_readf_float(snd, sndbuff, nbf);
+		if (nbf <= 0)
+			break;
+
+		for (n = 0; n < job->nbch; n++) {
+			for (i = 0; i < nbf; i++)
+				chs[n].dm_buffer[i] = sndbuff[n + i * job->nbch];
+
+			demodMSK(&(chs[n]), nbf);
+		}
+		pos += nbf;
+		__atomic_add_fetch(&batchsamples, nbf * job->nbch, __ATOMIC_RELAXED);
+	}
+	sf_close(snd);
 
-	} while (1);
+	/* keep the frames starting in this job, error corrected */
+	batchtime(job, job->start, &tvs);
+	batchtime(job, job->end, &tve);
+	for (n = 0; n < job->nbch; n++) {
+		channel_t *ch = &(chs[n]);
+
+		while (ch->blkl) {
+			msgblk_t *blk = ch->blkl;
+
+			ch->blkl = blk->prev;
+			batchkeep(job, blk, &tvs, &tve);
+		}
+		free(ch->blk);
+		free(ch->inb);
+	}
+	qsort(job->blks, job->nbblks, sizeof(msgblk_t *), cmpblk);
+}
+
+static void *batch_thread(void *arg)
+{
+	channel_t *chs;
+	sample_t *sndbuff;
+	int j, n;
+
+	stageThread(-1, "acarsdec-batch");
+	chs = calloc(MAXNBCHANNELS, sizeof(channel_t));
+	sndbuff = malloc(MAXNBFRAMES * MAXNBCHANNELS * sizeof(sample_t));
+	if (chs == NULL || sndbuff == NULL) {
+		fprintf(stderr, "ERROR : malloc\n");
+		signalExit = 1;
+		return NULL;
+	}
+	for (n = 0; n < MAXNBCHANNELS; n++) {
+		chs[n].dm_buffer = malloc(MAXNBFRAMES * sizeof(float));
+		if (chs[n].dm_buffer == NULL) {
+			fprintf(stderr, "ERROR : malloc\n");
+			signalExit = 1;
+			return NULL;
+		}
+	}
+
+	while ((j = __atomic_fetch_add(&batchnext, 1, __ATOMIC_RELAXED)) < nbbatchjobs && !signalExit) {
+		decodejob(&(batchjobs[j]), chs, sndbuff);
+		__atomic_add_fetch(&batchdone, 1, __ATOMIC_RELEASE);
+	}
+
+	for (n = 0; n < MAXNBCHANNELS; n++)
+		free(chs[n].dm_buffer);
+	free(chs);
+	free(sndbuff);
+	return NULL;
+}
+
+int runBatch(void)
+{
+	struct timespec start, now;
+	int nbth, t, j, n, nbmsg, tick;
+	msgblk_t **blks;
+	double elapsed;
+
+	nbth = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nbth < 1)
+		nbth = 1;
+	if (nbth > nbbatchjobs)
+		nbth = nbbatchjobs;
+
+	if (verbose)
+		fprintf(stderr, "batch: %d jobs on %d threads\n", nbbatchjobs, nbth);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pthread_t th[nbth];
+	for (t = 0; t < nbth; t++)
+		pthread_create(&th[t], NULL, batch_thread, NULL);
+
+	/* progress report, every 5s */
+	for (tick = 1; __atomic_load_n(&batchdone, __ATOMIC_ACQUIRE) < nbbatchjobs && !signalExit; tick++) {
+		usleep(100000);
+		if (tick % 50)
+			continue;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = now.tv_sec - start.tv_sec + (now.tv_nsec - start.tv_nsec) / 1e9;
+		fprintf(stderr, "batch: %d/%d jobs, %llu samples, %.0f samples/s (%.0fx real time)\n",
+			__atomic_load_n(&batchdone, __ATOMIC_RELAXED), nbbatchjobs, batchsamples,
+			batchsamples / elapsed, batchsamples / elapsed / INTRATE / nbch);
+	}
+
+	for (t = 0; t < nbth; t++)
+		pthread_join(th[t], NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = now.tv_sec - start.tv_sec + (now.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "batch: %d jobs, %llu samples in %.1fs, %.0f samples/s\n",
+		nbbatchjobs, batchsamples, elapsed, batchsamples / elapsed);
+
+	/* merge all messages in time order */
+	nbmsg = 0;
+	for (j = 0; j < nbbatchjobs; j++)
+		nbmsg += batchjobs[j].nbblks;
+	blks = malloc((nbmsg + 1) * sizeof(msgblk_t *));
+	if (blks == NULL) {
+		fprintf(stderr, "ERROR : malloc\n");
+		return -1;
+	}
+	for (n = 0, j = 0; j < nbbatchjobs; j++) {
+		memcpy(&(blks[n]), batchjobs[j].blks, batchjobs[j].nbblks * sizeof(msgblk_t *));
+		n += batchjobs[j].nbblks;
+		free(batchjobs[j].blks);
+	}
+	qsort(blks, nbmsg, sizeof(msgblk_t *), cmpblk);
+
+	for (n = 0; n < nbmsg; n++) {
+		msgblk_t *blk = blks[n];
+
+		/* a frame right on a segment boundary could be decoded by both jobs */
+		if (n == 0 || blk->chn != blks[n - 1]->chn || blk->len != blks[n - 1]->len
+		    || blk->tv.tv_sec - blks[n - 1]->tv.tv_sec > 1
+		    || memcmp(blk->txt, blks[n - 1]->txt, blk->len))
+			outputmsg(blk);
+	}
+	for (n = 0; n < nbmsg; n++)
+		free(blks[n]);
+
+	free(blks);
+	free(batchjobs);
 	return 0;
 }
 
+/* per channel baseband recording, written from demodMSK */
+static SNDFILE *bbsnd[MAXNBCHANNELS];
+
+int initBBrec(char *prefix)
+{
+	SF_INFO infsnd;
+	char *filename;
+	int n;
+
+	filename = malloc(strlen(prefix) + 32);
+	if (filename == NULL)
+		return (1);
+
+	for (n = 0; n < nbch; n++) {
+		if (channel[n].Fr != 0)
+			sprintf(filename, "%s_%.3f.wav", prefix, channel[n].Fr / 1000000.0);
+		else
+			sprintf(filename, "%s_%d.wav", prefix, n);
+
+		memset(&infsnd, 0, sizeof(infsnd));
+		infsnd.format = SF_FORMAT_WAV | (bbFormat == BBFMT_PCM16 ? SF_FORMAT_PCM_16 : SF_FORMAT_FLOAT);
+		infsnd.samplerate = INTRATE;
+		infsnd.channels = 1;
+		bbsnd[n] = sf_open(filename, SFM_WRITE, &infsnd);
+		if (bbsnd[n] == NULL) {
+			fprintf(stderr, "could not open %s : %s\n", filename, sf_strerror(NULL));
+			free(filename);
+			return (1);
+		}
+		if (bbFormat == BBFMT_PCM16)
+			sf_command(bbsnd[n], SFC_SET_CLIPPING, NULL, SF_TRUE);
+		/* a readable file even if acarsdec is killed before BBrecclose */
+		sf_command(bbsnd[n], SFC_SET_UPDATE_HEADER_AUTO, NULL, SF_TRUE);
+		if (verbose)
+			fprintf(stderr, "Recording channel %d baseband to %s\n", n, filename);
+	}
+
+	free(filename);
+	return (0);
+}
+
+void BBrecwrite(channel_t *ch, int len)
+{
+	if (bbsnd[ch->chn])
+		sf_write_float(bbsnd[ch->chn], ch->dm_buffer, len);
+}
+
+void BBrecclose(void)
+{
+	int n;
+
+	for (n = 0; n < MAXNBCHANNELS; n++) {
+		if (bbsnd[n])
+			sf_close(bbsnd[n]);
+		bbsnd[n] = NULL;
+	}
+}
+
 #ifdef DEBUG
 static SNDFILE *outsnd;
 void initSndWrite(void)
@@ -0,0 +1,392 @@
+/*
+ *  Copyright (c) 2015 Thierry Leconte
+ *
+ *
+ *   This code is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Library General Public License version 2
+ *   published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Library General Public License for more details.
+ *
+ */
+
+/*
+ * --survey : find the active channels of a band, in place of scan.sh.
+ *
+ * The band is cut into candidate channels every 25kHz (or 8.33kHz), grouped
+ * in segments of up to MAXNBCHANNELS channels that fit in the input
+ * bandwidth. The tuner is set once per segment, and for surveyTime seconds
+ * all its channels are demodulated and decoded in parallel by the
+ * channelizer : mean power, noise floor, carrier duty, frames and frames
+ * with a good crc are kept for each of them (decoded messages are output as
+ * usual). Once every segment has been surveyed, a ranked channel plan is
+ * printed, and with --survey-best N decoding goes on with the N best
+ * channels that fit in one tuning.
+ *
+ * surveyInput is called by the input thread before each buffer : it changes
+ * the segment, and drops the buffers received while the front end control
+ * loop retunes the device (see chanTuneTo). The -R input has a fixed center
+ * frequency and is never retuned.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "acarsdec.h"
+
+typedef struct {
+	unsigned int fr;
+	int frames, valid;
+	float lvl, floor, duty;
+} cand_t;
+
+typedef struct {
+	int first, nb;
+	unsigned int Fc;
+} segment_t;
+
+/* tuning, dropping the first buffer after it, surveying, over, decoding the best channels */
+enum { SV_TUNE, SV_MUTE, SV_RUN, SV_OVER, SV_DONE };
+
+static cand_t *cands;
+static int nbcands;
+static segment_t *segs;
+static int nbsegs;
+static int svRate;
+static unsigned int svFixedFc;
+
+/* current segment (nbsegs for the final plan) : candidate of each channel, center frequency */
+static int svSeg;
+static int svCand[MAXNBCHANNELS];
+static int svNb;
+static unsigned int svFc;
+
+static int svState;
+static unsigned long svCount;
+static int svFrames[MAXNBCHANNELS], svValid[MAXNBCHANNELS];
+
+/* center frequency for nb sorted frequencies, 0 if they don't fit */
+static unsigned int segFc(const unsigned int *fr, int nb)
+{
+	int n;
+
+	if (svFixedFc) {
+		for (n = 0; n < nb; n++)
+			if (abs((int)fr[n] - (int)svFixedFc) > svRate / 2 - INTRATE)
+				return 0;
+		return svFixedFc;
+	}
+
+	return chanPlanFc(fr, nb, svRate);
+}
+
+static void setState(int s)
+{
+	__atomic_store_n(&svState, s, __ATOMIC_RELEASE);
+}
+
+static void selectSegment(int sg)
+{
+	int n;
+
+	svSeg = sg;
+	svNb = segs[sg].nb;
+	for (n = 0; n < svNb; n++)
+		svCand[n] = segs[sg].first + n;
+	svFc = segs[sg].Fc;
+	chanTuneTo(svFc);
+	setState(SV_TUNE);
+}
+
+/* the device is on svFc : restart the channels on the candidates of the segment */
+static void startSegment(void)
+{
+	int n;
+
+	for (n = 0; n < svNb; n++) {
+		channel[n].Fr = (float)cands[svCand[n]].fr;
+		channel[n].amdet = amDetector;
+		svFrames[n] = svValid[n] = 0;
+	}
+	nbch = svNb;
+	retuneChan(svFc);
+	for (n = 0; n < svNb; n++)
+		resetAcars(&(channel[n]));
+}
+
+static void endSegment(void)
+{
+	int n;
+
+	for (n = 0; n < svNb; n++) {
+		cand_t *c = &(cands[svCand[n]]);
+
+		chanEnergy(n, &(c->lvl), &(c->floor), &(c->duty));
+		c->frames = svFrames[n];
+		c->valid = svValid[n];
+	}
+	if (verbose)
+		fprintf(stderr, "survey segment %d/%d done\n", svSeg + 1, nbsegs);
+}
+
+/* most valid frames first, then most frames, then most carrier */
+static int cmpcand(const void *a, const void *b)
+{
+	const cand_t *x = &(cands[*(const int *)a]), *y = &(cands[*(const int *)b]);
+
+	if (x->valid != y->valid)
+		return y->valid - x->valid;
+	if (x->frames != y->frames)
+		return y->frames - x->frames;
+	return (y->duty > x->duty) - (y->duty < x->duty);
+}
+
+static void report(int *rk)
+{
+	int i, silent = 0;
+
+	for (i = 0; i < nbcands; i++)
+		rk[i] = i;
+	qsort(rk, nbcands, sizeof(int), cmpcand);
+
+	printf("\nSurvey of %d channels, %ds each\n", nbcands, surveyTime);
+	printf(" rank  freq MHz  frames   valid  carrier  level dB  floor dB\n");
+	for (i = 0; i < nbcands; i++) {
+		const cand_t *c = &(cands[rk[i]]);
+
+		if (c->frames == 0 && c->duty < 0.01) {
+			silent++;
+			continue;
+		}
+		printf("%5d  %8.4f  %6d  %6d  %6.1f%%  %8.1f  %8.1f\n", i + 1, c->fr / 1e6, c->frames, c->valid,
+		       c->duty * 100, c->lvl, c->floor);
+	}
+	printf("%d channels without traffic\n", silent);
+
+	printf("Channel plan :");
+	for (i = 0; i < nbcands && cands[rk[i]].valid; i++)
+		printf(" %.4f", cands[rk[i]].fr / 1e6);
+	printf("\n");
+	fflush(stdout);
+}
+
+/* the surveyBest best channels that fit in one tuning, in frequency order */
+static void bestPlan(const int *rk)
+{
+	unsigned int fr[MAXNBCHANNELS];
+	int cd[MAXNBCHANNELS];
+	int i, n, k, nb = 0;
+	unsigned int Fc = 0;
+
+	for (i = 0; i < nbcands && nb < surveyBest && nb < MAXNBCHANNELS && cands[rk[i]].valid; i++) {
+		unsigned int f = cands[rk[i]].fr, fc;
+
+		for (k = nb; k > 0 && fr[k - 1] > f; k--) {
+			fr[k] = fr[k - 1];
+			cd[k] = cd[k - 1];
+		}
+		fr[k] = f;
+		cd[k] = rk[i];
+		fc = segFc(fr, nb + 1);
+		if (fc == 0) {
+			/* does not fit with the better ones */
+			for (; k < nb; k++) {
+				fr[k] = fr[k + 1];
+				cd[k] = cd[k + 1];
+			}
+			continue;
+		}
+		Fc = fc;
+		nb++;
+	}
+
+	if (nb == 0) {
+		fprintf(stderr, "No channel with valid messages, survey over\n");
+		setState(SV_OVER);
+		return;
+	}
+
+	fprintf(stderr, "Decoding the %d best channels :", nb);
+	for (n = 0; n < nb; n++) {
+		svCand[n] = cd[n];
+		fprintf(stderr, " %.4f", fr[n] / 1e6);
+	}
+	fprintf(stderr, "\n");
+	svSeg = nbsegs;
+	svNb = nb;
+	svFc = Fc;
+	chanTuneTo(svFc);
+	setState(SV_TUNE);
+}
+
+/*
+ * parse surveyBand (f1:f2[:step], in MHz and kHz), build the candidates and their segments
+ * for an input at rate s/s, centered on fixedFc if it can't be tuned.
+ * Channels are set up for the largest segment, the first one is returned in Fc.
+ */
+int initSurvey(int rate, unsigned int fixedFc, unsigned int *Fc)
+{
+	double f1, f2, step = 25;
+	char *p;
+	int k, i, j, nbmax, maxnb = 0;
+
+	f1 = strtod(surveyBand, &p);
+	if (*p == ':')
+		f2 = strtod(p + 1, &p);
+	else
+		f2 = 0;
+	if (*p == ':')
+		step = strtod(p + 1, &p);
+	if (*p || f2 <= f1 || step <= 0) {
+		fprintf(stderr, "Invalid survey band %s (ie : 129.0:137.0 or 131.0:132.0:8.33)\n", surveyBand);
+		return 1;
+	}
+	step *= 1000;
+	/* 8.33kHz channels are 25kHz/3 apart */
+	if (fabs(step - 25000.0 / 3) < 10)
+		step = 25000.0 / 3;
+
+	svRate = rate;
+	svFixedFc = fixedFc;
+	nbmax = lrint((f2 - f1) * 1e6 / step) + 1;
+	cands = calloc(nbmax, sizeof(cand_t));
+	segs = calloc(nbmax, sizeof(segment_t));
+	if (cands == NULL || segs == NULL) {
+		fprintf(stderr, "ERROR : malloc\n");
+		return 1;
+	}
+
+	nbcands = 0;
+	for (k = 0; k < nbmax; k++) {
+		unsigned int fr = lrint(f1 * 1e6 + k * step);
+
+		if (fr < 118000000 || fr > 138000000)
+			continue;
+		if (fixedFc && abs((int)fr - (int)fixedFc) > rate / 2 - INTRATE)
+			continue;
+		cands[nbcands++].fr = fr;
+	}
+	if (nbcands == 0) {
+		fprintf(stderr, "No channel to survey in %s\n", surveyBand);
+		return 1;
+	}
+
+	nbsegs = 0;
+	for (i = 0; i < nbcands; i = j) {
+		unsigned int fr[MAXNBCHANNELS], fc = 0;
+
+		for (j = i; j < nbcands && j - i < MAXNBCHANNELS; j++) {
+			unsigned int f;
+
+			fr[j - i] = cands[j].fr;
+			f = segFc(fr, j - i + 1);
+			if (f == 0)
+				break;
+			fc = f;
+		}
+		if (j == i) {
+			fprintf(stderr, "Sample rate too low for the survey\n");
+			return 1;
+		}
+		segs[nbsegs].first = i;
+		segs[nbsegs].nb = j - i;
+		segs[nbsegs].Fc = fc;
+		nbsegs++;
+		if (j - i > maxnb)
+			maxnb = j - i;
+	}
+
+	/* the channels of the largest segment are allocated, the others use the first ones */
+	nbch = maxnb;
+	for (k = 0; k < maxnb; k++) {
+		channel[k].chn = k;
+		channel[k].Fr = (float)cands[k < segs[0].nb ? k : 0].fr;
+		channel[k].amdet = amDetector;
+	}
+
+	selectSegment(0);
+	*Fc = svFc;
+
+	fprintf(stderr, "Surveying %d channels from %.4f to %.4fMHz, in %d segments of %ds\n", nbcands,
+		cands[0].fr / 1e6, cands[nbcands - 1].fr / 1e6, nbsegs, surveyTime);
+	return 0;
+}
+
+/* input thread, before each buffer of len output samples : return 1 if it must be dropped */
+int surveyInput(int len)
+{
+	switch (svState) {
+	case SV_RUN:
+		svCount += len;
+		if (svCount < (unsigned long)surveyTime * INTRATE)
+			return 0;
+		endSegment();
+		if (svSeg + 1 < nbsegs) {
+			selectSegment(svSeg + 1);
+		} else {
+			int *rk = malloc(nbcands * sizeof(int));
+
+			if (rk == NULL) {
+				setState(SV_OVER);
+				return 1;
+			}
+			report(rk);
+			if (surveyBest)
+				bestPlan(rk);
+			else
+				setState(SV_OVER);
+			free(rk);
+		}
+		return 1;
+	case SV_TUNE:
+		if (!chanTuned())
+			return 1;
+		startSegment();
+		setState(SV_MUTE);
+		return 1;
+	case SV_MUTE:
+		/* samples from before the retune could still be in it */
+		svCount = 0;
+		setState(svSeg < nbsegs ? SV_RUN : SV_DONE);
+		return 1;
+	case SV_DONE:
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+/* once the input has stopped : report an unfinished survey, ie : at the end of a -R recording */
+void surveyFlush(void)
+{
+	int *rk;
+
+	if (svState != SV_RUN || svSeg >= nbsegs)
+		return;
+	endSegment();
+	rk = malloc(nbcands * sizeof(int));
+	if (rk == NULL)
+		return;
+	fprintf(stderr, "Survey interrupted in segment %d of %d\n", svSeg + 1, nbsegs);
+	report(rk);
+	free(rk);
+}
+
+/* input thread, at the end of each frame of channel chn */
+void surveyFrame(int chn, int crcok)
+{
+	if (svState == SV_RUN) {
+		svFrames[chn]++;
+		svValid[chn] += crcok;
+	}
+}
+
+/* the survey is done, and there is nothing left to decode */
+int surveyOver(void)
+{
+	return __atomic_load_n(&svState, __ATOMIC_ACQUIRE) == SV_OVER;
+}
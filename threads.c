@@ -0,0 +1,175 @@
+/*
+ *  Copyright (c) 2015 Thierry Leconte
+ *
+ *
+ *   This code is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Library General Public License version 2
+ *   published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Library General Public License for more details.
+ *
+ */
+
+/*
+ * --cpu, --rt and --nice : placement of the threads of each pipeline stage.
+ *   input  : the thread reading the device (and the rtl usb callbacks), that mixes,
+ *            demodulates and decodes the frames of all channels
+ *   output : error correction and output of the messages (blk_thread)
+ *   aux    : the tuner control loop, control socket, metrics, IQ record writer and reload
+ * Each thread calls stageThread once it runs, which also names it for top -H, perf, gdb ...
+ * A setting that fails (ie : SCHED_FIFO without CAP_SYS_NICE) is reported and the thread
+ * goes on without it.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include "acarsdec.h"
+
+typedef struct {
+	cpu_set_t cpus;
+	int setcpus;
+	int prio;		/* SCHED_FIFO priority, 0 for the default policy */
+	int nice;
+	int setnice;
+} stage_t;
+
+static stage_t stages[NBSTAGES];
+static const char *stagenames[NBSTAGES] = { "input", "output", "aux" };
+/*
+ * settings of the process at start, and which ones some stage changes : a thread inherits
+ * the placement of its creator (ie : the reader thread, created again after an outage, from
+ * the aux placed main thread), so a stage without a setting gets the default one back
+ */
+static stage_t defstage;
+static int anycpus, anyrt, anynice;
+
+static void savedefaults(void)
+{
+	static int saved = 0;
+
+	if (saved)
+		return;
+	saved = 1;
+	if (sched_getaffinity(0, sizeof(cpu_set_t), &(defstage.cpus)))
+		CPU_ZERO(&(defstage.cpus));
+	errno = 0;
+	defstage.nice = getpriority(PRIO_PROCESS, 0);
+	if (errno)
+		defstage.nice = 0;
+}
+
+/* stage of "stage:value", its value in *val */
+static int parsestage(char *arg, char **val)
+{
+	char *p = strchr(arg, ':');
+	int s;
+
+	if (p == NULL)
+		return -1;
+	for (s = 0; s < NBSTAGES; s++)
+		if (strlen(stagenames[s]) == (size_t)(p - arg) && strncmp(arg, stagenames[s], p - arg) == 0) {
+			*val = p + 1;
+			return s;
+		}
+	return -1;
+}
+
+/* --cpu stage:cpus, cpus as 2 or 0,2-3 */
+int stageCpus(char *arg)
+{
+	char *p;
+	int s = parsestage(arg, &p);
+
+	if (s < 0)
+		return 1;
+	savedefaults();
+	CPU_ZERO(&(stages[s].cpus));
+	do {
+		long c1, c2;
+
+		c1 = c2 = strtol(p, &p, 10);
+		if (*p == '-')
+			c2 = strtol(p + 1, &p, 10);
+		if (c1 < 0 || c2 < c1 || c2 >= CPU_SETSIZE || (*p && *p != ','))
+			return 1;
+		for (; c1 <= c2; c1++)
+			CPU_SET(c1, &(stages[s].cpus));
+	} while (*p++ == ',');
+	stages[s].setcpus = anycpus = 1;
+	return 0;
+}
+
+/* --rt stage:prio, SCHED_FIFO priority */
+int stageRt(char *arg)
+{
+	char *p;
+	int s = parsestage(arg, &p);
+
+	if (s < 0)
+		return 1;
+	savedefaults();
+	stages[s].prio = atoi(p);
+	if (stages[s].prio < sched_get_priority_min(SCHED_FIFO) || stages[s].prio > sched_get_priority_max(SCHED_FIFO))
+		return 1;
+	anyrt = 1;
+	return 0;
+}
+
+/* --nice stage:n */
+int stageNice(char *arg)
+{
+	char *p;
+	int s = parsestage(arg, &p);
+
+	if (s < 0)
+		return 1;
+	savedefaults();
+	stages[s].nice = atoi(p);
+	if (stages[s].nice < -20 || stages[s].nice > 19)
+		return 1;
+	stages[s].setnice = anynice = 1;
+	return 0;
+}
+
+/* called by a thread of stage (-1 for none) when it starts : name it (unless NULL) and place it */
+void stageThread(int stage, const char *name)
+{
+	stage_t *st;
+	int r;
+
+	if (name)
+		pthread_setname_np(pthread_self(), name);
+	if (stage < 0)
+		return;
+	st = &(stages[stage]);
+
+	if (st->setcpus || (anycpus && CPU_COUNT(&(defstage.cpus)))) {
+		r = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), st->setcpus ? &(st->cpus) : &(defstage.cpus));
+		if (r)
+			fprintf(stderr, "WARNING: Failed to set the cpus of the %s thread: %s\n", stagenames[stage], strerror(r));
+	}
+	if (st->prio || anyrt) {
+		struct sched_param sp = { .sched_priority = st->prio };
+
+		r = pthread_setschedparam(pthread_self(), st->prio ? SCHED_FIFO : SCHED_OTHER, &sp);
+		if (r)
+			fprintf(stderr, "WARNING: Failed to set the %s thread real time: %s\n", stagenames[stage], strerror(r));
+	}
+	/* per thread on linux */
+	if ((st->setnice || anynice) && setpriority(PRIO_PROCESS, syscall(SYS_gettid), st->setnice ? st->nice : defstage.nice))
+		fprintf(stderr, "WARNING: Failed to set the nice value of the %s thread: %s\n", stagenames[stage], strerror(errno));
+
+	if (verbose && (st->setcpus || st->prio || st->setnice))
+		fprintf(stderr, "%s thread placed\n", name ? name : stagenames[stage]);
+}